@@ -5,33 +5,36 @@
 #include "decl.h"
 #include "lib.h"
 #include "parse.h"
+#include "frag.h"
+#include "expr.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
 
+// Code and data go into the current section's buffer, stored little-endian
 void emit8(uint8_t v)
 {
-    fwrite(&v, 1, 1, g_outf);
+    *sect_reserve(g_currsect, 1) = v;
 }
 
 void emit16(uint16_t v)
 {
-    emit8(v & 0xff);
-    emit8(v >> 8);
+    uint8_t *p = sect_reserve(g_currsect, 2);
+    for (int i = 0; i < 2; i++) p[i] = v >> (i * 8);
 }
 
 void emit32(uint32_t v)
 {
-    emit16(v & 0xffff);
-    emit16(v >> 16);
+    uint8_t *p = sect_reserve(g_currsect, 4);
+    for (int i = 0; i < 4; i++) p[i] = v >> (i * 8);
 }
 
 void emit64(uint64_t v)
 {
-    emit32(v & 0xffffffff);
-    emit32(v >> 32);
+    uint8_t *p = sect_reserve(g_currsect, 8);
+    for (int i = 0; i < 8; i++) p[i] = v >> (i * 8);
 }
 
 void emit(int size, uint64_t v)
@@ -45,128 +48,119 @@ void emit(int size, uint64_t v)
     }
 }
 
-void assemble_file()
-{
-    char *line = NULL;
-    size_t n = 0;
-
-    uint64_t lc = 0;
-
-    g_currsect = NULL;
-
-    elf_begin_file();
+// Recommended multi-byte NOPs, s_nops[n - 1] is n bytes long
+static const uint8_t s_nops[][9] = {
+    { 0x90 },
+    { 0x66, 0x90 },
+    { 0x0f, 0x1f, 0x00 },
+    { 0x0f, 0x1f, 0x40, 0x00 },
+    { 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+    { 0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00 },
+    { 0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00 },
+    { 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+    { 0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00 },
+};
 
-    while (getline(&line, &n, g_inf) != -1)
+// Pad with as few NOPs as possible. The ModRM forms decode to other
+// lengths in 16-bit mode, so there it's single-byte NOPs
+static void emitnops(size_t n)
+{
+    size_t max = g_currsize == 16 ? 1 : ARRLEN(s_nops);
+    while (n)
     {
-        if (*line == '\n') continue;
-        if (isalpha(*line) || *line == '_') continue;
+        size_t len = n < max ? n : max;
+        memcpy(sect_reserve(g_currsect, len), s_nops[len - 1], len);
+        n -= len;
+    }
+}
 
-        char *strt = *line == '\t' ? line + 1 : line + 4;
-        if (*strt == '.')
-        {
-            char *direct = strndup(strt, strchr(strt, ' ') - strt);
-            if (!strcmp(direct, ".section"))
-            {
-                strt += strlen(direct) + 1;
-                char *name = strndup(strt, strchr(strt, '\n') - strt);
-           
-                if (g_currsect) g_currsect->size = ftell(g_outf) - g_currsect->offset;
-
-                g_currsect = findsect(name);
-                g_currsect->offset += 64; // sizeof(Elf64_Ehdr) TODO: don't do this
-
-                struct symbol sym = {
-                    .name = name,
-                    .flags = SYM_SECT,
-                    .sect = g_currsect
-                };
-                addsym(&sym);
-            }
-            else if (!strcmp(direct, ".global"))
-            {
-                strt += strlen(direct) + 1;
-                char *name = strndup(strt, strchr(strt, '\n') - strt);
+// 'n' zero bytes, a .bss section only counts them
+static void emitzeros(size_t n)
+{
+    if (g_currsect->nobits) g_currsect->size += n;
+    else memset(sect_reserve(g_currsect, n), 0, n);
+}
 
-                findsym(name)->flags |= SYM_GLOB;
+// A value of 'size' bytes, relocated against its symbol if it has one. 32-bit values
+// in instructions are sign-extended (REL_32S), in data they're not (REL_32)
+static void emitvalue(int size, struct value v, int rel32)
+{
+    if (v.sym)
+    {
+        int type = size == 1 ? REL_8
+                 : size == 2 ? REL_16
+                 : size == 4 ? rel32
+                 : REL_64;
 
-                free(name);
-            }
-            else if (!strncmp(strt, ".type", 5))
-            {
-                char *sym = strt + 6;
-                *strchr(sym, ',') = 0;
+        sect_add_reloc(g_currsect, g_currsect->size, v.sym, v.val, type);
+        v.val = 0;
+    }
 
-                char *type = sym + strlen(sym) + 2;
-                *strchr(type, '\n') = 0;
+    emit(size * 8, v.val);
+}
 
-                findsym(sym)->type = symtypestr(type);
-            }
-            else if (!strncmp(strt, ".size", 5))
-            {
-                char *sym = strt + 6;
-                *strchr(sym, ',') = 0;
+// Encode the parsed fragments, layout() has given every label its value
+void assemble_file()
+{
+    uint64_t lc = 0;
 
-                char *size = sym + strlen(sym) + 2;
-                findsym(sym)->size = xstrtonum(size, NULL);
-            }
-            else if (!strcmp(direct, ".str"))
-            {
-                strt += strlen(direct) + 2;
-                char *str = stresc(strt, '"', NULL);
+    g_currsect = NULL;
 
-                fputs(str, g_outf);
-                fputc(0, g_outf);
+    elf_begin_file();
 
-                free(str);
-            }
-            else if (!strcmp(direct, ".byte"))
-            {
-                strt += strlen(direct) + 1;
-                emit8(xstrtonum(strt, NULL));
-            }
-            else if (!strcmp(direct, ".word"))
-            {
-                strt += strlen(direct) + 1;
-                emit16(xstrtonum(strt, NULL));
-            }
-            else if (!strcmp(direct, ".long"))
-            {
-                strt += strlen(direct) + 1;
-                emit32(xstrtonum(strt, NULL));
-            }
-            else if (!strcmp(direct, ".quad"))
-            {
-                strt += strlen(direct) + 1;
-                emit64(xstrtonum(strt, NULL));
-            }
-            else if (!strcmp(direct, ".skip"))
+    for (size_t i = 0; i < g_fragcnt; i++)
+    {
+        struct frag *frag = &g_frags[i];
+        switch (frag->type)
+        {
+            case FRAG_SECT:
+                g_currsect = frag->sect;
+                lc = g_currsect->size;
+                break;
+
+            case FRAG_MODE:
+                g_currsize = frag->mode;
+                break;
+
+            case FRAG_DATA:
+                if (frag->data) memcpy(sect_reserve(g_currsect, frag->size), frag->data, frag->size);
+                else emitzeros(frag->size);
+                lc += frag->size;
+                break;
+
+            case FRAG_ALIGN:
+                if (frag->align.fill < 0 && !strncmp(g_currsect->name, ".text", 5)) emitnops(frag->size);
+                else if (frag->align.fill <= 0) emitzeros(frag->size);
+                else memset(sect_reserve(g_currsect, frag->size), frag->align.fill, frag->size);
+                lc += frag->size;
+                break;
+
+            case FRAG_EXPR:
+                emitvalue(frag->size, eval_expr(frag->expr, frag->off), REL_32);
+                lc += frag->size;
+                break;
+
+            case FRAG_SIZE:
             {
-                strt += strlen(direct) + 1;
-                size_t s = xstrtonum(strt, NULL);
-
-                for (size_t i = 0; i < s; i++)
-                    emit8(0);
+                struct value v = eval_expr(frag->symsize.expr, frag->off);
+                if (v.sym)
+                    error("Line %d: Size of '%s' is not a constant\n", frag->lineno, frag->symsize.sym->name);
+                frag->symsize.sym->size = v.val;
+                break;
             }
-            else if (!strcmp(direct, ".code16"))
-                g_currsize = 16;
-            else if (!strcmp(direct, ".code64"))
-                g_currsize = 64;
 
-            free(direct);
-            continue;
+            case FRAG_INST:
+                lc += frag->size;
+                if (frag->inst.jshort)
+                {
+                    emit8(frag->inst.inst->sopcode);
+                    emit8(eval_expr(frag->inst.code.op1.expr, frag->off).val - lc);
+                }
+                else assemble(&frag->inst.code, frag->inst.inst, lc);
+                break;
         }
-
-        struct code code = parse_code(strt);
-        struct inst *ent = searchi(&code);
-        if (!ent)
-            error("Invalid instruction\n");
-
-        lc += instsize(ent, &code);
-
-        assemble(&code, ent, lc);
     }
 
-    if (g_currsect) g_currsect->size = ftell(g_outf) - g_currsect->offset;
     elf_end_file();
 }
 
@@ -230,6 +224,8 @@ static struct inst s_insttbl[] = {
     { .mnem = "imul", .opcode = 0xf6, .op1 = OP_RM | OP_SIZE8, .reg = 5 },
     { .mnem = "imul", .opcode = 0xf7, .op1 = OP_RM | OP_SZEX8, .reg = 5 },
     { .mnem = "imul", .pre = 0x0f, .opcode = 0xaf, .op1 = OP_RM | OP_SZEX8, .op2 = OP_REG | OP_SZEX8, .reg = -1  },
+    { .mnem = "imul", .opcode = 0x6b, .op1 = OP_IMM | OP_SIZE8, .op2 = OP_RM | OP_SZEX8, .op3 = OP_REG | OP_SZEX8, .reg = -1 },
+    { .mnem = "imul", .opcode = 0x69, .op1 = OP_IMM | OP_SIZE16 | OP_SIZE32, .op2 = OP_RM | OP_SZEX8, .op3 = OP_REG | OP_SZEX8, .reg = -1 },
 
     { .mnem = "div", .opcode = 0xf6, .op1 = OP_RM | OP_SIZE8, .reg = 6 },
     { .mnem = "div", .opcode = 0xf7, .op1 = OP_RM | OP_SZEX8, .reg = 6 },
@@ -265,7 +261,7 @@ static struct inst s_insttbl[] = {
     { .mnem = "mov", .opcode = 0xc6, .op1 = OP_IMM | OP_SIZE8, .op2 = OP_RM | OP_SIZE8, .reg = 0 },
     { .mnem = "mov", .opcode = 0xc7, .op1 = OP_IMM | OP_SIZE16, .op2 = OP_RM | OP_SIZE16, .reg = 0 },
     { .mnem = "mov", .opcode = 0xc7, .op1 = OP_IMM | OP_SIZE32, .op2 = OP_RM | OP_SIZE32, .reg = 0 },
-    { .mnem = "mov", .opcode = 0xc7, .op1 = OP_IMM | OP_SIZE64, .op2 = OP_RM | OP_SIZE64, .reg = 0 },
+    { .mnem = "mov", .opcode = 0xc7, .op1 = OP_IMM | OP_SIZE32, .op2 = OP_RM | OP_SIZE64, .reg = 0 }, // Sign-extended
 
     { .mnem = "movzx", .pre = 0x0f, .opcode = 0xb6, .op1 = OP_RM | OP_SIZE8,  .op2 = OP_REG | OP_SZEX8, .reg = -1 },
     { .mnem = "movzx", .pre = 0x0f, .opcode = 0xb7, .op1 = OP_RM | OP_SIZE16, .op2 = OP_REG | OP_SZEX8, .reg = -1 },
@@ -275,26 +271,130 @@ static struct inst s_insttbl[] = {
 
     // Jump & Conditional jumps
     
-    // No short jump, complicates things too much
-    { .mnem = "jmp", .opcode = 0xe9, .op1 = OP_IMM | OP_SIZE16 | OP_SIZE32, .reg = -1, .flags = IF_REL },
+    // layout() relaxes a branch to its rel8 form (sopcode) when the target is close enough
+    { .mnem = "jmp", .opcode = 0xe9, .sopcode = 0xeb, .op1 = OP_IMM | OP_SIZE16 | OP_SIZE32, .reg = -1, .flags = IF_REL },
     
-    { .mnem = "jz",  .pre = 0x0f, .opcode = 0x84, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
-    { .mnem = "jnz", .pre = 0x0f, .opcode = 0x85, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
-    { .mnem = "js",  .pre = 0x0f, .opcode = 0x88, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
-    { .mnem = "jl",  .pre = 0x0f, .opcode = 0x8c, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
-    { .mnem = "jge", .pre = 0x0f, .opcode = 0x8d, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
-    { .mnem = "jle", .pre = 0x0f, .opcode = 0x8e, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
-    { .mnem = "jg",  .pre = 0x0f, .opcode = 0x8f, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
+    { .mnem = "jz",  .pre = 0x0f, .opcode = 0x84, .sopcode = 0x74, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
+    { .mnem = "je",  .pre = 0x0f, .opcode = 0x84, .sopcode = 0x74, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
+    { .mnem = "jnz", .pre = 0x0f, .opcode = 0x85, .sopcode = 0x75, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
+    { .mnem = "jne", .pre = 0x0f, .opcode = 0x85, .sopcode = 0x75, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
+    { .mnem = "jb",  .pre = 0x0f, .opcode = 0x82, .sopcode = 0x72, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
+    { .mnem = "jae", .pre = 0x0f, .opcode = 0x83, .sopcode = 0x73, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
+    { .mnem = "jbe", .pre = 0x0f, .opcode = 0x86, .sopcode = 0x76, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
+    { .mnem = "ja",  .pre = 0x0f, .opcode = 0x87, .sopcode = 0x77, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
+    { .mnem = "js",  .pre = 0x0f, .opcode = 0x88, .sopcode = 0x78, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
+    { .mnem = "jp",  .pre = 0x0f, .opcode = 0x8a, .sopcode = 0x7a, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
+    { .mnem = "jnp", .pre = 0x0f, .opcode = 0x8b, .sopcode = 0x7b, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
+    { .mnem = "jl",  .pre = 0x0f, .opcode = 0x8c, .sopcode = 0x7c, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
+    { .mnem = "jge", .pre = 0x0f, .opcode = 0x8d, .sopcode = 0x7d, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
+    { .mnem = "jle", .pre = 0x0f, .opcode = 0x8e, .sopcode = 0x7e, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
+    { .mnem = "jg",  .pre = 0x0f, .opcode = 0x8f, .sopcode = 0x7f, .op1 = OP_IMM | OP_SIZE32, .reg = -1, .flags = IF_REL },
 
     // Set on condition
     { .mnem = "setz",  .pre = 0x0f, .opcode = 0x94, .op1 = OP_RM | OP_SIZE8, .reg = 0 },
+    { .mnem = "sete",  .pre = 0x0f, .opcode = 0x94, .op1 = OP_RM | OP_SIZE8, .reg = 0 },
     { .mnem = "setnz", .pre = 0x0f, .opcode = 0x95, .op1 = OP_RM | OP_SIZE8, .reg = 0 },
+    { .mnem = "setne", .pre = 0x0f, .opcode = 0x95, .op1 = OP_RM | OP_SIZE8, .reg = 0 },
+    { .mnem = "setb",  .pre = 0x0f, .opcode = 0x92, .op1 = OP_RM | OP_SIZE8, .reg = 0 },
+    { .mnem = "setae", .pre = 0x0f, .opcode = 0x93, .op1 = OP_RM | OP_SIZE8, .reg = 0 },
+    { .mnem = "setbe", .pre = 0x0f, .opcode = 0x96, .op1 = OP_RM | OP_SIZE8, .reg = 0 },
+    { .mnem = "seta",  .pre = 0x0f, .opcode = 0x97, .op1 = OP_RM | OP_SIZE8, .reg = 0 },
     { .mnem = "sets",  .pre = 0x0f, .opcode = 0x98, .op1 = OP_RM | OP_SIZE8, .reg = 0 },
+    { .mnem = "setp",  .pre = 0x0f, .opcode = 0x9a, .op1 = OP_RM | OP_SIZE8, .reg = 0 },
+    { .mnem = "setnp", .pre = 0x0f, .opcode = 0x9b, .op1 = OP_RM | OP_SIZE8, .reg = 0 },
     { .mnem = "setl",  .pre = 0x0f, .opcode = 0x9c, .op1 = OP_RM | OP_SIZE8, .reg = 0 },
     { .mnem = "setge", .pre = 0x0f, .opcode = 0x9d, .op1 = OP_RM | OP_SIZE8, .reg = 0 },
     { .mnem = "setle", .pre = 0x0f, .opcode = 0x9e, .op1 = OP_RM | OP_SIZE8, .reg = 0 },
     { .mnem = "setg",  .pre = 0x0f, .opcode = 0x9f, .op1 = OP_RM | OP_SIZE8, .reg = 0 },
 
+    // Bit test and complement
+    { .mnem = "btc", .pre = 0x0f, .opcode = 0xba, .op1 = OP_IMM | OP_SIZE8, .op2 = OP_RM | OP_SZEX8, .reg = 7 },
+
+    // SSE2 scalar floating-point. The mandatory prefix picks the type: none
+    // or 0x66 for packed single/double, 0xf3 for scalar single, 0xf2 for
+    // scalar double
+    { .mnem = "movss", .mpre = 0xf3, .pre = 0x0f, .opcode = 0x10, .op1 = OP_XMMRM,  .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "movss", .mpre = 0xf3, .pre = 0x0f, .opcode = 0x11, .op1 = OP_XMMREG, .op2 = OP_XMMRM,  .reg = -1 },
+    { .mnem = "movsd", .mpre = 0xf2, .pre = 0x0f, .opcode = 0x10, .op1 = OP_XMMRM,  .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "movsd", .mpre = 0xf2, .pre = 0x0f, .opcode = 0x11, .op1 = OP_XMMREG, .op2 = OP_XMMRM,  .reg = -1 },
+    { .mnem = "movaps", .pre = 0x0f, .opcode = 0x28, .op1 = OP_XMMRM,  .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "movaps", .pre = 0x0f, .opcode = 0x29, .op1 = OP_XMMREG, .op2 = OP_XMMRM,  .reg = -1 },
+    { .mnem = "movapd", .mpre = 0x66, .pre = 0x0f, .opcode = 0x28, .op1 = OP_XMMRM,  .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "movapd", .mpre = 0x66, .pre = 0x0f, .opcode = 0x29, .op1 = OP_XMMREG, .op2 = OP_XMMRM,  .reg = -1 },
+
+    // Between XMM and general purpose registers, movq gets REX.W from its operand
+    { .mnem = "movd", .mpre = 0x66, .pre = 0x0f, .opcode = 0x6e, .op1 = OP_RM | OP_SIZE32, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "movd", .mpre = 0x66, .pre = 0x0f, .opcode = 0x7e, .op1 = OP_XMMREG, .op2 = OP_RM | OP_SIZE32, .reg = -1 },
+    { .mnem = "movq", .mpre = 0x66, .pre = 0x0f, .opcode = 0x6e, .op1 = OP_RM | OP_SIZE64, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "movq", .mpre = 0x66, .pre = 0x0f, .opcode = 0x7e, .op1 = OP_XMMREG, .op2 = OP_RM | OP_SIZE64, .reg = -1 },
+
+    { .mnem = "addss",  .mpre = 0xf3, .pre = 0x0f, .opcode = 0x58, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "addsd",  .mpre = 0xf2, .pre = 0x0f, .opcode = 0x58, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "mulss",  .mpre = 0xf3, .pre = 0x0f, .opcode = 0x59, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "mulsd",  .mpre = 0xf2, .pre = 0x0f, .opcode = 0x59, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "subss",  .mpre = 0xf3, .pre = 0x0f, .opcode = 0x5c, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "subsd",  .mpre = 0xf2, .pre = 0x0f, .opcode = 0x5c, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "divss",  .mpre = 0xf3, .pre = 0x0f, .opcode = 0x5e, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "divsd",  .mpre = 0xf2, .pre = 0x0f, .opcode = 0x5e, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "sqrtss", .mpre = 0xf3, .pre = 0x0f, .opcode = 0x51, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "sqrtsd", .mpre = 0xf2, .pre = 0x0f, .opcode = 0x51, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "xorps",  .pre = 0x0f, .opcode = 0x57, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "xorpd",  .mpre = 0x66, .pre = 0x0f, .opcode = 0x57, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+
+    { .mnem = "ucomiss", .pre = 0x0f, .opcode = 0x2e, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "ucomisd", .mpre = 0x66, .pre = 0x0f, .opcode = 0x2e, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+
+    { .mnem = "cvtsi2ss",  .mpre = 0xf3, .pre = 0x0f, .opcode = 0x2a, .op1 = OP_RM | OP_SIZE32 | OP_SIZE64, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "cvtsi2sd",  .mpre = 0xf2, .pre = 0x0f, .opcode = 0x2a, .op1 = OP_RM | OP_SIZE32 | OP_SIZE64, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "cvttss2si", .mpre = 0xf3, .pre = 0x0f, .opcode = 0x2c, .op1 = OP_XMMRM, .op2 = OP_REG | OP_SIZE32 | OP_SIZE64, .reg = -1 },
+    { .mnem = "cvttsd2si", .mpre = 0xf2, .pre = 0x0f, .opcode = 0x2c, .op1 = OP_XMMRM, .op2 = OP_REG | OP_SIZE32 | OP_SIZE64, .reg = -1 },
+    { .mnem = "cvtss2sd",  .mpre = 0xf3, .pre = 0x0f, .opcode = 0x5a, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "cvtsd2ss",  .mpre = 0xf2, .pre = 0x0f, .opcode = 0x5a, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+
+    // SSE2 packed integer and single precision
+    { .mnem = "movdqu", .mpre = 0xf3, .pre = 0x0f, .opcode = 0x6f, .op1 = OP_XMMRM,  .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "movdqu", .mpre = 0xf3, .pre = 0x0f, .opcode = 0x7f, .op1 = OP_XMMREG, .op2 = OP_XMMRM,  .reg = -1 },
+    { .mnem = "movups", .pre = 0x0f, .opcode = 0x10, .op1 = OP_XMMRM,  .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "movups", .pre = 0x0f, .opcode = 0x11, .op1 = OP_XMMREG, .op2 = OP_XMMRM,  .reg = -1 },
+
+    { .mnem = "paddb", .mpre = 0x66, .pre = 0x0f, .opcode = 0xfc, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "paddd", .mpre = 0x66, .pre = 0x0f, .opcode = 0xfe, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "psubb", .mpre = 0x66, .pre = 0x0f, .opcode = 0xf8, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "psubd", .mpre = 0x66, .pre = 0x0f, .opcode = 0xfa, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "pand",  .mpre = 0x66, .pre = 0x0f, .opcode = 0xdb, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "por",   .mpre = 0x66, .pre = 0x0f, .opcode = 0xeb, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "pxor",  .mpre = 0x66, .pre = 0x0f, .opcode = 0xef, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "addps", .pre = 0x0f, .opcode = 0x58, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "mulps", .pre = 0x0f, .opcode = 0x59, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "subps", .pre = 0x0f, .opcode = 0x5c, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+    { .mnem = "divps", .pre = 0x0f, .opcode = 0x5e, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1 },
+
+    { .mnem = "pshufd", .mpre = 0x66, .pre = 0x0f, .opcode = 0x70, .op1 = OP_IMM | OP_SIZE8, .op2 = OP_XMMRM, .op3 = OP_XMMREG, .reg = -1 },
+
+    // AVX/AVX2, a %ymm operand sets VEX.L. Three operand forms take the
+    // first source in vvvv: vaddps %ymm2, %ymm1, %ymm0 is ymm0 = ymm1 + ymm2
+    { .mnem = "vmovdqu", .mpre = 0xf3, .pre = 0x0f, .opcode = 0x6f, .op1 = OP_XMMRM,  .op2 = OP_XMMREG, .reg = -1, .flags = IF_VEX },
+    { .mnem = "vmovdqu", .mpre = 0xf3, .pre = 0x0f, .opcode = 0x7f, .op1 = OP_XMMREG, .op2 = OP_XMMRM,  .reg = -1, .flags = IF_VEX },
+    { .mnem = "vmovups", .pre = 0x0f, .opcode = 0x10, .op1 = OP_XMMRM,  .op2 = OP_XMMREG, .reg = -1, .flags = IF_VEX },
+    { .mnem = "vmovups", .pre = 0x0f, .opcode = 0x11, .op1 = OP_XMMREG, .op2 = OP_XMMRM,  .reg = -1, .flags = IF_VEX },
+    { .mnem = "vmovd", .mpre = 0x66, .pre = 0x0f, .opcode = 0x6e, .op1 = OP_RM | OP_SIZE32, .op2 = OP_XMMREG, .reg = -1, .flags = IF_VEX },
+    { .mnem = "vpbroadcastd", .mpre = 0x66, .pre = 0x0f, .pre2 = 0x38, .opcode = 0x58, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .reg = -1, .flags = IF_VEX },
+
+    { .mnem = "vpaddb",  .mpre = 0x66, .pre = 0x0f, .opcode = 0xfc, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .op3 = OP_XMMREG, .reg = -1, .flags = IF_VEX | IF_VVVV },
+    { .mnem = "vpaddd",  .mpre = 0x66, .pre = 0x0f, .opcode = 0xfe, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .op3 = OP_XMMREG, .reg = -1, .flags = IF_VEX | IF_VVVV },
+    { .mnem = "vpsubb",  .mpre = 0x66, .pre = 0x0f, .opcode = 0xf8, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .op3 = OP_XMMREG, .reg = -1, .flags = IF_VEX | IF_VVVV },
+    { .mnem = "vpsubd",  .mpre = 0x66, .pre = 0x0f, .opcode = 0xfa, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .op3 = OP_XMMREG, .reg = -1, .flags = IF_VEX | IF_VVVV },
+    { .mnem = "vpmulld", .mpre = 0x66, .pre = 0x0f, .pre2 = 0x38, .opcode = 0x40, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .op3 = OP_XMMREG, .reg = -1, .flags = IF_VEX | IF_VVVV },
+    { .mnem = "vpand",   .mpre = 0x66, .pre = 0x0f, .opcode = 0xdb, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .op3 = OP_XMMREG, .reg = -1, .flags = IF_VEX | IF_VVVV },
+    { .mnem = "vpor",    .mpre = 0x66, .pre = 0x0f, .opcode = 0xeb, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .op3 = OP_XMMREG, .reg = -1, .flags = IF_VEX | IF_VVVV },
+    { .mnem = "vpxor",   .mpre = 0x66, .pre = 0x0f, .opcode = 0xef, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .op3 = OP_XMMREG, .reg = -1, .flags = IF_VEX | IF_VVVV },
+    { .mnem = "vaddps",  .pre = 0x0f, .opcode = 0x58, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .op3 = OP_XMMREG, .reg = -1, .flags = IF_VEX | IF_VVVV },
+    { .mnem = "vmulps",  .pre = 0x0f, .opcode = 0x59, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .op3 = OP_XMMREG, .reg = -1, .flags = IF_VEX | IF_VVVV },
+    { .mnem = "vsubps",  .pre = 0x0f, .opcode = 0x5c, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .op3 = OP_XMMREG, .reg = -1, .flags = IF_VEX | IF_VVVV },
+    { .mnem = "vdivps",  .pre = 0x0f, .opcode = 0x5e, .op1 = OP_XMMRM, .op2 = OP_XMMREG, .op3 = OP_XMMREG, .reg = -1, .flags = IF_VEX | IF_VVVV },
+
+    { .mnem = "vzeroupper", .pre = 0x0f, .opcode = 0x77, .reg = -1, .flags = IF_VEX },
+
     // Misc.
     { .mnem = "ret", .opcode = 0xc3, .reg = -1  },
     { .mnem = "syscall", .pre = 0x0f, .opcode = 0x05, .reg = -1  },
@@ -325,33 +425,133 @@ static struct inst s_insttbl[] = {
 
 };
 
-struct inst *searchi(struct code *code)
+// Register operands must also agree on being XMM or general purpose registers
+#define XMMMATCH(op, iop) (!ISREG(op) || (op & OP_XMM) == (iop & OP_XMM))
+
+static int opmatch(struct codeop *op, uint64_t iop)
+{
+    if (!(op->type & OP_TYPEM)) return !(iop & OP_TYPEM);
+
+    return (op->type & OP_TYPEM) & (iop & OP_TYPEM)
+        && (op->type & OP_SIZEM) & (iop & OP_SIZEM)
+        && XMMMATCH(op->type, iop);
+}
+
+// Table entries sharing a mnemonic, in table order
+struct mnemidx
+{
+    const char *mnem;
+    struct inst **cands;
+    size_t cnt;
+};
+
+#define MNEMIDXSIZE 512 // Power of two, a few times the number of mnemonics
+
+static struct mnemidx s_mnemidx[MNEMIDXSIZE];
+
+static struct mnemidx *mnemslot(const char *mnem)
+{
+    size_t i = strhash(mnem) & (MNEMIDXSIZE - 1);
+    while (s_mnemidx[i].mnem && strcmp(s_mnemidx[i].mnem, mnem))
+        i = (i + 1) & (MNEMIDXSIZE - 1);
+    return &s_mnemidx[i];
+}
+
+static void index_insts()
 {
     for (size_t i = 0; i < ARRLEN(s_insttbl); i++)
     {
-        int op1u = code->op1.type & OP_TYPEM;
-        int op2u = code->op2.type & OP_TYPEM;
-        if (!strcmp(s_insttbl[i].mnem, code->mnem)
-                && (!op1u || (code->op1.type & OP_TYPEM) & (s_insttbl[i].op1 & OP_TYPEM))
-                && (!op1u || (code->op1.type & OP_SIZEM) & (s_insttbl[i].op1 & OP_SIZEM))
-                && (!op2u || (code->op2.type & OP_TYPEM) & (s_insttbl[i].op2 & OP_TYPEM))
-                && (!op2u || (code->op2.type & OP_SIZEM) & (s_insttbl[i].op2 & OP_SIZEM)))
-            return &s_insttbl[i];
+        struct mnemidx *idx = mnemslot(s_insttbl[i].mnem);
+        idx->mnem = s_insttbl[i].mnem;
+        idx->cands = realloc(idx->cands, (idx->cnt + 1) * sizeof(struct inst*));
+        idx->cands[idx->cnt++] = &s_insttbl[i];
+    }
+}
+
+static int immwidth(struct inst *inst, struct code *code);
+
+// An immediate narrower than the operand is sign-extended, so it has to fit
+// as a signed value. One as wide may also be unsigned
+static int immfits(struct code *code, struct inst *inst)
+{
+    if (!ISIMM(code->op1.type) || inst->flags & IF_REL) return 1;
+
+    // The value of a symbol is only known after layout or by the linker, imm8 is too small
+    int isize = immwidth(inst, code);
+    if (code->op1.expr) return isize != OP_SIZE8;
+
+    if (isize == OP_SIZE64) return 1;
+
+    uint64_t osize = code->op2.type & OP_SIZEM;
+    if (!osize || osize & (osize - 1)) osize = isize;
+
+    int64_t v = code->op1.val, lim = 1L << (isize - 1);
+    return v >= -lim && v < (osize > (uint64_t)isize ? lim : 2 * lim);
+}
+
+struct inst *searchi(struct code *code)
+{
+    static int indexed = 0;
+    if (!indexed)
+    {
+        index_insts();
+        indexed = 1;
+    }
+
+    struct mnemidx *idx = mnemslot(code->mnem);
+    struct inst *best = NULL;
+    size_t bestsize = 0;
+
+    for (size_t i = 0; i < idx->cnt; i++)
+    {
+        struct inst *inst = idx->cands[i];
+        if (!opmatch(&code->op1, inst->op1) || !opmatch(&code->op2, inst->op2)
+                || !opmatch(&code->op3, inst->op3) || !immfits(code, inst))
+            continue;
+
+        // Several forms can fit, e.g. imm8 and imm32, take the shortest
+        if (!best) best = inst;
+        else
+        {
+            if (!bestsize) bestsize = instsize(best, code);
+
+            size_t size = instsize(inst, code);
+            if (size < bestsize)
+            {
+                best = inst;
+                bestsize = size;
+            }
+        }
     }
 
-    return NULL;
+    return best;
 }
 
 #define REXFIX (0b01000000) // Fixed REX bit pattern
 
-uint8_t mkrex(int is64, struct modrm *modrm)
+uint8_t mkrex(int is64, struct modrm *modrm, struct sib *sib)
 {
-    return REXFIX | (!!is64 << 3) | (!!(modrm->reg & 0b1000) << 2) | !!(modrm->rm & 0b1000);
+    int x = sib->flags & SIB_USED && sib->idx & 0b1000;
+    int b = sib->flags & SIB_USED ? sib->base & 0b1000 : modrm->rm & 0b1000;
+    return REXFIX | (!!is64 << 3) | (!!(modrm->reg & 0b1000) << 2) | (!!x << 1) | !!b;
+}
+
+// %spl, %bpl, %sil and %dil need a REX prefix even if it's empty, without one
+// the same encodings mean %ah, %ch, %dh and %bh
+static int isrex8(struct codeop *op)
+{
+    return ISREGSZ(op->type, OP_SIZE8) && !(op->type & OP_HIREG) && op->val >= REG_SP && op->val <= REG_DI;
+}
+
+static int needrex(struct code *code)
+{
+    return isrex8(&code->op1) || isrex8(&code->op2) || isrex8(&code->op3);
 }
 
 int iscode64(struct code *code, struct inst *inst)
 {
-    return inst->size & OP_SIZE64 || (!(inst->flags & IF_DEF64) && (ISREGSZ(code->op1.type, OP_SIZE64) || ISREGSZ(code->op2.type, OP_SIZE64)));
+    return inst->size & OP_SIZE64 || (!(inst->flags & IF_DEF64) && (ISREGSZ(code->op1.type, OP_SIZE64) || ISREGSZ(code->op2.type, OP_SIZE64)
+        || ISREGSZ(code->op3.type, OP_SIZE64)));
 }
 
 size_t immsize(uint64_t imm)
@@ -359,16 +559,27 @@ size_t immsize(uint64_t imm)
     return imm < UINT8_MAX ? 1 : imm < UINT16_MAX ? 2 : imm < UINT32_MAX ? 4 : 8;
 }
 
+// Displacements are signed, so only -128..127 fit in a disp8
+static int isdisp8(uint64_t disp)
+{
+    return (int64_t)disp >= INT8_MIN && (int64_t)disp <= INT8_MAX;
+}
+
 void mkmodrmsib(struct modrm *modrm, struct sib *sib, struct code *code, struct inst *inst)
 {
-    struct codeop *mem = ISMEM(inst->op1) && ISMEM(code->op1.type) ? &code->op1
-                       : ISMEM(inst->op2) && ISMEM(code->op2.type) ? &code->op2 : NULL;
+    struct codeop *ops[] = { &code->op1, &code->op2, &code->op3 };
+    uint64_t iops[] = { inst->op1, inst->op2, inst->op3 };
 
-    struct codeop *reg = (inst->op1 & OP_TYPEM) == OP_REG && ISREG(code->op1.type) ? &code->op1
-                       : (inst->op2 & OP_TYPEM) == OP_REG && ISREG(code->op2.type) ? &code->op2 : NULL;
+    struct codeop *mem = NULL, *reg = NULL, *rm = NULL;
+    for (size_t i = 0; i < ARRLEN(ops); i++)
+    {
+        // VEX.vvvv operand is encoded outside of ModRM
+        if (i == 1 && inst->flags & IF_VVVV) continue;
 
-    struct codeop *rm = (inst->op1 & OP_TYPEM) == OP_RM && ISRM(code->op1.type) ? &code->op1
-                      : (inst->op2 & OP_TYPEM) == OP_RM && ISRM(code->op2.type) ? &code->op2 : NULL;
+        if (!mem && ISMEM(iops[i]) && ISMEM(ops[i]->type)) mem = ops[i];
+        if (!reg && (iops[i] & OP_TYPEM) == OP_REG && ISREG(ops[i]->type)) reg = ops[i];
+        if (!rm && (iops[i] & OP_TYPEM) == OP_RM && ISRM(ops[i]->type)) rm = ops[i];
+    }
 
     if (!modrm->reg && reg && reg != rm) modrm->reg = reg->val;
     if (!mem && (reg || rm))
@@ -386,9 +597,9 @@ void mkmodrmsib(struct modrm *modrm, struct sib *sib, struct code *code, struct
         {
             if (!(mem->sib.flags & SIB_NODISP) && mem->sib.base != REG_NUL)
             {
-                if (immsize(mem->val) == 1)
+                if (!mem->expr && immsize(mem->val) == 1)
                     mem->sib.flags |= SIB_DISP8;
-                modrm->mod = immsize(mem->val) == 1 ? 1 : 2;
+                modrm->mod = mem->sib.flags & SIB_DISP8 ? 1 : 2;
             }
 
             if (mem->sib.idx == REG_NUL) modrm->rm |= 0b100;
@@ -406,17 +617,25 @@ void mkmodrmsib(struct modrm *modrm, struct sib *sib, struct code *code, struct
                 return;
             }
 
+            // mod 00 with a %rbp/%r13 base means disp32, so use a zero disp8
+            if (mem->sib.flags & SIB_NODISP && mem->sib.base != REG_NUL && (mem->sib.base & 0b111) == REG_BP)
+            {
+                mem->sib.flags &= ~SIB_NODISP;
+                mem->val = 0;
+            }
+
             if (!(mem->sib.flags & SIB_NODISP))
             {
-                if (immsize(mem->val) == 1 && mem->sib.base != REG_NUL)
+                if (!mem->expr && isdisp8(mem->val) && mem->sib.base != REG_NUL)
                     mem->sib.flags |= SIB_DISP8;
                 if (mem->sib.base != REG_NUL)
-                    modrm->mod = immsize(mem->val) == 1 ? 1 : 2;
+                    modrm->mod = mem->sib.flags & SIB_DISP8 ? 1 : 2;
                 else
                     sib->base = 0b101;
             }
 
-            if (mem->sib.idx == REG_NUL && mem->sib.base != REG_NUL && mem->sib.base != REG_SP)
+            // %rsp/%r12 base can only be encoded with a SIB byte
+            if (mem->sib.idx == REG_NUL && mem->sib.base != REG_NUL && (mem->sib.base & 0b111) != REG_SP)
                 modrm->rm = mem->sib.base;
             else
             {
@@ -440,7 +659,8 @@ int need_opover(struct inst *inst, struct code *code)
     // For long/protected mode, 16-bit instructions
     // For real mode, 32-bit instructions
     int size = g_currsize == 16 ? OP_SIZE32 : OP_SIZE16;
-    return (inst->size & size || ISREGSZ(code->op1.type, size) || ISREGSZ(code->op2.type, size));
+    return (inst->size & size || ISREGSZ(code->op1.type, size) || ISREGSZ(code->op2.type, size)
+        || ISREGSZ(code->op3.type, size));
 }
 
 // Need address-size override prefix (0x67)
@@ -453,6 +673,17 @@ int need_adrover(struct code *code)
         || (ISMEM(code->op2.type) && (code->op2.sib.flags & flag));
 }
 
+// Immediate size. Forms taking 16 or 32 bits follow the operand size, branches the mode
+static int immwidth(struct inst *inst, struct code *code)
+{
+    if (inst->flags & IF_REL) return g_currsize == 16 ? OP_SIZE16 : OP_SIZE32;
+
+    int size = inst->op1 & OP_SIZEM;
+    if (size == (OP_SIZE16 | OP_SIZE32))
+        return need_opover(inst, code) != (g_currsize == 16) ? OP_SIZE16 : OP_SIZE32;
+    return size;
+}
+
 void segover(uint8_t seg)
 {
     switch (seg)
@@ -466,6 +697,35 @@ void segover(uint8_t seg)
     }
 }
 
+// VEX prefix, two bytes when only the 0x0f map and REX.R are needed, else three
+static size_t mkvex(uint8_t vex[3], struct code *code, struct inst *inst, struct modrm *modrm, struct sib *sib)
+{
+    uint8_t rex = mkrex(iscode64(code, inst), modrm, sib);
+    int l = (code->op1.type | code->op2.type | code->op3.type) & OP_YMM ? 1 : 0;
+    int pp = inst->mpre == 0x66 ? 1 : inst->mpre == 0xf3 ? 2 : inst->mpre == 0xf2 ? 3 : 0;
+    int map = inst->pre2 == 0x38 ? 2 : inst->pre2 == 0x3a ? 3 : 1;
+    int vvvv = inst->flags & IF_VVVV ? code->op2.val : 0;
+
+    uint8_t low = ((~vvvv & 0b1111) << 3) | (l << 2) | pp;
+
+    if (map == 1 && !(rex & 0b1011))
+    {
+        vex[0] = 0xc5;
+        vex[1] = (!(rex & 0b0100) << 7) | low;
+        return 2;
+    }
+
+    vex[0] = 0xc4;
+    vex[1] = (!(rex & 0b0100) << 7) | (!(rex & 0b0010) << 6) | (!(rex & 0b0001) << 5) | map;
+    vex[2] = (!!(rex & 0b1000) << 7) | low;
+    return 3;
+}
+
+static int hasmodrm(struct modrm *modrm, struct inst *inst)
+{
+    return (modrm->reg || ISRM(inst->op1) || ISRM(inst->op2) || ISRM(inst->op3)) && !(inst->flags & IF_ROPCODE);
+}
+
 size_t instsize(struct inst *inst, struct code *code)
 {
     size_t s = 1; // opcode
@@ -474,10 +734,22 @@ size_t instsize(struct inst *inst, struct code *code)
     struct sib sib = { 0 };
     mkmodrmsib(&modrm, &sib, code, inst);
    
-    if (g_currsize == 64)
+    if (inst->flags & IF_VEX)
     {
-        uint8_t rex = mkrex(iscode64(code, inst), &modrm);
-        if (rex != REXFIX) s++;
+        uint8_t vex[3];
+        s += mkvex(vex, code, inst, &modrm, &sib);
+    }
+    else
+    {
+        if (g_currsize == 64)
+        {
+            uint8_t rex = mkrex(iscode64(code, inst), &modrm, &sib);
+            if (rex != REXFIX || needrex(code)) s++;
+        }
+
+        if (inst->mpre) s++;
+        if (inst->pre) s++;
+        if (inst->pre2) s++;
     }
 
     if (ISMEM(code->op1.type) && code->op1.sib.seg != REG_NUL)
@@ -488,9 +760,7 @@ size_t instsize(struct inst *inst, struct code *code)
     if (need_opover(inst, code)) s++;
     if (need_adrover(code)) s++;
 
-    if (inst->pre) s++;
-
-    if ((modrm.reg || ISRM(inst->op1) || ISRM(inst->op2)) && !(inst->flags & IF_ROPCODE))
+    if (hasmodrm(&modrm, inst))
         s++;
 
     if (sib.flags & SIB_USED)
@@ -502,19 +772,58 @@ size_t instsize(struct inst *inst, struct code *code)
         s += code->op2.sib.flags & SIB_DISP8 ? 1 : 4;
 
     if (ISIMM(code->op1.type))
+        s += immwidth(inst, code) >> 3;
+
+    return s;
+}
+
+// Memory operand displacement, 'tail' bytes of immediate come after it
+static void emitdisp(struct codeop *op, uint64_t dot, int tail)
+{
+    int size = op->sib.flags & SIB_DISP8 ? OP_SIZE8 : OP_SIZE32;
+    if (!op->expr)
     {
-        int size = inst->op1 & OP_SIZEM;
-        if (inst->flags & IF_REL)
-            size = g_currsize == 16 ? OP_SIZE16 : OP_SIZE32;
+        emit(size, op->val);
+        return;
+    }
 
-        s += size >> 3;
+    struct value v = eval_expr(op->expr, dot);
+    if (op->sib.base != REG_RIP)
+    {
+        emitvalue(4, v, REL_32S);
+        return;
     }
 
-    return s;
+    // %rip is the end of the instruction
+    if (v.sym == g_currsect->sym) v.val -= g_currsect->size + 4 + tail;
+    else if (v.sym)
+    {
+        sect_add_reloc(g_currsect, g_currsect->size, v.sym, v.val - 4 - tail, REL_PC32);
+        v.val = 0;
+    }
+
+    emit32(v.val);
+}
+
+// Branch displacement from 'end', the end of the instruction. Targets in this section
+// are resolved here, others are left to the linker, through the PLT if undefined
+static void emitrel(int size, struct value v, size_t end)
+{
+    if (v.sym && v.sym != g_currsect->sym)
+    {
+        int type = v.sym->flags & SYM_UNDEF ? REL_PLT : REL_PC32;
+        sect_add_reloc(g_currsect, g_currsect->size, v.sym, v.val - size / 8, type);
+        v.val = 0;
+    }
+    else v.val -= end;
+
+    emit(size, v.val);
 }
 
 void assemble(struct code *code, struct inst *inst, size_t lc)
 {
+    uint64_t dot = g_currsect->size;
+
     struct modrm modrm = { .reg = inst->reg != REG_NUL ? inst->reg : 0 };
     struct sib sib = { 0 };
     mkmodrmsib(&modrm, &sib, code, inst);
@@ -524,16 +833,32 @@ void assemble(struct code *code, struct inst *inst, size_t lc)
     else if (ISMEM(code->op2.type) && code->op2.sib.seg != REG_NUL)
         segover(code->op2.sib.seg);
 
-    if (g_currsize == 64)
+    if (need_opover(inst, code)) emit8(0x66);
+    if (need_adrover(code)) emit8(0x67);
+
+    if (inst->flags & IF_VEX)
     {
-        uint8_t rex = mkrex(iscode64(code, inst), &modrm);
-        if (rex != REXFIX) emit8(rex);
+        uint8_t vex[3];
+        size_t n = mkvex(vex, code, inst, &modrm, &sib);
+        for (size_t i = 0; i < n; i++) emit8(vex[i]);
     }
+    else
+    {
+        if (inst->mpre) emit8(inst->mpre);
 
-    if (need_opover(inst, code)) emit8(0x66);
-    if (need_adrover(code)) emit8(0x67);
+        // REX has to come last, right before the opcode
+        if (g_currsize == 64)
+        {
+            uint8_t rex = mkrex(iscode64(code, inst), &modrm, &sib);
+
+            // A register in the opcode is extended by REX.B, not REX.R
+            if (inst->flags & IF_ROPCODE && rex & 0b0100) rex ^= 0b0101;
+            if (rex != REXFIX || needrex(code)) emit8(rex);
+        }
 
-    if (inst->pre) emit8(inst->pre);
+        if (inst->pre) emit8(inst->pre);
+        if (inst->pre2) emit8(inst->pre2);
+    }
 
     uint8_t opcode = inst->opcode;
 
@@ -541,82 +866,25 @@ void assemble(struct code *code, struct inst *inst, size_t lc)
 
     emit8(opcode);
 
-    if ((modrm.reg || ISRM(inst->op1) || ISRM(inst->op2)) && !(inst->flags & IF_ROPCODE))
+    if (hasmodrm(&modrm, inst))
         emit8((modrm.mod << 6) | ((modrm.reg & 0b111) << 3) | (modrm.rm & 0b111));
 
     if (sib.flags & SIB_USED)
-        emit8((sib.scale << 6) | (sib.idx << 3) | sib.base);
+        emit8((sib.scale << 6) | ((sib.idx & 0b111) << 3) | (sib.base & 0b111));
 
-    if (ISMEM(code->op1.type) && !(code->op1.sib.flags & SIB_NODISP))
-    {
-        if (code->op1.sym)
-        {
-            struct symbol *sym = findsym(code->op1.sym);
-            if (code->op1.sib.base == REG_RIP)
-            {
-                sect_add_reloc(g_currsect, ftell(g_outf) - g_currsect->offset, sym, sym->val - 4, REL_PC32);
-                code->op1.val = 0;
-            }
-            else
-                code->op1.val = sym->val;
-        }
+    int immsz = ISIMM(code->op1.type) ? immwidth(inst, code) : 0;
 
-        emit(code->op1.sib.flags & SIB_DISP8 ? OP_SIZE8 : OP_SIZE32, code->op1.val);
-    }
+    if (ISMEM(code->op1.type) && !(code->op1.sib.flags & SIB_NODISP))
+        emitdisp(&code->op1, dot, immsz / 8);
     else if (ISMEM(code->op2.type) && !(code->op2.sib.flags & SIB_NODISP))
-        emit(code->op2.sib.flags & SIB_DISP8 ? OP_SIZE8 : OP_SIZE32, code->op2.val);
+        emitdisp(&code->op2, dot, immsz / 8);
 
-    if (ISIMM(code->op1.type))
+    if (immsz)
     {
-        int size = inst->op1 & OP_SIZEM;
-        if (inst->flags & IF_REL)
-            size = g_currsize == 16 ? OP_SIZE16 : OP_SIZE32;
-
-        struct symbol *sym = NULL;
-        if (code->op1.sym)
-        {
-            if (!strcmp(code->op1.sym, "."))
-            {
-                sym = findsym(g_currsect->name);
-            }
-            else
-            {
-                sym = findsym(code->op1.sym);
-                if (!sym)
-                {
-                    struct symbol null = {
-                        .flags = SYM_UNDEF | SYM_GLOB,
-                        .name = strdup(code->op1.sym)
-                    };
-                    addsym(&null);
-                    sym = findsym(code->op1.sym);
-                }
-                if (sym->flags & SYM_UNDEF)
-                {
-                    sect_add_reloc(g_currsect, ftell(g_outf) - g_currsect->offset, sym, -4, REL_PLT);
-                    code->op1.val = 0;
-
-                    emit(size, code->op1.val);
-                    return;
-                }
-            }
-        }
-        
-        if (inst->flags & IF_REL)
-        {
-            if (code->op1.sym) code->op1.val += sym->val;
-            code->op1.val -= lc;
-        }
-        else if (code->op1.sym)
-        {
-            int type = size == 16 ? REL_16
-                     : size == 32 ? REL_32S
-                     : REL_64;
-
-            sect_add_reloc(g_currsect, ftell(g_outf) - g_currsect->offset, sym, sym->val, type);
-            code->op1.val = 0;
-        }
+        struct value v = { NULL, code->op1.val };
+        if (code->op1.expr) v = eval_expr(code->op1.expr, dot);
 
-        emit(size, code->op1.val);
+        if (inst->flags & IF_REL) emitrel(immsz, v, lc);
+        else emitvalue(immsz / 8, v, REL_32S);
     }
 }
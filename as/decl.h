@@ -8,9 +8,15 @@
 
 #include "sym.h"
 
+struct frag;
+
 extern_ FILE *g_inf; // Input file
 extern_ FILE *g_outf; // Output file
-extern_ struct symbol *g_syms; // Symbol table
-extern_ struct section *g_sects; // Sections
+extern_ struct symbol **g_syms; // Symbol table
+extern_ size_t g_symcnt;
+extern_ struct section **g_sects; // Sections
+extern_ size_t g_sectcnt;
 extern_ struct section *g_currsect; // Current section
 extern_ size_t g_currsize; // Current assembly size (16-bit/64-bit)
+extern_ struct frag *g_frags; // Parsed lines, in order
+extern_ size_t g_fragcnt;
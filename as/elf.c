@@ -11,7 +11,7 @@
 
 static Elf64_Ehdr s_ehdr = { 0 }; // ELF header
 
-// Write as much of Ehdr as possible
+// Fill in what Ehdr needs no sections for
 void elf_begin_file()
 {
     unsigned char ident[EI_NIDENT] = {
@@ -31,11 +31,9 @@ void elf_begin_file()
     s_ehdr.e_version   = EV_CURRENT;
     s_ehdr.e_ehsize    = sizeof(Elf64_Ehdr);
     s_ehdr.e_shentsize = sizeof(Elf64_Shdr);
-
-    fwrite(&s_ehdr, sizeof(Elf64_Ehdr), 1, g_outf);
 }
 
-static void write_symbol(struct symbol *sym)
+static void write_symbol(struct section *symtab, struct symbol *sym)
 {
     uint8_t type = sym->type == SYMT_FUNC   ? STT_FUNC
                  : sym->type == SYMT_OBJECT ? STT_OBJECT
@@ -53,14 +51,18 @@ static void write_symbol(struct symbol *sym)
         esym.st_shndx = SHN_ABS;
     else if (!(sym->flags & SYM_UNDEF))
     {
-        size_t sect = 1;
-        for (struct section *cand = g_sects; cand && cand != sym->sect; cand = cand->next, sect++);
-       
         esym.st_value = sym->val;
-        esym.st_shndx = sect;
+        esym.st_shndx = sym->sect->idx + 1;
     }
 
-    fwrite(&esym, sizeof(Elf64_Sym), 1, g_outf);
+    memcpy(sect_reserve(symtab, sizeof(Elf64_Sym)), &esym, sizeof(Elf64_Sym));
+}
+
+// 'name' is 'base' or one of its per-function/per-object pieces, like .text.main
+static int issect(const char *name, const char *base)
+{
+    size_t len = strlen(base);
+    return !strncmp(name, base, len) && (!name[len] || name[len] == '.');
 }
 
 static void write_section(struct section *sect)
@@ -71,23 +73,24 @@ static void write_section(struct section *sect)
         shdr = (Elf64_Shdr) {
             .sh_offset = sect->offset,
             .sh_size = sect->size,
-            .sh_name = sect->namei
+            .sh_name = sect->namei,
+            .sh_addralign = sect->align
         };
 
-        if (!strcmp(sect->name, ".text")) { shdr.sh_type = SHT_PROGBITS; shdr.sh_flags = SHF_ALLOC | SHF_EXECINSTR; }
-        else if (!strcmp(sect->name, ".data")) { shdr.sh_type = SHT_PROGBITS; shdr.sh_flags = SHF_ALLOC | SHF_WRITE; }
-        else if (!strcmp(sect->name, ".rodata")) { shdr.sh_type = SHT_PROGBITS; shdr.sh_flags = SHF_ALLOC; }
-        else if (!strcmp(sect->name, ".bss")) { shdr.sh_type = SHT_NOBITS; shdr.sh_flags = SHF_ALLOC | SHF_WRITE; }
+        if (issect(sect->name, ".text")) { shdr.sh_type = SHT_PROGBITS; shdr.sh_flags = SHF_ALLOC | SHF_EXECINSTR; }
+        else if (issect(sect->name, ".data")) { shdr.sh_type = SHT_PROGBITS; shdr.sh_flags = SHF_ALLOC | SHF_WRITE; }
+        else if (issect(sect->name, ".rodata")) { shdr.sh_type = SHT_PROGBITS; shdr.sh_flags = SHF_ALLOC; }
+        else if (sect->nobits) { shdr.sh_type = SHT_NOBITS; shdr.sh_flags = SHF_ALLOC | SHF_WRITE; }
         else if (!strcmp(sect->name, ".strtab")) { shdr.sh_type = SHT_STRTAB; }
         else if (!strcmp(sect->name, ".symtab"))
         {
-            size_t lastloc = 1, i = 0;
-            for (struct symbol *sym = g_syms; sym; sym = sym->next, i++)
-                if (!(sym->flags & SYM_GLOB)) lastloc++;
+            size_t lastloc = 1;
+            for (size_t i = 0; i < g_symcnt; i++)
+                if (!(g_syms[i]->flags & SYM_GLOB)) lastloc++;
 
             shdr.sh_type = SHT_SYMTAB;
             shdr.sh_info = lastloc;
-            shdr.sh_link = sectnum(sect);
+            shdr.sh_link = sect->idx;
             shdr.sh_entsize = sizeof(Elf64_Sym);
         }
         else if (!strcmp(sect->name, ".shstrtab")) { shdr.sh_type = SHT_STRTAB; }
@@ -95,113 +98,90 @@ static void write_section(struct section *sect)
         {
             shdr.sh_flags = SHF_INFO_LINK,
             shdr.sh_type = SHT_RELA,
-            shdr.sh_info = sectnum(sect),
+            shdr.sh_info = sect->idx,
             shdr.sh_entsize = sizeof(Elf64_Rela),
-            shdr.sh_link = sectcnt() - 1; // TODO: TEMP
+            shdr.sh_link = g_sectcnt - 1; // TODO: TEMP
         }
     }
 
     fwrite(&shdr, sizeof(Elf64_Shdr), 1, g_outf);
 }
 
-// Append mandatory sections (shstr, symtab, etc), write section headers, patch Ehdr
+// Append mandatory sections (shstr, symtab, etc), then write the whole file:
+// Ehdr, each section's contents, section headers
 void elf_end_file()
 {
     sort_symbols();
 
-    struct section *relsects[32];
-    size_t relsectcnt = 0;
-
-    for (struct section *s = g_sects; s; s = s->next)
+    // Each .rela section goes right after the section it applies to
+    for (size_t i = 0; i < g_sectcnt; i++)
     {
-        if (s->rels)
-        {
-            // Prepend '.rela' to section name
-            char *name = strcat(strcpy(malloc(strlen(s->name) + 6), ".rela"), s->name);
-            struct section *rel = creatsect(name);
-            relsects[relsectcnt++] = rel;
-
-            rel->offset = ftell(g_outf);
+        struct section *s = g_sects[i];
+        if (!s->relcnt) continue;
 
-            for (struct reloc *r = s->rels; r; r = r->next)
-            {
-                struct symbol *sym = r->sym->flags & SYM_UNDEF ? r->sym : findsym(r->sym->sect->name);
+        // Prepend '.rela' to section name
+        char *name = strcat(strcpy(malloc(strlen(s->name) + 6), ".rela"), s->name);
+        struct section *rel = creatsect(name);
 
-                uint32_t symidx = 1;
-                for (struct symbol *s = g_syms; s; s = s->next, symidx++)
-                    if (s == sym) break;
-
-                /*uint8_t type = r->flags & REL_PCREL ? R_X86_64_PC32
-                             : r->sym->flags & SYM_UNDEF ? R_X86_64_PLT32
-                             : R_X86_64_32S;*/
-
-                Elf64_Rela rela = {
-                    .r_offset = r->offset,
-                    .r_info = ELF64_R_INFO(symidx, r->flags),
-                    .r_addend = r->addend,
-                };
-
-                fwrite(&rela, sizeof(Elf64_Rela), 1, g_outf);
-            }
-
-            rel->size = ftell(g_outf) - rel->offset;
+        Elf64_Rela *rela = (Elf64_Rela*)sect_reserve(rel, s->relcnt * sizeof(Elf64_Rela));
+        for (size_t j = 0; j < s->relcnt; j++)
+        {
+            struct reloc *r = &s->rels[j];
+            struct symbol *sym = r->sym->flags & SYM_UNDEF ? r->sym : r->sym->sect->sym;
+
+            rela[j] = (Elf64_Rela) {
+                .r_offset = r->offset,
+                .r_info = ELF64_R_INFO(sym->idx + 1, r->flags),
+                .r_addend = r->addend,
+            };
         }
-    }
 
-    for (size_t i = 0; i < relsectcnt; i++)
-    {
-        struct section *s = findsect(relsects[i]->name + 5);
-        relsects[i]->next = s->next;
-        s->next = relsects[i];
+        insertsect(rel, ++i);
     }
 
-    struct section *strtab = addsect(".strtab");
-    strtab->offset = ftell(g_outf);
-
-    fputc(0, g_outf);
-    for (struct symbol *sym = g_syms; sym; sym = sym->next)
-    {
-        sym->namei = ftell(g_outf) - strtab->offset;
-        fwritestr(sym->name, g_outf);
-    }
+    struct strtab names = { 0 };
+    for (size_t i = 0; i < g_symcnt; i++)
+        g_syms[i]->namei = strtab_add(&names, g_syms[i]->name);
 
-    strtab->size = ftell(g_outf) - strtab->offset;
+    struct section *strtab = addsect(".strtab");
+    strtab_write(&names, sect_reserve(strtab, strtab_finish(&names)));
+    for (size_t i = 0; i < g_symcnt; i++)
+        g_syms[i]->namei = names.offs[g_syms[i]->namei];
+    strtab_free(&names);
 
     struct section *symtab = addsect(".symtab");
-    symtab->offset = ftell(g_outf);
-
-    Elf64_Sym esym = { 0 };
-    fwrite(&esym, sizeof(Elf64_Sym), 1, g_outf);
-
-    for (struct symbol *sym = g_syms; sym; sym = sym->next)
-        write_symbol(sym);
-
-    symtab->size = ftell(g_outf) - symtab->offset;
+    memset(sect_reserve(symtab, sizeof(Elf64_Sym)), 0, sizeof(Elf64_Sym));
+    for (size_t i = 0; i < g_symcnt; i++)
+        write_symbol(symtab, g_syms[i]);
 
+    // .rela.text is stored once and .text points into it
     struct section *shstrtab = addsect(".shstrtab");
-    shstrtab->offset = ftell(g_outf);
+    for (size_t i = 0; i < g_sectcnt; i++)
+        g_sects[i]->namei = strtab_add(&names, g_sects[i]->name);
 
-    fputc(0, g_outf);
-    for (struct section *s = g_sects; s; s = s->next)
+    strtab_write(&names, sect_reserve(shstrtab, strtab_finish(&names)));
+    for (size_t i = 0; i < g_sectcnt; i++)
+        g_sects[i]->namei = names.offs[g_sects[i]->namei];
+    strtab_free(&names);
+
+    size_t off = sizeof(Elf64_Ehdr);
+    for (size_t i = 0; i < g_sectcnt; i++)
     {
-        s->namei = ftell(g_outf) - shstrtab->offset;
-        fwritestr(s->name, g_outf);
+        g_sects[i]->offset = off;
+        if (!g_sects[i]->nobits) off += g_sects[i]->size;
     }
 
-    shstrtab->size = ftell(g_outf) - shstrtab->offset;
-
-    uint64_t shoff = ftell(g_outf);
+    s_ehdr.e_shoff = off;
+    s_ehdr.e_shnum = g_sectcnt + 1;
+    s_ehdr.e_shstrndx = shstrtab->idx + 1;
 
-    write_section(NULL);
+    fwrite(&s_ehdr, sizeof(Elf64_Ehdr), 1, g_outf);
 
-    for (struct section *s = g_sects; s; s = s->next)
-        write_section(s);
+    for (size_t i = 0; i < g_sectcnt; i++)
+        if (!g_sects[i]->nobits) fwrite(g_sects[i]->data, 1, g_sects[i]->size, g_outf);
 
-    s_ehdr.e_shoff = shoff;
-    s_ehdr.e_shnum = sectcnt() + 1;
-    s_ehdr.e_shstrndx = sectnum(shstrtab) + 1;
+    write_section(NULL);
 
-    fseek(g_outf, 0, SEEK_SET);
-    fwrite(&s_ehdr, sizeof(Elf64_Ehdr), 1, g_outf);
+    for (size_t i = 0; i < g_sectcnt; i++)
+        write_section(g_sects[i]);
 }
-
@@ -0,0 +1,265 @@
+#include "expr.h"
+#include "sym.h"
+#include "lib.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+static char *s_str = NULL;
+static int s_lineno; // For errors
+
+static struct expr *mkexpr(int type)
+{
+    struct expr *expr = calloc(1, sizeof(struct expr));
+    expr->type = type;
+    return expr;
+}
+
+static struct expr *mkbinop(int op, struct expr *lhs, struct expr *rhs)
+{
+    struct expr *expr = mkexpr(EXPR_BINOP);
+    expr->op = op;
+    expr->lhs = lhs;
+    expr->rhs = rhs;
+    return expr;
+}
+
+static void skipspace()
+{
+    while (*s_str == ' ') s_str++;
+}
+
+static int issymchar(char c)
+{
+    return isalnum(c) || c == '_' || c == '.' || c == '$';
+}
+
+static struct expr *parse_or();
+
+static struct expr *parse_primary()
+{
+    skipspace();
+
+    struct expr *expr;
+    if (isdigit(*s_str))
+    {
+        expr = mkexpr(EXPR_NUM);
+        expr->val = xstrtonum(s_str, &s_str);
+    }
+    else if (*s_str == '\'')
+    {
+        size_t len;
+        char *c = stresc(++s_str, '\'', &len);
+        if (strlen(c) != 1)
+            error("Line %d: Invalid character constant\n", s_lineno);
+
+        expr = mkexpr(EXPR_NUM);
+        expr->val = *c;
+        s_str += len;
+        free(c);
+    }
+    else if (*s_str == '(')
+    {
+        s_str++;
+        expr = parse_or();
+
+        skipspace();
+        if (*s_str++ != ')')
+            error("Line %d: Expected ')' in expression\n", s_lineno);
+    }
+    else if (*s_str == '.' && !issymchar(s_str[1]))
+    {
+        expr = mkexpr(EXPR_DOT);
+        s_str++;
+    }
+    else if (issymchar(*s_str))
+    {
+        char *strt = s_str;
+        while (issymchar(*s_str)) s_str++;
+
+        expr = mkexpr(EXPR_SYM);
+        expr->name = strndup(strt, s_str - strt);
+    }
+    else if (!*s_str || *s_str == '\n') error("Line %d: Expected an expression\n", s_lineno);
+    else error("Line %d: Invalid expression: %.*s\n", s_lineno, (int)strcspn(s_str, "\n"), s_str);
+
+    return expr;
+}
+
+static struct expr *parse_unary()
+{
+    skipspace();
+
+    if (*s_str == '-' || *s_str == '~')
+    {
+        struct expr *expr = mkexpr(*s_str++ == '-' ? EXPR_NEG : EXPR_NOT);
+        expr->lhs = parse_unary();
+        return expr;
+    }
+
+    return parse_primary();
+}
+
+static struct expr *parse_mul()
+{
+    struct expr *expr = parse_unary();
+    for (skipspace(); *s_str == '*'; skipspace())
+    {
+        s_str++;
+        expr = mkbinop('*', expr, parse_unary());
+    }
+    return expr;
+}
+
+static struct expr *parse_add()
+{
+    struct expr *expr = parse_mul();
+    for (skipspace(); *s_str == '+' || *s_str == '-'; skipspace())
+    {
+        int op = *s_str++;
+        expr = mkbinop(op, expr, parse_mul());
+    }
+    return expr;
+}
+
+static struct expr *parse_shift()
+{
+    struct expr *expr = parse_add();
+    for (skipspace(); (*s_str == '<' || *s_str == '>') && s_str[1] == *s_str; skipspace())
+    {
+        int op = *s_str;
+        s_str += 2;
+        expr = mkbinop(op, expr, parse_add());
+    }
+    return expr;
+}
+
+static struct expr *parse_and()
+{
+    struct expr *expr = parse_shift();
+    for (skipspace(); *s_str == '&'; skipspace())
+    {
+        s_str++;
+        expr = mkbinop('&', expr, parse_shift());
+    }
+    return expr;
+}
+
+static struct expr *parse_or()
+{
+    struct expr *expr = parse_and();
+    for (skipspace(); *s_str == '|'; skipspace())
+    {
+        s_str++;
+        expr = mkbinop('|', expr, parse_and());
+    }
+    return expr;
+}
+
+// Parse an expression at '*str' with C precedence, leaving '*str' after it
+struct expr *parse_expr(char **str, int lineno)
+{
+    s_str = *str;
+    s_lineno = lineno;
+    struct expr *expr = parse_or();
+    *str = s_str;
+    return expr;
+}
+
+// No symbols in it, so eval_expr() works right away
+int expr_isconst(struct expr *expr)
+{
+    if (!expr) return 1;
+    if (expr->type == EXPR_SYM || expr->type == EXPR_DOT) return 0;
+    return expr_isconst(expr->lhs) && expr_isconst(expr->rhs);
+}
+
+// Look up the symbols, '.' is a location in 'sect'
+void bind_expr(struct expr *expr, struct section *sect)
+{
+    if (!expr) return;
+
+    if (expr->type == EXPR_SYM) expr->sym = refsym(expr->name);
+    else if (expr->type == EXPR_DOT) expr->sym = sect ? sect->sym : NULL;
+
+    bind_expr(expr->lhs, sect);
+    bind_expr(expr->rhs, sect);
+}
+
+// Error message if 'expr' can't be turned into a value
+static const char *evaluate(struct expr *expr, uint64_t dot, struct value *v)
+{
+    struct value l = { 0 }, r = { 0 };
+    const char *err = NULL;
+
+    switch (expr->type)
+    {
+        case EXPR_NUM:
+            *v = (struct value) { NULL, expr->val };
+            return NULL;
+
+        case EXPR_DOT:
+            *v = (struct value) { expr->sym, dot };
+            return NULL;
+
+        case EXPR_SYM:
+            if (expr->sym->flags & SYM_UNDEF) *v = (struct value) { expr->sym, 0 };
+            else if (expr->sym->flags & SYM_SECT) *v = (struct value) { expr->sym, 0 };
+            else *v = (struct value) { expr->sym->sect->sym, expr->sym->val };
+            return NULL;
+    }
+
+    if ((err = evaluate(expr->lhs, dot, &l))) return err;
+    if (expr->rhs && (err = evaluate(expr->rhs, dot, &r))) return err;
+
+    // Symbols only survive + and -, a difference of two in the same section is a constant
+    if (expr->type == EXPR_BINOP && expr->op == '+')
+    {
+        if (l.sym && r.sym) return "Can't add two symbols";
+        *v = (struct value) { l.sym ? l.sym : r.sym, l.val + r.val };
+        return NULL;
+    }
+
+    if (expr->type == EXPR_BINOP && expr->op == '-')
+    {
+        if (r.sym && (l.sym != r.sym || (r.sym->flags & SYM_UNDEF)))
+            return "Can only subtract symbols from the same section";
+
+        *v = (struct value) { r.sym ? NULL : l.sym, l.val - r.val };
+        return NULL;
+    }
+
+    if (l.sym || r.sym) return "Operator needs constant operands";
+
+    v->sym = NULL;
+    switch (expr->type == EXPR_BINOP ? expr->op : expr->type)
+    {
+        case EXPR_NEG: v->val = -l.val; break;
+        case EXPR_NOT: v->val = ~l.val; break;
+        case '*': v->val = l.val * r.val; break;
+        case '&': v->val = l.val & r.val; break;
+        case '|': v->val = l.val | r.val; break;
+        case '<': v->val = (uint64_t)l.val << r.val; break;
+        case '>': v->val = (uint64_t)l.val >> r.val; break;
+    }
+
+    return NULL;
+}
+
+// Once parsing is done every symbol's section is known, so any misuse shows up here
+void check_expr(struct expr *expr, int lineno)
+{
+    struct value v;
+    const char *err = expr ? evaluate(expr, 0, &v) : NULL;
+    if (err)
+        error("Line %d: %s\n", lineno, err);
+}
+
+// 'dot' is the offset of the line the expression is on
+struct value eval_expr(struct expr *expr, uint64_t dot)
+{
+    struct value v = { 0 };
+    evaluate(expr, dot, &v);
+    return v;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+
+struct symbol;
+struct section;
+
+#define EXPR_NUM   0 // Constant
+#define EXPR_SYM   1 // Symbol, bound to 'sym' after parsing
+#define EXPR_DOT   2 // Location of the current line, '.'
+#define EXPR_NEG   3 // -lhs
+#define EXPR_NOT   4 // ~lhs
+#define EXPR_BINOP 5 // lhs 'op' rhs, where '<' is << and '>' is >>
+
+struct expr
+{
+    int type;
+    int op;
+    int64_t val;
+    const char *name;
+    struct symbol *sym;
+    struct expr *lhs, *rhs;
+};
+
+// 'val' bytes past 'sym', which is a section symbol or an undefined one. Absolute if 'sym' is NULL
+struct value
+{
+    struct symbol *sym;
+    int64_t val;
+};
+
+struct expr *parse_expr(char **str, int lineno);
+int expr_isconst(struct expr *expr);
+void bind_expr(struct expr *expr, struct section *sect);
+void check_expr(struct expr *expr, int lineno);
+struct value eval_expr(struct expr *expr, uint64_t dot);
@@ -0,0 +1,330 @@
+#include "frag.h"
+#include "decl.h"
+#include "sym.h"
+#include "inst.h"
+#include "lib.h"
+#include "asm.h"
+#include "expr.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdlib.h>
+
+static size_t s_fragcap = 0;
+static int s_lineno = 0;
+
+static struct frag *newfrag(int type)
+{
+    if (g_fragcnt == s_fragcap)
+    {
+        s_fragcap = s_fragcap ? s_fragcap * 2 : 256;
+        g_frags = realloc(g_frags, s_fragcap * sizeof(struct frag));
+    }
+
+    struct frag *frag = &g_frags[g_fragcnt++];
+    *frag = (struct frag) { .type = type, .lineno = s_lineno };
+    return frag;
+}
+
+// Little-endian constant of 'size' bytes
+static void datafrag(uint64_t v, size_t size)
+{
+    struct frag *frag = newfrag(FRAG_DATA);
+    frag->size = size;
+    frag->data = malloc(size);
+    for (size_t i = 0; i < size; i++)
+        frag->data[i] = v >> (i * 8);
+}
+
+// A label defines its symbol, or fills in the placeholder left by an earlier reference
+static void deflabel(char *name, struct section *sect, int lineno)
+{
+    struct symbol *sym = findsym(name);
+    if (sym && !(sym->flags & SYM_UNDEF))
+        error("Line %d: Symbol '%s' already defined\n", lineno, name);
+
+    if (!sym)
+    {
+        struct symbol def = { .name = name };
+        sym = addsym(&def);
+    }
+    else free(name);
+
+    sym->flags &= ~SYM_UNDEF;
+    sym->sect = sect;
+
+    newfrag(FRAG_LABEL)->sym = sym;
+}
+
+// .byte/.word/.long/.quad, with symbols the value is only known after layout
+static void datavalue(char *arg, size_t size, struct section *sect, int lineno)
+{
+    struct expr *expr = parse_expr(&arg, lineno);
+    if (expr_isconst(expr))
+    {
+        datafrag(eval_expr(expr, 0).val, size);
+        return;
+    }
+
+    bind_expr(expr, sect);
+
+    struct frag *frag = newfrag(FRAG_EXPR);
+    frag->size = size;
+    frag->expr = expr;
+}
+
+#define MAXALIGN 0x10000 // 64 KiB, well past a page
+
+// .align N[, fill] in bytes, .p2align N[, fill] in powers of two
+static void alignfrag(char *arg, int pow2, struct section *sect, int lineno)
+{
+    char *end;
+    long n = xstrtonum(arg, &end);
+
+    // Checked before shifting, 1 << 64 and up is undefined
+    if (pow2 && (n < 0 || n >= 64))
+        error("Line %d: Alignment must be a power of two up to %d\n", lineno, MAXALIGN);
+
+    size_t to = pow2 ? (size_t)1 << n : (size_t)n;
+    if (!to || to & (to - 1) || to > MAXALIGN)
+        error("Line %d: Alignment must be a power of two up to %d\n", lineno, MAXALIGN);
+
+    struct frag *frag = newfrag(FRAG_ALIGN);
+    frag->align.to = to;
+    frag->align.fill = -1;
+
+    end += strspn(end, " ");
+    if (*end == ',')
+    {
+        end++;
+        long fill = xstrtonum(end + strspn(end, " "), NULL);
+        if (fill < 0 || fill > 0xff)
+            error("Line %d: Fill value %ld doesn't fit in a byte\n", lineno, fill);
+        frag->align.fill = fill;
+    }
+
+    if (sect && to > sect->align) sect->align = to;
+}
+
+static void parse_directive(char *strt, struct section **currsect, int lineno)
+{
+    char *direct = strndup(strt, strcspn(strt, " \n"));
+    char *arg = strt + strlen(direct) + 1;
+
+    if (!strcmp(direct, ".section"))
+    {
+        char *name = strndup(arg, strchr(arg, '\n') - arg);
+
+        // Switching back to a section continues where it left off
+        *currsect = findsect(name);
+        if (*currsect) free(name);
+        else
+        {
+            *currsect = addsect(name);
+            (*currsect)->nobits = !strcmp(name, ".bss") || !strncmp(name, ".bss.", 5);
+
+            struct symbol sym = {
+                .name = name,
+                .flags = SYM_SECT,
+                .sect = *currsect
+            };
+            (*currsect)->sym = addsym(&sym);
+        }
+
+        newfrag(FRAG_SECT)->sect = *currsect;
+    }
+    else if (!strcmp(direct, ".global"))
+    {
+        char *name = strndup(arg, strchr(arg, '\n') - arg);
+        refsym(name)->flags |= SYM_GLOB;
+        free(name);
+    }
+    else if (!strcmp(direct, ".type"))
+    {
+        *strchr(arg, ',') = 0;
+
+        char *type = arg + strlen(arg) + 2;
+        *strchr(type, '\n') = 0;
+
+        refsym(arg)->type = symtypestr(type);
+    }
+    else if (!strcmp(direct, ".size"))
+    {
+        *strchr(arg, ',') = 0;
+
+        char *size = arg + strlen(arg) + 1;
+        struct expr *expr = parse_expr(&size, lineno);
+        if (expr_isconst(expr)) refsym(arg)->size = eval_expr(expr, 0).val;
+        else
+        {
+            bind_expr(expr, *currsect);
+
+            struct frag *frag = newfrag(FRAG_SIZE);
+            frag->symsize.sym = refsym(arg);
+            frag->symsize.expr = expr;
+        }
+    }
+    else if (!strcmp(direct, ".str"))
+    {
+        struct frag *frag = newfrag(FRAG_DATA);
+        frag->data = (uint8_t*)stresc(arg + 1, '"', NULL);
+        frag->size = strlen((char*)frag->data) + 1;
+    }
+    else if (!strcmp(direct, ".byte")) datavalue(arg, 1, *currsect, lineno);
+    else if (!strcmp(direct, ".word")) datavalue(arg, 2, *currsect, lineno);
+    else if (!strcmp(direct, ".long")) datavalue(arg, 4, *currsect, lineno);
+    else if (!strcmp(direct, ".quad")) datavalue(arg, 8, *currsect, lineno);
+    else if (!strcmp(direct, ".skip") || !strcmp(direct, ".zero")) newfrag(FRAG_DATA)->size = xstrtonum(arg, NULL);
+    else if (!strcmp(direct, ".align")) alignfrag(arg, 0, *currsect, lineno);
+    else if (!strcmp(direct, ".p2align")) alignfrag(arg, 1, *currsect, lineno);
+    else if (!strcmp(direct, ".code16"))
+    {
+        g_currsize = 16;
+        newfrag(FRAG_MODE)->mode = 16;
+    }
+    else if (!strcmp(direct, ".code64"))
+    {
+        g_currsize = 64;
+        newfrag(FRAG_MODE)->mode = 64;
+    }
+
+    free(direct);
+}
+
+// Read the input once. Instructions are matched and sized here, so encoding
+// never has to look at the text again. Returns the number of lines
+size_t parse_file()
+{
+    size_t mode = g_currsize;
+    struct section *currsect = NULL;
+
+    char *line = NULL;
+    size_t n = 0;
+    int lineno = 0;
+    while (getline(&line, &n, g_inf) != -1)
+    {
+        s_lineno = ++lineno;
+        if (*line == '\n') continue;
+
+        char *strt = *line == '\t' ? line + 1 : line + 4;
+        if (!isspace(*line)) deflabel(strndup(line, strchr(line, ':') - line), currsect, lineno);
+        else if (*strt == '.') parse_directive(strt, &currsect, lineno);
+        else if (isalpha(*strt))
+        {
+            struct code code = parse_code(strt, lineno);
+            struct inst *inst = searchi(&code);
+            if (!inst)
+                error("Line %d: Invalid instruction: %s\n", lineno, line);
+
+            bind_expr(code.op1.expr, currsect);
+            bind_expr(code.op2.expr, currsect);
+            bind_expr(code.op3.expr, currsect);
+
+            struct frag *frag = newfrag(FRAG_INST);
+            frag->inst.code = code;
+            frag->inst.inst = inst;
+            frag->size = frag->inst.lsize = instsize(inst, &code);
+        }
+
+        struct frag *last = g_fragcnt ? &g_frags[g_fragcnt - 1] : NULL;
+        if (!currsect && last && last->type != FRAG_MODE)
+            error("Line %d: Not in a section\n", lineno);
+
+        if (currsect && currsect->nobits && last && (last->type == FRAG_INST || last->type == FRAG_EXPR
+                || (last->type == FRAG_DATA && last->data) || (last->type == FRAG_ALIGN && last->align.fill > 0)))
+            error("Line %d: Only zeros can go in %s\n", lineno, currsect->name);
+    }
+
+    free(line);
+
+    // Whatever was referenced but never defined comes from another object
+    for (size_t i = 0; i < g_symcnt; i++)
+        if (g_syms[i]->flags & SYM_UNDEF) g_syms[i]->flags |= SYM_GLOB;
+
+    for (size_t i = 0; i < g_fragcnt; i++)
+    {
+        struct frag *frag = &g_frags[i];
+        if (frag->type == FRAG_EXPR) check_expr(frag->expr, frag->lineno);
+        else if (frag->type == FRAG_SIZE) check_expr(frag->symsize.expr, frag->lineno);
+        else if (frag->type == FRAG_INST)
+        {
+            check_expr(frag->inst.code.op1.expr, frag->lineno);
+            check_expr(frag->inst.code.op2.expr, frag->lineno);
+            check_expr(frag->inst.code.op3.expr, frag->lineno);
+        }
+    }
+
+    g_currsize = mode;
+    return lineno;
+}
+
+// Give fragments and labels their offsets into their sections. Each
+// section has its own location counter, runs of it can be interleaved
+static void place()
+{
+    size_t *lcs = calloc(g_sectcnt, sizeof(size_t));
+    size_t *lc = NULL;
+
+    for (size_t i = 0; i < g_fragcnt; i++)
+    {
+        struct frag *frag = &g_frags[i];
+        if (frag->type == FRAG_SECT) lc = &lcs[frag->sect->idx];
+        if (!lc) continue;
+
+        if (frag->type == FRAG_ALIGN) frag->size = -*lc & (frag->align.to - 1);
+
+        frag->off = *lc;
+        if (frag->type == FRAG_LABEL) frag->sym->val = *lc;
+        *lc += frag->size;
+    }
+
+    free(lcs);
+}
+
+static int isrel8(int64_t disp)
+{
+    return disp >= INT8_MIN && disp <= INT8_MAX;
+}
+
+// Branches to labels in the same section start out short. Each round
+// lengthens those that can't reach their target, which moves everything
+// after them, until nothing changes. Branches only ever grow, so this ends
+void layout()
+{
+    struct section *sect = NULL;
+    for (size_t i = 0; i < g_fragcnt; i++)
+    {
+        struct frag *frag = &g_frags[i];
+        if (frag->type == FRAG_SECT) sect = frag->sect;
+        if (frag->type != FRAG_INST || !frag->inst.inst->sopcode) continue;
+
+        struct expr *target = frag->inst.code.op1.expr;
+        if (target && eval_expr(target, 0).sym == sect->sym)
+        {
+            frag->inst.jshort = 1;
+            frag->size = 2;
+        }
+    }
+
+    int grown;
+    do
+    {
+        place();
+
+        grown = 0;
+        for (size_t i = 0; i < g_fragcnt; i++)
+        {
+            struct frag *frag = &g_frags[i];
+            if (frag->type != FRAG_INST || !frag->inst.jshort) continue;
+
+            struct value target = eval_expr(frag->inst.code.op1.expr, frag->off);
+            if (!isrel8(target.val - (frag->off + frag->size)))
+            {
+                frag->inst.jshort = 0;
+                frag->size = frag->inst.lsize;
+                grown = 1;
+            }
+        }
+    } while (grown);
+}
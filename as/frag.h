@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "parse.h"
+
+#define FRAG_INST  0 // Instruction
+#define FRAG_DATA  1 // Bytes from a data directive, zeros if 'data' is NULL
+#define FRAG_LABEL 2 // Label definition
+#define FRAG_SECT  3 // Section switch
+#define FRAG_MODE  4 // .code16/.code64
+#define FRAG_ALIGN 5 // Padding up to a multiple of 'align.to', sized by layout()
+#define FRAG_EXPR  6 // Data directive whose value needs symbols
+#define FRAG_SIZE  7 // .size whose value needs symbols, usually .-name
+
+// A line parsed once and kept in memory for layout and encoding
+struct frag
+{
+    int type;
+    int lineno;
+    size_t size; // Bytes emitted
+    size_t off;  // Offset into the section, set by layout()
+
+    union
+    {
+        struct
+        {
+            struct code code;
+            struct inst *inst;
+            size_t lsize; // Size of the full-length encoding
+            int jshort;   // Branch relaxed to its rel8 form
+        } inst;
+
+        struct
+        {
+            size_t to;
+            int fill; // Fill byte, -1 for NOPs in code and zeros elsewhere
+        } align;
+
+        struct
+        {
+            struct symbol *sym;
+            struct expr *expr;
+        } symsize;
+
+        uint8_t *data;
+        struct expr *expr;
+        struct symbol *sym;
+        struct section *sect;
+        size_t mode;
+    };
+};
+
+size_t parse_file();
+void layout();
@@ -6,6 +6,7 @@
 // op format:
 // | - | - | - | - | - | - | - | - |
 //     | q | l | w | b | i | m | r |
+// Above those: control/debug register, high byte register, XMM/YMM register
 
 #define OP_REG (1 << 0)
 #define OP_MEM (1 << 1)
@@ -28,13 +29,21 @@
 #define OP_CTLREG (1 << 7)
 #define OP_DBGREG (1 << 8)
 #define OP_HIREG  (1 << 9)
+#define OP_XMM    (1 << 10)
+#define OP_YMM    (1 << 11) // Set along with OP_XMM for the 256-bit registers
+
+// XMM register, and XMM register or memory. Any size matches
+#define OP_XMMREG (OP_REG | OP_XMM | OP_SIZEM)
+#define OP_XMMRM  (OP_RM | OP_XMM | OP_SIZEM)
+
+#define ISXMM(op) (ISREG(op) && (op & OP_XMM))
 
 // All excluding 8-bit
 #define OP_SZEX8 (OP_SIZE16 | OP_SIZE32 | OP_SIZE64)
 
 #define OP_ALLSZ (OP_SIZE8 | OP_SZEX8)
 
-#define ISREGSZ(op, sz) ((op & OP_REG) && ((op & OP_SIZEM) & sz))
+#define ISREGSZ(op, sz) ((op & OP_REG) && !(op & OP_XMM) && ((op & OP_SIZEM) & sz))
 
 #define REG_AX  0b0000
 #define REG_CX  0b0001
@@ -101,14 +110,19 @@ struct sib
 #define IF_ROPCODE (1 << 0) // opcode+r
 #define IF_DEF64   (1 << 1) // instruction defaults to 64-bit
 #define IF_REL     (1 << 2) // immediate operand is relative to %rip
+#define IF_VEX     (1 << 3) // VEX encoded, mpre/pre/pre2 fold into the VEX prefix
+#define IF_VVVV    (1 << 4) // op2 goes in VEX.vvvv
 
 struct inst
 {
     const char *mnem; // mnemonic
-    uint64_t op1, op2;
+    uint64_t op1, op2, op3;
+    uint8_t mpre; // mandatory prefix (0x66, 0xf2, 0xf3), goes before REX
     uint8_t pre;
+    uint8_t pre2; // second escape byte (0x38, 0x3a) after 0x0f
     uint8_t opcode;
     uint8_t reg; // reg field in modr/m byte, 0 if unused
+    uint8_t sopcode; // opcode of the rel8 form of a branch, 0 if there is none
     int flags;
     uint8_t size; // optional size attribute
 };
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 FILE *xfopen(const char *path, const char *access)
 {
@@ -71,9 +72,158 @@ char *stresc(const char *str, char delim, size_t *len)
     return strdup(buf);
 }
 
-// Write string to file, including null character
-void fwritestr(const char *str, FILE *file)
+size_t strhash(const char *str)
 {
-    fputs(str, file);
-    fputc(0, file);
+    size_t h = 14695981039346656037UL; // FNV-1a
+    while (*str) h = (h ^ (uint8_t)*str++) * 1099511628211UL;
+    return h;
+}
+
+static size_t htab_slot(struct htab *tab, const char *key)
+{
+    size_t i = strhash(key) & (tab->cap - 1);
+    while (tab->keys[i] && strcmp(tab->keys[i], key))
+        i = (i + 1) & (tab->cap - 1);
+    return i;
+}
+
+void *htab_get(struct htab *tab, const char *key)
+{
+    if (!tab->cap) return NULL;
+    return tab->vals[htab_slot(tab, key)];
+}
+
+// Add or replace 'key'. Grows at half full, so probes stay short
+void htab_put(struct htab *tab, const char *key, void *val)
+{
+    if (2 * (tab->cnt + 1) > tab->cap)
+    {
+        struct htab old = *tab;
+
+        tab->cap = old.cap ? old.cap * 2 : 64;
+        tab->keys = calloc(tab->cap, sizeof(char*));
+        tab->vals = calloc(tab->cap, sizeof(void*));
+
+        for (size_t i = 0; i < old.cap; i++)
+        {
+            if (!old.keys[i]) continue;
+
+            size_t slot = htab_slot(tab, old.keys[i]);
+            tab->keys[slot] = old.keys[i];
+            tab->vals[slot] = old.vals[i];
+        }
+
+        free(old.keys);
+        free(old.vals);
+    }
+
+    size_t slot = htab_slot(tab, key);
+    if (!tab->keys[slot]) tab->cnt++;
+
+    tab->keys[slot] = key;
+    tab->vals[slot] = val;
+}
+
+size_t strtab_add(struct strtab *tab, const char *str)
+{
+    if (tab->cnt == tab->cap)
+    {
+        tab->cap = tab->cap ? tab->cap * 2 : 64;
+        tab->strs = realloc(tab->strs, tab->cap * sizeof(char*));
+    }
+
+    tab->strs[tab->cnt] = str;
+    return tab->cnt++;
+}
+
+struct tail
+{
+    const char *str;
+    size_t len, id;
+};
+
+// The character 'pos' places from the end, -1 once past the start
+static int tailchar(struct tail *t, size_t pos)
+{
+    return pos < t->len ? (uint8_t)t->str[t->len - pos - 1] : -1;
+}
+
+static void swaptails(struct tail *a, struct tail *b)
+{
+    struct tail t = *a;
+    *a = *b;
+    *b = t;
+}
+
+// Sort by the characters from the last back, descending, so a string comes
+// right after every string it is the tail of. Multikey quicksort: the run
+// sharing the pivot's character moves on to the next one, so the characters
+// already known to match are never compared again
+static void sorttails(struct tail *t, size_t n, size_t pos)
+{
+    while (n > 1)
+    {
+        int pivot = tailchar(&t[n / 2], pos);
+
+        size_t gt = 0, i = 0, lt = n;
+        while (i < lt)
+        {
+            int c = tailchar(&t[i], pos);
+            if (c > pivot) swaptails(&t[gt++], &t[i++]);
+            else if (c < pivot) swaptails(&t[i], &t[--lt]);
+            else i++;
+        }
+
+        sorttails(t, gt, pos);
+        sorttails(t + lt, n - lt, pos);
+
+        // All of the middle run ended here, so they are the same string
+        if (pivot == -1) return;
+        t += gt;
+        n = lt - gt;
+        pos++;
+    }
+}
+
+// Give every string its offset, returns the size of the table. Offset 0
+// is the empty name
+size_t strtab_finish(struct strtab *tab)
+{
+    struct tail *tails = malloc(tab->cnt * sizeof(struct tail));
+    for (size_t i = 0; i < tab->cnt; i++)
+        tails[i] = (struct tail) { tab->strs[i], strlen(tab->strs[i]), i };
+    sorttails(tails, tab->cnt, 0);
+
+    tab->offs = malloc(tab->cnt * sizeof(size_t));
+    tab->size = 1;
+    for (size_t i = 0; i < tab->cnt; i++)
+    {
+        struct tail *t = &tails[i], *prev = i ? &tails[i - 1] : NULL;
+        if (!t->len) tab->offs[t->id] = 0;
+        else if (prev && prev->len >= t->len && !memcmp(prev->str + prev->len - t->len, t->str, t->len))
+            tab->offs[t->id] = tab->offs[prev->id] + prev->len - t->len;
+        else
+        {
+            tab->offs[t->id] = tab->size;
+            tab->size += t->len + 1;
+        }
+    }
+
+    free(tails);
+    return tab->size;
+}
+
+// The table itself, strtab_finish() bytes. Strings that share bytes write the same ones
+void strtab_write(struct strtab *tab, void *dst)
+{
+    *(char*)dst = 0;
+    for (size_t i = 0; i < tab->cnt; i++)
+        strcpy((char*)dst + tab->offs[i], tab->strs[i]);
+}
+
+void strtab_free(struct strtab *tab)
+{
+    free(tab->strs);
+    free(tab->offs);
+    *tab = (struct strtab) { 0 };
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdio.h>
+#include <stddef.h>
 
 #define ARRLEN(arr) (sizeof(arr) / sizeof(arr[0]))
 
@@ -9,4 +10,32 @@ void *memdup(void *mem, size_t n);
 long xstrtonum(const char *str, char **end);
 void error(const char *format, ...);
 char *stresc(const char *str, char delim, size_t *len);
-void fwritestr(const char *str, FILE *file);
+
+size_t strhash(const char *str);
+
+// Symbol and section lookup by name, open addressing. Keys are not copied
+struct htab
+{
+    const char **keys;
+    void **vals;
+    size_t cap, cnt;
+};
+
+void *htab_get(struct htab *tab, const char *key);
+void htab_put(struct htab *tab, const char *key, void *val);
+
+// Builds .strtab and .shstrtab. strtab_add() hands out ids while the symbols
+// and sections are numbered, then strtab_finish() sorts all the names at once
+// and stores a name ending another (".text" in ".rela.text") inside it. The
+// offsets are in 'offs' after that. Strings are not copied
+struct strtab
+{
+    const char **strs;
+    size_t *offs;
+    size_t cnt, cap, size;
+};
+
+size_t strtab_add(struct strtab *tab, const char *str);
+size_t strtab_finish(struct strtab *tab);
+void strtab_write(struct strtab *tab, void *dst);
+void strtab_free(struct strtab *tab);
@@ -3,49 +3,47 @@
 #include "lib.h"
 #include "asm.h"
 #include "sym.h"
+#include "frag.h"
 
 #include <stdio.h>
 #include <getopt.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 static char *inf_name = NULL;
 static char *outf_name = NULL;
+static int s_timing = 0;
 
 void usage()
 {
-    fprintf(stderr, "usage: as <input> -o <output>\n");
+    fprintf(stderr, "usage: as [-t] <input> -o <output>\n");
     exit(-1);
 }
 
 void do_cmd_args(int argc, char **argv)
 {
     char opt;
-    while ((opt = getopt(argc, argv, "o:")) != -1)
+    while ((opt = getopt(argc, argv, "o:t")) != -1)
     {
         switch (opt)
         {
             case 'o':
                 outf_name = strdup(optarg);
                 break;
+            case 't':
+                s_timing = 1;
+                break;
 
             default: usage(); break;
         }
     }
 
-    for (char **arg = argv + 1; *arg; arg++)
-    {
-        if ((*arg)[0] == '-' && (*arg)[1] == 'o') arg++;
-        else
-        {
-            inf_name = strdup(*arg);
-            break;
-        }
-    }
-
-    if (!inf_name)
+    if (optind >= argc)
         usage();
 
+    inf_name = strdup(argv[optind]);
+
     if (!outf_name)
     {
         outf_name = strndup(inf_name, strrchr(inf_name, '.') - inf_name + 2);
@@ -80,11 +78,22 @@ int main(int argc, char **argv)
     };
     addsym(&sym);
 
-    collect_syms();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t lines = parse_file();
+    layout();
     assemble_file();
 
     cleanup();
 
+    if (s_timing)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "as: %zu lines in %.3f s, %.0f lines/s\n", lines, secs, lines / secs);
+    }
+
     // TODO: TEMP
     //char cmd[64];
     //snprintf(cmd, 64, "gcc %s -static -fpie", outf_name);
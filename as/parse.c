@@ -1,4 +1,5 @@
 #include "parse.h"
+#include "expr.h"
 #include "sym.h"
 #include "lib.h"
 
@@ -8,6 +9,7 @@
 #include <stdio.h>
 
 static char *s_str = NULL;
+static int s_lineno; // For errors
 
 static void parse_reg(struct codeop *op)
 {
@@ -15,6 +17,22 @@ static void parse_reg(struct codeop *op)
 
     s_str++;
 
+    if (!strncmp(s_str, "xmm", 3))
+    {
+        s_str += 3;
+        op->type |= OP_XMM | OP_SIZEM;
+        op->val = strtol(s_str, (char**)&s_str, 10);
+        return;
+    }
+
+    if (!strncmp(s_str, "ymm", 3))
+    {
+        s_str += 3;
+        op->type |= OP_XMM | OP_YMM | OP_SIZEM;
+        op->val = strtol(s_str, (char**)&s_str, 10);
+        return;
+    }
+
     if (!strncmp(s_str, "cs", 2))
     {
         op->type |= OP_SIZE32;
@@ -84,22 +102,27 @@ static uint64_t parse_digit_op()
     return xstrtonum(s_str, &s_str);
 }
 
+// Immediate or displacement. Constant expressions are folded right away
+static void parse_value(struct codeop *op)
+{
+    op->expr = parse_expr(&s_str, s_lineno);
+    if (expr_isconst(op->expr))
+    {
+        op->val = eval_expr(op->expr, 0).val;
+        op->expr = NULL;
+    }
+}
+
 static void parse_address(struct codeop *op)
 {
     op->type = OP_MEM;
     op->sib.base = REG_NUL;
     op->sib.idx  = REG_NUL;
 
-    if (isdigit(*s_str) || *s_str == '-')
-    {
-        op->val = parse_digit_op();
-    }
-    else if (isalpha(*s_str) || *s_str == '_')
-    {
-        op->sym = strndup(s_str, strpbrk(s_str, ",\n(") - s_str);
-        s_str = strpbrk(s_str, ",\n(");
-    }
-    else op->sib.flags |= SIB_NODISP;
+    // A '(' starts the base and index unless it's a parenthesized displacement
+    if (*s_str == '(' && (s_str[1] == '%' || s_str[1] == ','))
+        op->sib.flags |= SIB_NODISP;
+    else parse_value(op);
 
     if (*s_str != '(') return;
 
@@ -130,23 +153,6 @@ static void parse_address(struct codeop *op)
     s_str++;
 }
 
-static int parse_charconst()
-{
-    s_str++;
-
-    size_t len;
-    char *v = stresc(s_str, '\'', &len);
-
-    if (strlen(v) > 1)
-        error("Invalid character constant\n");
-
-    s_str += len;
-
-    char c = *v;
-    free(v);
-    return c;
-}
-
 static struct codeop parse_op()
 {
     struct codeop op = { 0 };
@@ -157,6 +163,9 @@ static struct codeop parse_op()
     else if (!strncmp(s_str, "u32 ", 4)) { op.type |= OP_SIZE32; s_str += 4; }
     else if (!strncmp(s_str, "u64 ", 4)) { op.type |= OP_SIZE64; s_str += 4; }
 
+    // parse_address() resets the type, keep the size prefix
+    uint64_t size = op.type;
+
     switch (*s_str)
     {
         case '%':
@@ -166,27 +175,22 @@ static struct codeop parse_op()
                 op.sib.seg = op.val;
                 s_str++;
                 parse_address(&op);
+                op.type |= size;
             }
             break;
 
-        case '$': // TODO: evaluate constant expressions
+        case '$':
             if (!op.type) op.type |= OP_ALLSZ;
             op.type |= OP_IMM;
 
-            if (isdigit(*(++s_str))) op.val = parse_digit_op();
-            else if (*s_str == '\'')
-                op.val = parse_charconst();
-            else
-            {
-                op.sym = strndup(s_str, strpbrk(s_str, ",\n") - s_str);
-                s_str = strpbrk(s_str, ",\n");
-            }
-
+            s_str++;
+            parse_value(&op);
             break;
 
         default:
         {
             parse_address(&op);
+            op.type |= size;
             break;
         }
     }
@@ -194,9 +198,10 @@ static struct codeop parse_op()
     return op;
 }
 
-struct code parse_code(const char *str)
+struct code parse_code(const char *str, int lineno)
 {
     s_str = (char*)str;
+    s_lineno = lineno;
 
     const char *mnem = s_str;
 
@@ -212,6 +217,13 @@ struct code parse_code(const char *str)
     s_str += 2;
 
     code.op2 = parse_op();
+
+    // Third operand, only VEX and immediate-form SSE instructions have one
+    if (s_str[0] == ',')
+    {
+        s_str += 2;
+        code.op3 = parse_op();
+    }
   
     if (code.op1.type & OP_MEM && !(code.op1.type & OP_SIZEM))
     {
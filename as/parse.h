@@ -4,17 +4,19 @@
 
 #include "inst.h"
 
+struct expr;
+
 struct codeop
 {
     uint64_t type, val;
     struct sib sib;
-    const char *sym;
+    struct expr *expr; // Value that needs symbols, evaluated after layout. NULL if 'val' is it
 };
 
 struct code
 {
     char *mnem;
-    struct codeop op1, op2;
+    struct codeop op1, op2, op3;
 };
 
-struct code parse_code(const char *str);
+struct code parse_code(const char *str, int lineno);
@@ -10,132 +10,74 @@
 #include <ctype.h>
 #include <stdlib.h>
 
+static struct htab s_symtab;  // Name -> symbol
+static struct htab s_secttab; // Name -> section
+static size_t s_symcap, s_sectcap;
+
+// "function", "@function" or "%function", and the same for the others
 int symtypestr(const char *str)
 {
-    if (!strcmp(str, "func")) return SYMT_FUNC;
-    else if (!strcmp(str, "object")) return SYMT_FUNC;
+    if (*str == '@' || *str == '%') str++;
+
+    if (!strcmp(str, "func") || !strcmp(str, "function")) return SYMT_FUNC;
+    else if (!strcmp(str, "object")) return SYMT_OBJECT;
     else if (!strcmp(str, "file")) return SYMT_FILE;
 
     return -1;
 }
 
-void collect_syms()
-{
-    uint64_t lc = 0; // Location counter
-
-    struct section *currsect = NULL;
-
-    char *line = NULL;
-    size_t n = 0;
-    int lineno = 0;
-    while (getline(&line, &n, g_inf) != -1)
-    {
-        lineno++;
-        if (*line == '\n') continue;
-        if (!isspace(*line))
-        {
-            // Label
-            char *lbl = strdup(line);
-            *strchr(lbl, ':') = 0;
-
-            struct symbol sym = {
-                .name = lbl,
-                .val = lc - currsect->offset,
-                .sect = currsect
-            };
-
-            addsym(&sym);
-            continue;
-        }
-
-        char *strt = *line == '\t' ? line + 1 : line + 4;
-        if (*strt == '.')
-        {
-            if (!strncmp(strt, ".str", 4))
-            {
-                char *direct = strt + 6;
-                char *str = stresc(direct, '"', NULL);
-                lc += strlen(str) + 1;
-                free(str);
-            }
-            else if (!strncmp(strt, ".section", 8))
-            {
-                char *nstrt = strt + 9;
-                char *name = strndup(nstrt, strchr(nstrt, '\n') - nstrt);
-                currsect = addsect(name);
-                currsect->offset = lc;
-            }
-            else if (!strncmp(strt, ".byte", 5)) lc++;
-            else if (!strncmp(strt, ".word", 5)) lc += 2;
-            else if (!strncmp(strt, ".long", 5)) lc += 4;
-            else if (!strncmp(strt, ".quad", 5)) lc += 8;
-            else if (!strncmp(strt, ".skip", 5))
-            {
-                strt += 6;
-                lc += xstrtonum(strt, NULL);
-            }
-            else if (!strncmp(strt, ".code16", 7))
-                g_currsize = 16;
-            else if (!strncmp(strt, ".code64", 7))
-                g_currsize = 64;
-        }
-        else if (isalpha(*strt))
-        {
-            // Instruction
-            struct code code = parse_code(strt);
-            struct inst *inst = searchi(&code);
-            if (!inst)
-                error("Line %d: Invalid instruction: %s\n", lineno, line);
-            lc += instsize(inst, &code);
-        }
-    }
-
-    free(line);
-    fseek(g_inf, 0, SEEK_SET);
-}
-
 struct symbol *findsym(const char *name)
 {
-    for (struct symbol *sym = g_syms; sym; sym = sym->next)
-        if (!strcmp(sym->name, name)) return sym;
-    return NULL;
+    return htab_get(&s_symtab, name);
 }
 
 struct symbol *addsym(struct symbol *sym)
 {
-    struct symbol **last;
-    for (last = &g_syms; (*last); last = &((*last)->next));
-    return *last = memdup(sym, sizeof(struct symbol));
+    if (g_symcnt == s_symcap)
+    {
+        s_symcap = s_symcap ? s_symcap * 2 : 256;
+        g_syms = realloc(g_syms, s_symcap * sizeof(struct symbol*));
+    }
+
+    struct symbol *new = memdup(sym, sizeof(struct symbol));
+    new->idx = g_symcnt;
+    g_syms[g_symcnt++] = new;
+
+    if (!findsym(new->name)) htab_put(&s_symtab, new->name, new);
+    return new;
 }
 
-static int sym_compar(const void *a, const void *b)
+// Symbol 'name' for a reference. Until its label shows up it's an undefined
+// placeholder, which the label then fills in
+struct symbol *refsym(const char *name)
 {
-    int a1 = ((*(struct symbol**)a)->flags & SYM_GLOB);
-    int b1 = ((*(struct symbol**)b)->flags & SYM_GLOB);
+    struct symbol *sym = findsym(name);
+    if (sym) return sym;
 
-    return a1 == b1 ? 0 : a1 > b1 ? 1 : -1;
+    struct symbol ref = {
+        .name = strdup(name),
+        .flags = SYM_UNDEF
+    };
+    return addsym(&ref);
 }
 
-// Sort by binding
+// Sort by binding, locals first. Stable, so symbols keep their order within each group
 void sort_symbols()
 {
-    struct symbol *sym;
-    size_t nitems = 0;
-    for (sym = g_syms; sym; sym = sym->next) nitems++;
-
-    if (!nitems) return;
-
-    struct symbol **arr = malloc(nitems * sizeof(struct symbol*));
-    struct symbol **arrp = arr;
-    for (sym = g_syms; sym; sym = sym->next) *arrp++ = sym;
+    struct symbol **arr = malloc(g_symcnt * sizeof(struct symbol*));
 
-    qsort(arr, nitems, sizeof(struct symbol*), sym_compar);
+    size_t n = 0;
+    for (int glob = 0; glob <= 1; glob++)
+    {
+        for (size_t i = 0; i < g_symcnt; i++)
+            if (!!(g_syms[i]->flags & SYM_GLOB) == glob) arr[n++] = g_syms[i];
+    }
 
-    for (size_t i = 0; i < nitems - 1; i++) arr[i]->next = arr[i + 1];
-    g_syms = arr[0];
-    arr[nitems - 1]->next = NULL;
+    for (size_t i = 0; i < g_symcnt; i++) arr[i]->idx = i;
 
-    free(arr);
+    free(g_syms);
+    g_syms = arr;
+    s_symcap = g_symcnt;
 }
 
 struct section *creatsect(const char *name)
@@ -144,46 +86,66 @@ struct section *creatsect(const char *name)
     return memdup(&s, sizeof(struct section));
 }
 
-struct section *addsect(const char *name)
+// Put 'sect' at index 'idx' of g_sects, shifting the ones after it
+void insertsect(struct section *sect, size_t idx)
 {
-    struct section **last;
-    for (last = &g_sects; (*last); last = &((*last)->next));
-    return *last = creatsect(name);
+    if (g_sectcnt == s_sectcap)
+    {
+        s_sectcap = s_sectcap ? s_sectcap * 2 : 16;
+        g_sects = realloc(g_sects, s_sectcap * sizeof(struct section*));
+    }
+
+    memmove(&g_sects[idx + 1], &g_sects[idx], (g_sectcnt - idx) * sizeof(struct section*));
+    g_sects[idx] = sect;
+    g_sectcnt++;
+
+    for (size_t i = idx; i < g_sectcnt; i++) g_sects[i]->idx = i;
+
+    if (!findsect(sect->name)) htab_put(&s_secttab, sect->name, sect);
 }
 
-struct section *findsect(const char *name)
+struct section *addsect(const char *name)
 {
-    for (struct section *sect = g_sects; sect; sect = sect->next)
-        if (!strcmp(sect->name, name)) return sect;
-    return NULL;
+    struct section *sect = creatsect(name);
+    insertsect(sect, g_sectcnt);
+    return sect;
 }
 
-size_t sectcnt()
+struct section *findsect(const char *name)
 {
-    size_t i = 0;
-    for (struct section *s = g_sects; s; s = s->next) i++;
-    return i;
+    return htab_get(&s_secttab, name);
 }
 
-size_t sectnum(struct section *sect)
+// Grow 'sect' by 'n' bytes, returns where they go
+uint8_t *sect_reserve(struct section *sect, size_t n)
 {
-    size_t i = 0;
-    for (struct section *s = g_sects; s && s != sect; s = s->next) i++;
-    return i;
+    if (sect->size + n > sect->cap)
+    {
+        sect->cap = sect->cap ? sect->cap * 2 : 256;
+        if (sect->cap < sect->size + n) sect->cap = sect->size + n;
+        sect->data = realloc(sect->data, sect->cap);
+    }
+
+    uint8_t *p = sect->data + sect->size;
+    sect->size += n;
+    return p;
 }
 
 struct reloc *sect_add_reloc(struct section *sect, size_t offset, struct symbol *sym, int64_t addend, int flags)
 {
-    struct reloc **last;
-    for (last = &sect->rels; *last; last = &((*last)->next));
+    if (sect->relcnt == sect->relcap)
+    {
+        sect->relcap = sect->relcap ? sect->relcap * 2 : 64;
+        sect->rels = realloc(sect->rels, sect->relcap * sizeof(struct reloc));
+    }
 
-    struct reloc rel = {
+    struct reloc *rel = &sect->rels[sect->relcnt++];
+    *rel = (struct reloc) {
         .sym = sym,
         .addend = addend,
         .offset = offset,
         .flags = flags
     };
 
-    *last = memdup(&rel, sizeof(struct reloc));
-    return *last;
+    return rel;
 }
@@ -24,20 +24,22 @@ struct symbol
     int flags; // Flags
     size_t size;
     struct section *sect;
-    struct symbol *next; // Next symbol in linked-list
+    size_t idx; // Index into g_syms, ELF symbol index - 1 once sorted
 };
 
 int symtypestr(const char *str);
 
-void collect_syms();
 struct symbol *findsym(const char *name);
 struct symbol *addsym(struct symbol *sym);
+struct symbol *refsym(const char *name);
 void sort_symbols();
 
 #define REL_PC32  R_X86_64_PC32
 #define REL_64    R_X86_64_64
+#define REL_32    R_X86_64_32
 #define REL_32S   R_X86_64_32S
 #define REL_16    R_X86_64_16
+#define REL_8     R_X86_64_8
 #define REL_PLT   R_X86_64_PLT32
 
 struct reloc
@@ -46,24 +48,27 @@ struct reloc
     int64_t addend;
     unsigned int offset;
     int flags;
-    
-    struct reloc *next;
 };
 
 struct section
 {
     const char *name;   // Name
     struct reloc *rels; // Relocations
-    unsigned int offset, size;
+    size_t relcnt, relcap;
+    uint8_t *data;      // Contents, 'size' bytes of 'cap'
+    size_t cap;
+    unsigned int offset, size; // Offset into the output file, set when it's written
     int namei;
-
-    struct section *next;
+    size_t idx;         // Index into g_sects, ELF section index - 1
+    size_t align;       // Largest .align in it
+    int nobits;         // Only zeros (.bss), its size takes no space in the file
+    struct symbol *sym; // Section symbol
 };
 
 struct section *addsect(const char *name);
 struct section *findsect(const char *name);
 struct section *creatsect(const char *name);
-size_t sectcnt();
-size_t sectnum(struct section *sect);
+void insertsect(struct section *sect, size_t idx);
+uint8_t *sect_reserve(struct section *sect, size_t n);
 
 struct reloc *sect_add_reloc(struct section *sect, size_t offset, struct symbol *sym, int64_t addend, int flags);
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Assembler throughput in lines per second, on a generated file shaped like
+# comp output. Run from as/: tests/bench.sh [functions]
+
+n=${1:-5000}
+src=${TMPDIR:-/tmp}/as-bench.s
+
+awk -v n="$n" 'BEGIN {
+    print "    .section .text"
+    for (i = 0; i < n; i++) {
+        printf "    .global f%d\n    .type f%d, func\nf%d:\n", i, i, i
+        print "    push %rbp"
+        print "    mov %rsp, %rbp"
+        print "    sub $32, %rsp"
+        print "    mov %rdi, -8(%rbp)"
+        printf "L%d:\n", i
+        print "    mov -8(%rbp), %rbx"
+        print "    mov $1000, %r12"
+        print "    cmp %r12, %rbx"
+        print "    setl %al"
+        print "    movzx %al, %r13"
+        print "    test %r13, %r13"
+        printf "    jz $E%d\n", i
+        print "    add $1, %rbx"
+        print "    mov %rbx, -8(%rbp)"
+        printf "    call $f%d\n", (i + 1) % n
+        printf "    jmp $L%d\n", i
+        printf "E%d:\n", i
+        print "    mov -8(%rbp), %rax"
+        print "    leave"
+        print "    ret"
+    }
+}' > "$src"
+
+./dist/as -t "$src" -o "${src%.s}.o" > /dev/null
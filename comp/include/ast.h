@@ -41,10 +41,13 @@ enum OPERATOR
     OP_BITOREQ,
 };
 
+#define ISCMPOP(op) ((op) >= OP_LT && (op) <= OP_NEQUAL)
+
 enum AST_TYPE
 {
     A_BINOP,
     A_INTLIT,
+    A_FLTLIT,
     A_FUNCDEF,
     A_VARDEF,
     A_BLOCK,
@@ -75,6 +78,14 @@ struct rostr
     int  lbl;
 };
 
+// Floating-point constant, loaded from .rodata
+struct roflt
+{
+    double val;
+    int size; // 4 for float32, 8 for float64
+    int lbl;
+};
+
 struct ast
 {
     int type, lvalue; // TODO: I don't like this 'lvalue' nonsense for determining if a dereference is a load or store - come up with a better way
@@ -105,7 +116,7 @@ struct ast
             char *name;
             struct ast *block;
             int endlbl;
-            char *params[6];
+            char **params;
         } funcdef;
 
         struct
@@ -120,6 +131,8 @@ struct ast
             struct symtable symtab;
             struct rostr *strs;
             unsigned int strcnt;
+            struct roflt *flts;
+            unsigned int fltcnt;
         } block;
 
         struct
@@ -160,6 +173,11 @@ struct ast
             unsigned int idx;
         } strlit;
 
+        struct
+        {
+            unsigned int idx;
+        } fltlit;
+
         struct
         {
             struct type t;
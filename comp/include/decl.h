@@ -9,7 +9,17 @@
 struct token;
 struct ast;
 
+// Code generation options (-f<option>, -m<option>)
+#define OPT_OMITFP      (1 << 0) // -fomit-frame-pointer
+#define OPT_NOVECTORIZE (1 << 1) // -fno-tree-vectorize
+#define OPT_AVX2        (1 << 2) // -mavx2
+#define OPT_FUNCSECTS   (1 << 3) // -ffunction-sections
+#define OPT_DATASECTS   (1 << 4) // -fdata-sections
+
 extern_ FILE *g_inf;
 extern_ FILE *g_outf;
 extern_ struct token *g_toks;
 extern_ struct ast *g_ast;
+extern_ int g_opts;
+extern_ int g_alignfuncs; // -falign-functions[=N], 0 if off
+extern_ int g_alignloops; // -falign-loops[=N], 0 if off
@@ -22,7 +22,7 @@ enum TOKTYPE
     T_MODEQ,
     T_SHL,
     T_SHR,
-    T_INTLIT, T_STRLIT,
+    T_INTLIT, T_FLTLIT, T_STRLIT,
     T_SEMI,
     T_COMMA,
     T_AMP,
@@ -57,6 +57,7 @@ struct token
     union
     {
         unsigned long ival;
+        double fval;
         char *sval;
     } v;
     int line, col;
@@ -24,6 +24,7 @@ struct sym
     char *name;
     struct type type;
     size_t stackoff; // If local
+    struct ast *init; // Constant a global starts out as, NULL for zero
 };
 
 #define SYMTAB_GLOB  1 // Global symbol table
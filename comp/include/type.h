@@ -20,7 +20,7 @@ struct type
     struct
     {
         struct type *ret;
-        struct type *params[6];
+        struct type *params; // Array of 'paramcnt' types
         unsigned int paramcnt;
         int variadic;
     } func;
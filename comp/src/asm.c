@@ -30,3 +30,9 @@ size_t asm_sizeof(struct type type)
 
     return prim * (type.arrlen ? type.arrlen : 1);
 }
+
+// Scalar float32/float64 values, held in XMM registers
+int asm_isfloat(struct type type)
+{
+    return !type.ptr && !type.arrlen && (type.name == TYPE_FLOAT32 || type.name == TYPE_FLOAT64);
+}
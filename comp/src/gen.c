@@ -3,11 +3,13 @@
 #include "asm.h"
 #include "ast.h"
 #include "decl.h"
+#include "util.h"
 
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
-#define CMPEXPR(ast) (ast->type == A_BINOP && ((ast->binop.op > OP_LT && ast->binop.op < OP_NEQUAL) || ast->binop.op == OP_LAND || ast->binop.op == OP_LOR))
+#define CMPEXPR(ast) (ast->type == A_BINOP && (ISCMPOP(ast->binop.op) || ast->binop.op == OP_LAND || ast->binop.op == OP_LOR))
 
 // Only for the .text section
 #define CODE_INST 0
@@ -199,20 +201,96 @@ enum INSTS
     INST_JMP
 };
 
-static const char *regs8[]  = { "%r8b", "%r9b", "%r10b", "%r11b" };
-static const char *regs16[] = { "%r8w", "%r9w", "%r10w", "%r11w" };
-static const char *regs32[] = { "%r8d", "%r9d", "%r10d", "%r11d" };
-static const char *regs64[] = { "%r8",  "%r9",  "%r10",  "%r11" };
+// General purpose registers, in encoding order
+enum GPR
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15,
+    GPRCNT
+};
+
+static const char *regs8[GPRCNT] =
+{
+    "%al", "%cl", "%dl", "%bl", "%spl", "%bpl", "%sil", "%dil",
+    "%r8b", "%r9b", "%r10b", "%r11b", "%r12b", "%r13b", "%r14b", "%r15b"
+};
+
+static const char *regs16[GPRCNT] =
+{
+    "%ax", "%cx", "%dx", "%bx", "%sp", "%bp", "%si", "%di",
+    "%r8w", "%r9w", "%r10w", "%r11w", "%r12w", "%r13w", "%r14w", "%r15w"
+};
+
+static const char *regs32[GPRCNT] =
+{
+    "%eax", "%ecx", "%edx", "%ebx", "%esp", "%ebp", "%esi", "%edi",
+    "%r8d", "%r9d", "%r10d", "%r11d", "%r12d", "%r13d", "%r14d", "%r15d"
+};
+
+static const char *regs64[GPRCNT] =
+{
+    "%rax", "%rcx", "%rdx", "%rbx", "%rsp", "%rbp", "%rsi", "%rdi",
+    "%r8", "%r9", "%r10", "%r11", "%r12", "%r13", "%r14", "%r15"
+};
+
+#define XMMCNT 16
+
+static const char *xmmregs[XMMCNT] =
+{
+    "%xmm0", "%xmm1", "%xmm2",  "%xmm3",  "%xmm4",  "%xmm5",  "%xmm6",  "%xmm7",
+    "%xmm8", "%xmm9", "%xmm10", "%xmm11", "%xmm12", "%xmm13", "%xmm14", "%xmm15"
+};
+
+static const char *ymmregs[XMMCNT] =
+{
+    "%ymm0", "%ymm1", "%ymm2",  "%ymm3",  "%ymm4",  "%ymm5",  "%ymm6",  "%ymm7",
+    "%ymm8", "%ymm9", "%ymm10", "%ymm11", "%ymm12", "%ymm13", "%ymm14", "%ymm15"
+};
+
+#define CALLEESAVED ((1 << RBX) | (1 << RBP) | (1 << R12) | (1 << R13) | (1 << R14) | (1 << R15))
+
+// Allocation order, picked per statement. Without a call nothing has to
+// survive one, so scratch registers come first and nothing needs saving. With
+// a call, callee-saved registers come first: they are saved once in the
+// prologue and survive calls. The pool then keeps clear of the parameter
+// registers so arguments can be moved into place without conflicts. %rbp is
+// only used with -fomit-frame-pointer.
+static const int s_scratchregs[] = { R8, R9, R10, R11, RBX, R12, R13, R14, R15, RBP };
+static const int s_callregs[]    = { RBX, R12, R13, R14, R15, RBP, R10, R11 };
+
+// Float temporaries. xmm0-7 carry arguments, so this stays clear of them just
+// like the integer pools. No XMM register survives a call
+static const int s_xmmpool[] = { 8, 9, 10, 11, 12, 13, 14, 15 };
 
 static struct symtable *s_currscope = NULL;
 static struct ast      *s_globlscope = NULL;
 
-#define REGCNT (sizeof(regs64) / sizeof(regs64[0]))
 #define NOREG (-1)
 
-#define DISCARD(expr) { int r = expr; if (r != NOREG) regfree(r); }
+#define REDZONE 128 // Bytes below %rsp a leaf function may use without adjusting it
 
-static int reglist[REGCNT] = { 0 };
+#define DISCARD(node) { struct ast *n = node; mkpool(n); int r = gen_code(n); if (r != NOREG) valfree(n, r); }
+
+// Stack frame of the function being generated
+struct frame
+{
+    size_t locals; // Bytes of local variables, addressed down from the top of the frame
+    size_t size;   // Bytes subtracted from %rsp in the prologue
+    size_t depth;  // Bytes currently pushed below the frame
+    int leaf;      // No calls, so no alignment is needed and the red zone is usable
+    int redzone;   // Locals live in the red zone and %rsp is never adjusted
+    int omitfp;    // Locals are addressed off %rsp and %rbp is allocatable
+    int spilled;   // A register was pushed to make room
+    int saved;     // Callee-saved registers used, preserved by the prologue
+
+    int pool[GPRCNT]; // Allocatable registers in order of preference
+    unsigned int poolcnt;
+};
+
+static struct frame s_frame;
+
+static int reglist[GPRCNT] = { 0 };
+static int xreglist[XMMCNT] = { 0 };
 
 static int label()
 {
@@ -220,22 +298,66 @@ static int label()
     return labels++;
 }
 
-static int spillreg = 0;
+static int spillreg = 0, xspillreg = 0;
+
+static void asm_push(const char *reg)
+{
+    fprintf(g_outf, "\tpush %s\n", reg);
+    s_frame.depth += 8;
+}
+
+static void asm_pop(const char *reg)
+{
+    fprintf(g_outf, "\tpop %s\n", reg);
+    s_frame.depth -= 8;
+}
+
+// XMM registers can't be pushed, the low 8 bytes are stored instead
+static void asm_xpush(int x)
+{
+    fprintf(g_outf, "\tsub $8, %%rsp\n");
+    fprintf(g_outf, "\tmovsd %s, (%%rsp)\n", xmmregs[x]);
+    s_frame.depth += 8;
+}
+
+static void asm_xpop(int x)
+{
+    fprintf(g_outf, "\tmovsd (%%rsp), %s\n", xmmregs[x]);
+    fprintf(g_outf, "\tadd $8, %%rsp\n");
+    s_frame.depth -= 8;
+}
+
+static int hascall(struct ast *ast);
+
+// Registers for the statement (or condition) 'stmt', before it takes any
+static void mkpool(struct ast *stmt)
+{
+    int calls = hascall(stmt);
+    const int *order = calls ? s_callregs : s_scratchregs;
+    size_t cnt = calls ? ARRLEN(s_callregs) : ARRLEN(s_scratchregs);
+
+    s_frame.poolcnt = 0;
+    for (size_t i = 0; i < cnt; i++)
+        if (order[i] != RBP || s_frame.omitfp) s_frame.pool[s_frame.poolcnt++] = order[i];
+}
 
 // Allocate a register
 static int regalloc()
 {
-    for (unsigned int i = 0; i < REGCNT; i++)
+    for (unsigned int i = 0; i < s_frame.poolcnt; i++)
     {
-        if (!reglist[i])
+        int r = s_frame.pool[i];
+        if (!reglist[r])
         {
-            reglist[i] = 1;
-            return i;
+            reglist[r] = 1;
+            if (CALLEESAVED & (1 << r)) s_frame.saved |= 1 << r;
+            return r;
         }
     }
 
-    int r = (spillreg++ % REGCNT);
-    fprintf(g_outf, "\tpush %s\n", regs64[r]);
+    int r = s_frame.pool[spillreg++ % s_frame.poolcnt];
+    asm_push(regs64[r]);
+    s_frame.spilled = 1;
     return r;
 }
 
@@ -243,12 +365,79 @@ static void regfree(int r)
 {
     if (spillreg > 0)
     {
-        r = (--spillreg & REGCNT);
-        fprintf(g_outf, "\tpop %s\n", regs64[r]);
+        r = s_frame.pool[--spillreg % s_frame.poolcnt];
+        asm_pop(regs64[r]);
     }
     else reglist[r] = 0;
 }
 
+// Allocate an XMM register for a float
+static int xregalloc()
+{
+    for (size_t i = 0; i < ARRLEN(s_xmmpool); i++)
+    {
+        int x = s_xmmpool[i];
+        if (!xreglist[x])
+        {
+            xreglist[x] = 1;
+            return x;
+        }
+    }
+
+    int x = s_xmmpool[xspillreg++ % ARRLEN(s_xmmpool)];
+    asm_xpush(x);
+    s_frame.spilled = 1;
+    return x;
+}
+
+static void xregfree(int x)
+{
+    if (xspillreg > 0)
+    {
+        x = s_xmmpool[--xspillreg % ARRLEN(s_xmmpool)];
+        asm_xpop(x);
+    }
+    else xreglist[x] = 0;
+}
+
+// Free the register holding the value of 'ast', which is an XMM register for floats
+static void valfree(struct ast *ast, int r)
+{
+    if (asm_isfloat(ast->vtype)) xregfree(r);
+    else regfree(r);
+}
+
+// Instruction suffix for scalar float operations, 'ss' or 'sd'
+static char fsfx(struct type t)
+{
+    return asm_sizeof(t) == 4 ? 's' : 'd';
+}
+
+static int issigned(struct type t)
+{
+    return !t.ptr && t.name <= TYPE_INT64;
+}
+
+// Memory operand of a local variable's stack slot
+static const char *asm_local(struct sym *sym)
+{
+    static char buf[32];
+
+    if (s_frame.omitfp)
+        snprintf(buf, sizeof(buf), "%ld(%%rsp)", (long)(s_frame.locals - sym->stackoff + s_frame.depth));
+    else
+        snprintf(buf, sizeof(buf), "-%lu(%%rbp)", sym->stackoff);
+    return buf;
+}
+
+// Globals are addressed relative to %rip, shorter than absolute and position independent
+static const char *asm_global(struct sym *sym)
+{
+    static char buf[128];
+    snprintf(buf, sizeof(buf), "%s(%%rip)", sym->name);
+    return buf;
+}
+
 static const char *setinsts[] =
 {
     [OP_EQUAL]  = "setz",
@@ -259,23 +448,37 @@ static const char *setinsts[] =
     [OP_LTE]    = "setle"
 };
 
+// Inverted, jumps past the block when the condition fails
 static const char *jmpinsts[] =
 {
     [OP_EQUAL]  = "jne",
     [OP_NEQUAL] = "je",
-    [OP_GT]     = "jl",
-    [OP_LT]     = "jg",
-    [OP_GTE]    = "jle",
-    [OP_LTE]    = "jge"
+    [OP_GT]     = "jle",
+    [OP_LT]     = "jge",
+    [OP_GTE]    = "jl",
+    [OP_LTE]    = "jg"
+};
+
+// Float compares set flags like unsigned ones. < and <= are turned around
+// into > and >=, see asm_fcmp()
+static const char *fsetinsts[] =
+{
+    [OP_GT]     = "seta",
+    [OP_GTE]    = "setae"
+};
+
+static const char *fjmpinsts[] =
+{
+    [OP_GT]     = "jbe",
+    [OP_GTE]    = "jb"
 };
 
 static int asm_addrof(struct sym *sym, int r)
 {
     if (sym->attr & SYM_GLOBAL)
-        //fprintf(g_outf, "\tleaq\t%s(%%rip), %s\n", sym->name, regs64[r]);
-        fprintf(g_outf, "\tmov $%s, %s\n", sym->name, regs64[r]);
+        fprintf(g_outf, "\tlea %s, %s\n", asm_global(sym), regs64[r]);
     else
-        fprintf(g_outf, "\tlea -%lu(%%rbp), %s\n", sym->stackoff, regs64[r]);
+        fprintf(g_outf, "\tlea %s, %s\n", asm_local(sym), regs64[r]);
     return r;
 }
 
@@ -292,6 +495,19 @@ void asm_label(int lbl)
     fprintf(g_outf, "L%d:\n", lbl);
 }
 
+// Pad to a multiple of 'n' bytes, nothing if 0
+void asm_align(int n)
+{
+    if (n) fprintf(g_outf, "\t.align %d\n", n);
+}
+
+// Loop heads are branch targets on every iteration, worth aligning
+void asm_looplabel(int lbl)
+{
+    asm_align(g_alignloops);
+    asm_label(lbl);
+}
+
 void asm_jump(int lbl)
 {
     fprintf(g_outf, "\tjmp $L%d\n", lbl);
@@ -307,60 +523,94 @@ void asm_section(const char *name)
     fprintf(g_outf, "\t.section %s\n", name);
 }
 
+// .text.<name> and the like, so the linker can drop what nothing uses
+static void asm_ownsection(const char *kind, struct sym *sym)
+{
+    fprintf(g_outf, "\t.section %s.%s\n", kind, sym->name);
+}
+
 void asm_string(const char *str)
 {
     fprintf(g_outf, "\t.str \"%s\"\n", str);
 }
 
-void asm_symbol(struct sym *sym)
+// Bit pattern of a float constant
+void asm_fltconst(struct roflt *flt)
+{
+    if (flt->size == 4)
+    {
+        float f = flt->val;
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        fprintf(g_outf, "\t.long 0x%08x\n", bits);
+    }
+    else
+    {
+        uint64_t bits;
+        memcpy(&bits, &flt->val, sizeof(bits));
+        fprintf(g_outf, "\t.quad 0x%016lx\n", bits);
+    }
+}
+
+// 'type' is "function" or "object", the size follows with asm_symsize()
+void asm_symbol(struct sym *sym, const char *type)
 {
     if (sym->attr & SYM_PUBLIC)
         fprintf(g_outf, "\t.global %s\n", sym->name);
+    fprintf(g_outf, "\t.type %s, @%s\n", sym->name, type);
     fprintf(g_outf, "%s:\n", sym->name); 
 }
 
-void asm_dataprim(struct type t)
+// Bytes from the label to here, for symbol tables and link maps
+static void asm_symsize(struct sym *sym)
 {
-    if (t.ptr)
-        fprintf(g_outf, "\t.long 0\n");
-    else
-    {
-        switch (asm_sizeof(t))
-        {
-            case 1: fprintf(g_outf, "\t.byte  0\n"); break;
-            case 2: fprintf(g_outf, "\t.short 0\n"); break;
-            case 4: fprintf(g_outf, "\t.int   0\n"); break;
-            case 8: fprintf(g_outf, "\t.long  0\n"); break;
-        }
-    }
+    fprintf(g_outf, "\t.size %s, .-%s\n", sym->name, sym->name);
 }
 
 static int asm_load(struct sym *sym, int r)
 {
     if (sym->type.arrlen)
         return asm_addrof(sym, r);
+    else if (asm_isfloat(sym->type))
+    {
+        if (sym->attr & SYM_LOCAL)
+            fprintf(g_outf, "\tmovs%c %s, %s\n", fsfx(sym->type), asm_local(sym), xmmregs[r]);
+        else
+            fprintf(g_outf, "\tmovs%c %s, %s\n", fsfx(sym->type), asm_global(sym), xmmregs[r]);
+        return r;
+    }
     else
     {
         if (sym->attr & SYM_LOCAL)
-            fprintf(g_outf, "\tmov -%lu(%%rbp), %s\n", sym->stackoff, regs[asm_sizeof(sym->type)][r]);
+            fprintf(g_outf, "\tmov %s, %s\n", asm_local(sym), regs[asm_sizeof(sym->type)][r]);
         else
-            fprintf(g_outf, "\tmov %s, %s\n", sym->name, regs[asm_sizeof(sym->type)][r]);
+            fprintf(g_outf, "\tmov %s, %s\n", asm_global(sym), regs[asm_sizeof(sym->type)][r]);
         return r;
     }
 }
 
 static int asm_store(struct sym *sym, int r)
 {
-    if (sym->attr & SYM_LOCAL)
-        fprintf(g_outf, "\tmov %s, -%lu(%%rbp)\n", regs[asm_sizeof(sym->type)][r], sym->stackoff);
+    if (asm_isfloat(sym->type))
+    {
+        if (sym->attr & SYM_LOCAL)
+            fprintf(g_outf, "\tmovs%c %s, %s\n", fsfx(sym->type), xmmregs[r], asm_local(sym));
+        else
+            fprintf(g_outf, "\tmovs%c %s, %s\n", fsfx(sym->type), xmmregs[r], asm_global(sym));
+    }
+    else if (sym->attr & SYM_LOCAL)
+        fprintf(g_outf, "\tmov %s, %s\n", regs[asm_sizeof(sym->type)][r], asm_local(sym));
     else
-        fprintf(g_outf, "\tmov %s, %s(%%rip)\n", regs[asm_sizeof(sym->type)][r], sym->name);
+        fprintf(g_outf, "\tmov %s, %s\n", regs[asm_sizeof(sym->type)][r], asm_global(sym));
     return r;
 }
 
 static int asm_storederef(struct ast *ast, int r1, int r2)
 {
-    fprintf(g_outf, "\tmov %s, (%s)\n", regs[asm_sizeof(ast->vtype)][r2], regs64[r1]);
+    if (asm_isfloat(ast->vtype))
+        fprintf(g_outf, "\tmovs%c %s, (%s)\n", fsfx(ast->vtype), xmmregs[r2], regs64[r1]);
+    else
+        fprintf(g_outf, "\tmov %s, (%s)\n", regs[asm_sizeof(ast->vtype)][r2], regs64[r1]);
     regfree(r1);
     return r2;
 }
@@ -369,6 +619,13 @@ static int asm_loadderef(struct ast *ast, int r)
 {
     if (ast->lvalue)
         return r;
+    else if (asm_isfloat(ast->vtype))
+    {
+        int x = xregalloc();
+        fprintf(g_outf, "\tmovs%c (%s), %s\n", fsfx(ast->vtype), regs64[r], xmmregs[x]);
+        regfree(r);
+        return x;
+    }
     else
     {
         int r2 = regalloc();
@@ -378,6 +635,63 @@ static int asm_loadderef(struct ast *ast, int r)
     }
 }
 
+// Memory operand for 'addr' into 'buf' if it is a variable plus a constant offset,
+// like a struct member or an array element with a constant index. 0 otherwise
+static int asm_memref(struct ast *addr, char *buf, size_t n)
+{
+    long off = 0;
+    for (; addr->type == A_BINOP && addr->binop.op == OP_PLUS; addr = addr->binop.lhs)
+    {
+        struct ast *rhs = addr->binop.rhs;
+        if (rhs->type == A_INTLIT)
+            off += rhs->intlit.ival;
+        else if (rhs->type == A_SCALE && rhs->scale.val->type == A_INTLIT)
+            off += rhs->scale.val->intlit.ival * rhs->scale.num;
+        else return 0;
+    }
+
+    struct sym *sym;
+    if (addr->type == A_UNARY && addr->unary.op == OP_ADDROF && addr->unary.val->type == A_IDENT)
+        sym = sym_lookup(s_currscope, addr->unary.val->ident.name);
+    else if (addr->type == A_IDENT)
+    {
+        sym = sym_lookup(s_currscope, addr->ident.name);
+        if (!sym->type.arrlen) return 0;
+    }
+    else return 0;
+
+    if (sym->attr & SYM_GLOBAL)
+        snprintf(buf, n, off ? "%s%+ld(%%rip)" : "%s(%%rip)", sym->name, off);
+    else if (s_frame.omitfp)
+        snprintf(buf, n, "%ld(%%rsp)", (long)(s_frame.locals - sym->stackoff + s_frame.depth) + off);
+    else
+        snprintf(buf, n, "%ld(%%rbp)", off - (long)sym->stackoff);
+    return 1;
+}
+
+static int asm_loadmem(struct ast *ast, const char *mem)
+{
+    if (asm_isfloat(ast->vtype))
+    {
+        int x = xregalloc();
+        fprintf(g_outf, "\tmovs%c %s, %s\n", fsfx(ast->vtype), mem, xmmregs[x]);
+        return x;
+    }
+
+    int r = regalloc();
+    fprintf(g_outf, "\tmov %s, %s\n", mem, regs[asm_sizeof(ast->vtype)][r]);
+    return r;
+}
+
+static int asm_storemem(struct ast *ast, int r, const char *mem)
+{
+    if (asm_isfloat(ast->vtype))
+        fprintf(g_outf, "\tmovs%c %s, %s\n", fsfx(ast->vtype), xmmregs[r], mem);
+    else
+        fprintf(g_outf, "\tmov %s, %s\n", regs[asm_sizeof(ast->vtype)][r], mem);
+    return r;
+}
+
 static int asm_add(int r1, int r2)
 {
     fprintf(g_outf, "\tadd %s, %s\n", regs64[r2], regs64[r1]);
@@ -478,25 +792,143 @@ static int asm_cmpandjmp(int r1, int r2, int op, int lbl)
     return NOREG;
 }
 
-void asm_funcpre(size_t st)
+// Scalar float arithmetic: add, sub, mul, div
+static int asm_fop(int x1, int x2, const char *inst, struct type t)
 {
-    if (!st) return;
+    fprintf(g_outf, "\t%ss%c %s, %s\n", inst, fsfx(t), xmmregs[x2], xmmregs[x1]);
+    xregfree(x2);
+    return x1;
+}
+
+// ucomis sets ZF and CF like an unsigned compare, and all of ZF, PF and CF
+// for unordered (NaN) operands. Comparing the other way around makes < and <=
+// use the 'above' conditions, which come out false for NaN. Returns the
+// resulting operator
+static int asm_fcmp(int x1, int x2, int op, struct type t)
+{
+    if (op == OP_LT || op == OP_LTE)
+    {
+        int tmp = x1;
+        x1 = x2;
+        x2 = tmp;
+        op = op == OP_LT ? OP_GT : OP_GTE;
+    }
 
-    fprintf(g_outf, "\tpush %%rbp\n");
-    fprintf(g_outf, "\tmov %%rsp, %%rbp\n");
-    fprintf(g_outf, "\tsub $%lu, %%rsp\n", st);
+    fprintf(g_outf, "\tucomis%c %s, %s\n", fsfx(t), xmmregs[x2], xmmregs[x1]);
+    return op;
 }
 
-void asm_funcpost(size_t st)
+static int asm_fcmpandset(int x1, int x2, int op, struct type t)
 {
-    if (st) fprintf(g_outf, "\tleave\n");
+    int r = regalloc();
+
+    switch (op = asm_fcmp(x1, x2, op, t))
+    {
+        case OP_EQUAL:
+            fprintf(g_outf, "\tsetz %%al\n");
+            fprintf(g_outf, "\tsetnp %%cl\n");
+            fprintf(g_outf, "\tand %%cl, %%al\n");
+            break;
+        case OP_NEQUAL:
+            fprintf(g_outf, "\tsetnz %%al\n");
+            fprintf(g_outf, "\tsetp %%cl\n");
+            fprintf(g_outf, "\tor %%cl, %%al\n");
+            break;
+        default:
+            fprintf(g_outf, "\t%s %%al\n", fsetinsts[op]);
+    }
+    fprintf(g_outf, "\tmovzx %%al, %s\n", regs64[r]);
+
+    xregfree(x1);
+    xregfree(x2);
+    return r;
+}
+
+static int asm_fcmpandjmp(int x1, int x2, int op, int lbl, struct type t)
+{
+    switch (op = asm_fcmp(x1, x2, op, t))
+    {
+        case OP_EQUAL:
+            fprintf(g_outf, "\tjnz $L%d\n", lbl);
+            fprintf(g_outf, "\tjp $L%d\n", lbl);
+            break;
+        case OP_NEQUAL:
+        {
+            int skip = label();
+            fprintf(g_outf, "\tjp $L%d\n", skip);
+            fprintf(g_outf, "\tjz $L%d\n", lbl);
+            asm_label(skip);
+            break;
+        }
+        default:
+            fprintf(g_outf, "\t%s $L%d\n", fjmpinsts[op], lbl);
+    }
+
+    xregfree(x1);
+    xregfree(x2);
+    return NOREG;
+}
+
+// Negating flips the sign bit, which is done in a general purpose register.
+// Subtracting from zero would get the sign of zero wrong
+static int asm_fneg(int x, struct type t)
+{
+    size_t s = asm_sizeof(t);
+    fprintf(g_outf, "\tmov%c %s, %s\n", s == 4 ? 'd' : 'q', xmmregs[x], regs[s][RAX]);
+    fprintf(g_outf, "\tbtc $%lu, %s\n", s * 8 - 1, regs[s][RAX]);
+    fprintf(g_outf, "\tmov%c %s, %s\n", s == 4 ? 'd' : 'q', regs[s][RAX], xmmregs[x]);
+    return x;
+}
+
+static void asm_xmove(int x1, int x2)
+{
+    fprintf(g_outf, "\tmovaps %s, %s\n", xmmregs[x1], xmmregs[x2]);
+}
+
+// A frame pointer is only set up if there is something to address or align
+static int asm_hasframe()
+{
+    return !s_frame.omitfp && (s_frame.locals || !s_frame.leaf);
+}
+
+void asm_funcpre()
+{
+    for (int r = 0; r < GPRCNT; r++)
+        if (s_frame.saved & (1 << r)) fprintf(g_outf, "\tpush %s\n", regs64[r]);
+
+    if (asm_hasframe())
+    {
+        fprintf(g_outf, "\tpush %%rbp\n");
+        fprintf(g_outf, "\tmov %%rsp, %%rbp\n");
+    }
+
+    if (s_frame.size) fprintf(g_outf, "\tsub $%lu, %%rsp\n", s_frame.size);
+}
+
+void asm_funcpost()
+{
+    if (asm_hasframe())
+        fprintf(g_outf, "\tleave\n");
+    else if (s_frame.size)
+        fprintf(g_outf, "\tadd $%lu, %%rsp\n", s_frame.size);
+
+    for (int r = GPRCNT - 1; r >= 0; r--)
+        if (s_frame.saved & (1 << r)) fprintf(g_outf, "\tpop %s\n", regs64[r]);
+
     fprintf(g_outf, "\tret\n");
 }
 
 // Assignment binary expressions e.g. x = 10, x += 2, *x /= 2, etc
 static int gen_assign(int r1, int r2, struct ast *ast)
 {
-    switch (ast->binop.op)
+    if (asm_isfloat(ast->vtype)) switch (ast->binop.op)
+    {
+        case OP_PLUSEQ:   r2 = asm_fop(r1, r2, "add", ast->vtype); break;
+        case OP_MULEQ:    r2 = asm_fop(r1, r2, "mul", ast->vtype); break;
+        case OP_DIVEQ:    r2 = asm_fop(r1, r2, "div", ast->vtype); break;
+        case OP_MINUSEQ:  r2 = asm_fop(r1, r2, "sub", ast->vtype); break;
+    }
+    else switch (ast->binop.op)
     {
         case OP_PLUSEQ:   r2 = asm_add(r1, r2); break;
         case OP_MULEQ:    r2 = asm_mul(r1, r2); break;
@@ -519,11 +951,13 @@ static int gen_assign(int r1, int r2, struct ast *ast)
     }
 }
 
+static int gen_cond(struct ast *ast);
+
 static int gen_lazyeval(struct ast *ast)
 {
     int end = label();
 
-    int r1 = gen_code(ast->binop.lhs);
+    int r1 = gen_cond(ast->binop.lhs);
 
     asm_testandjmp(r1, end, ast->binop.op == OP_LAND);
 
@@ -533,7 +967,7 @@ static int gen_lazyeval(struct ast *ast)
         fprintf(g_outf, "\tmovzbq %s, %s\n", regs8[r1], regs64[r1]);
     }
 
-    int r2 = gen_code(ast->binop.rhs);
+    int r2 = gen_cond(ast->binop.rhs);
     if (!CMPEXPR(ast->binop.rhs))
     {
         fprintf(g_outf, "\ttest %s, %s\n", regs64[r2], regs64[r2]);
@@ -548,12 +982,12 @@ static int gen_lazyeval(struct ast *ast)
 
 static int gen_lazyevaljmp(int lbl, struct ast *ast)
 {
-    int r1 = gen_code(ast->binop.lhs);
+    int r1 = gen_cond(ast->binop.lhs);
 
     asm_testandjmp(r1, lbl, ast->binop.op == OP_LAND);
     regfree(r1);
 
-    int r2 = gen_code(ast->binop.rhs);
+    int r2 = gen_cond(ast->binop.rhs);
     asm_testandjmp(r2, lbl, 1);
     regfree(r2);
     return NOREG;
@@ -564,9 +998,31 @@ static int gen_binop(struct ast *ast)
     if (ast->binop.op == OP_LAND || ast->binop.op == OP_LOR)
         return gen_lazyeval(ast);
 
+    char mem[64];
+    struct ast *lhs = ast->binop.lhs;
+    if (ast->binop.op == OP_ASSIGN && lhs->type == A_UNARY && lhs->unary.op == OP_DEREF && asm_memref(lhs->unary.val, mem, sizeof(mem)))
+        return asm_storemem(ast, gen_code(ast->binop.rhs), mem);
+
     int r1 = gen_code(ast->binop.lhs);
     int r2 = gen_code(ast->binop.rhs);
 
+    // Operands have been converted to a common type, and assignments to the
+    // type of their destination
+    if (asm_isfloat(ast->binop.rhs->vtype)) switch (ast->binop.op)
+    {
+        case OP_PLUS:   return asm_fop(r1, r2, "add", ast->vtype);
+        case OP_MUL:    return asm_fop(r1, r2, "mul", ast->vtype);
+        case OP_DIV:    return asm_fop(r1, r2, "div", ast->vtype);
+        case OP_MINUS:  return asm_fop(r1, r2, "sub", ast->vtype);
+        case OP_EQUAL:
+        case OP_NEQUAL:
+        case OP_GT:
+        case OP_LT:
+        case OP_GTE:
+        case OP_LTE:    return asm_fcmpandset(r1, r2, ast->binop.op, ast->binop.rhs->vtype);
+        default:        return gen_assign(r1, r2, ast);
+    }
+
     switch (ast->binop.op)
     {
         case OP_PLUS:   return asm_add(r1, r2); 
@@ -627,9 +1083,8 @@ void asm_testandjmp(int r, int lbl, int zf)
     fprintf(g_outf, "\t%s $L%d\n", zf ? "jz" : "jnz", lbl);
 }
 
-int asm_loadint(unsigned long i)
+int asm_loadint(unsigned long i, int r)
 {
-    int r = regalloc();
     fprintf(g_outf, "\tmov $%ld, %s\n", i, regs64[r]);
     return r;
 }
@@ -640,16 +1095,45 @@ void asm_move(int r1, int r2, size_t s1, size_t s2)
         fprintf(g_outf, "\tmov %s, %s\n", regs[s2][r1], regs[s2][r2]);
 }
 
-static int gen_addrof(struct ast *ast)
+static int gen_addrof(struct ast *ast, int r)
 {
-    int r = regalloc();
     return asm_addrof(sym_lookup(s_currscope, ast->unary.val->ident.name), r);
 }
 
+static int gen_fltlit(struct ast *ast, int x)
+{
+    fprintf(g_outf, "\tmovs%c L%d(%%rip), %s\n", fsfx(ast->vtype), s_globlscope->block.flts[ast->fltlit.idx].lbl, xmmregs[x]);
+    return x;
+}
+
+static int gen_strlit(struct ast *ast, int r)
+{
+    fprintf(g_outf, "\tlea L%d(%%rip), %s\n", s_globlscope->block.strs[ast->strlit.idx].lbl, regs64[r]);
+    return r;
+}
+
+static int gen_sizeof(struct ast *ast, int r)
+{
+    fprintf(g_outf, "\tmov $%lu, %s\n", asm_sizeof(ast->sizeofop.t), regs64[r]);
+    return r;
+}
+
 static int gen_unary(struct ast *ast)
 {
     if (ast->unary.op == OP_ADDROF)
-        return gen_addrof(ast);
+        return gen_addrof(ast, regalloc());
+
+    if (asm_isfloat(ast->unary.val->vtype))
+    {
+        if (ast->unary.op == OP_LOGNOT)
+            return asm_lognot(gen_cond(ast->unary.val));
+        if (ast->unary.op == OP_MINUS)
+            return asm_fneg(gen_code(ast->unary.val), ast->vtype);
+    }
+
+    char mem[64];
+    if (ast->unary.op == OP_DEREF && !ast->lvalue && asm_memref(ast->unary.val, mem, sizeof(mem)))
+        return asm_loadmem(ast, mem);
 
     int r = gen_code(ast->unary.val);
 
@@ -668,72 +1152,235 @@ static int gen_ident(struct ast *ast)
 {
     if (ast->lvalue) return NOREG;
 
-    int r = regalloc();
+    int r = asm_isfloat(ast->vtype) ? xregalloc() : regalloc();
     struct sym *sym = sym_lookup(s_currscope, ast->ident.name);
     return asm_load(sym, r);
 }
 
+// Evaluates a condition into a general purpose register. Floats are compared
+// against zero
+static int gen_cond(struct ast *ast)
+{
+    int r = gen_code(ast);
+    if (!asm_isfloat(ast->vtype)) return r;
+
+    int zero = xregalloc();
+    fprintf(g_outf, "\txorps %s, %s\n", xmmregs[zero], xmmregs[zero]);
+    return asm_fcmpandset(r, zero, OP_NEQUAL, ast->vtype);
+}
+
+// Casts that change the representation of a value, between integers and
+// floats or between float widths. Other casts leave registers as they are
+static int isconv(struct ast *ast)
+{
+    return (asm_isfloat(ast->vtype) || asm_isfloat(ast->cast.val->vtype))
+        && ast->vtype.name != ast->cast.val->vtype.name;
+}
+
+static int gen_cast(struct ast *ast)
+{
+    struct type from = ast->cast.val->vtype, to = ast->vtype;
+    int r = gen_code(ast->cast.val);
+
+    if (!isconv(ast)) return r;
+
+    if (asm_isfloat(from) && asm_isfloat(to))
+    {
+        fprintf(g_outf, "\tcvts%c2s%c %s, %s\n", fsfx(from), fsfx(to), xmmregs[r], xmmregs[r]);
+        return r;
+    }
+
+    if (asm_isfloat(from))
+    {
+        int r2 = regalloc();
+        fprintf(g_outf, "\tcvtts%c2si %s, %s\n", fsfx(from), xmmregs[r], regs64[r2]);
+        xregfree(r);
+        return r2;
+    }
+
+    // Loads of narrow integers leave the upper bits alone, and 32-bit signed
+    // values need converting as such
+    size_t s = asm_sizeof(from);
+    if (s < 4)
+        fprintf(g_outf, "\tmov%cx %s, %s\n", issigned(from) ? 's' : 'z', regs[s][r], regs64[r]);
+
+    int x = xregalloc();
+    fprintf(g_outf, "\tcvtsi2s%c %s, %s\n", fsfx(to), s == 4 && issigned(from) ? regs32[r] : regs64[r], xmmregs[x]);
+    regfree(r);
+    return x;
+}
+
 static int gen_block(struct ast *ast)
 {
     s_currscope = &ast->block.symtab;
 
     for (unsigned int i = 0; i < ast->block.cnt; i++)
-        DISCARD(gen_code(ast->block.statements[i]));
+        DISCARD(ast->block.statements[i]);
 
     s_currscope = s_currscope->parent;
     return NOREG;
 }
 
-static const char *paramregs64[6] =
-{
-    "%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"
-};
+static const int paramregs[] = { RDI, RSI, RDX, RCX, R8, R9 };
 
-static const char *paramregs32[6] =
+#define REGPARAMS ARRLEN(paramregs)
+#define XMMPARAMS 8 // xmm0-7
+
+// Register of the next argument of type 't': integers and pointers take the
+// next parameter register, floats the next XMM register. NOREG if it goes on
+// the stack
+static int argreg(struct type t, unsigned int *gprs, unsigned int *xmms)
 {
-    "%edi", "%esi", "%edx", "%ecx", "%r8d", "%r9d"
-};
+    if (asm_isfloat(t))
+        return *xmms < XMMPARAMS ? (int)(*xmms)++ : NOREG;
+    return *gprs < REGPARAMS ? paramregs[(*gprs)++] : NOREG;
+}
 
-static const char *paramregs16[6] =
+// Whether code generated for an AST node may call a function
+static int hascall(struct ast *ast)
 {
-    "%di", "%si", "%dx", "%cx", "%r8w", "%r9w"
-};
+    if (!ast) return 0;
+
+    switch (ast->type)
+    {
+        case A_CALL:
+        case A_ASM:     return 1; // Inline assembly is opaque, assume the worst
+        case A_BINOP:   return hascall(ast->binop.lhs) || hascall(ast->binop.rhs);
+        case A_UNARY:   return hascall(ast->unary.val);
+        case A_CAST:    return hascall(ast->cast.val);
+        case A_SCALE:   return hascall(ast->scale.val);
+        case A_RETURN:  return hascall(ast->ret.val);
+        case A_PREINC:
+        case A_PREDEC:
+        case A_POSTINC:
+        case A_POSTDEC: return hascall(ast->incdec.val);
+        case A_TERNARY: return hascall(ast->ternary.cond) || hascall(ast->ternary.lhs) || hascall(ast->ternary.rhs);
+        case A_IFELSE:  return hascall(ast->ifelse.cond) || hascall(ast->ifelse.ifblock) || hascall(ast->ifelse.elseblock);
+        case A_WHILE:   return hascall(ast->whileloop.cond) || hascall(ast->whileloop.body);
+        case A_FOR:     return hascall(ast->forloop.init) || hascall(ast->forloop.cond)
+                            || hascall(ast->forloop.update) || hascall(ast->forloop.body);
+        case A_BLOCK:
+            for (unsigned int i = 0; i < ast->block.cnt; i++)
+                if (hascall(ast->block.statements[i])) return 1;
+            return 0;
+    }
+
+    return 0;
+}
 
-static const char *paramregs8[6] =
+static size_t align16(size_t n)
 {
-    "%dil", "%sil", "%dl", "%cl", "%r8b", "%r9b"
-};
+    return (n + 15) & ~(size_t)15;
+}
 
-static const char **paramregs[] =
+// Bytes pushed between the end of the caller's frame and our locals
+static size_t asm_pushed()
 {
-    [1] = paramregs8,
-    [2] = paramregs16,
-    [4] = paramregs32,
-    [8] = paramregs64
-};
+    return 8 + 8 * __builtin_popcount(s_frame.saved) + (asm_hasframe() ? 8 : 0);
+}
 
-static int gen_funcdef(struct ast *ast)
+// Generates register parameter stores and the function body
+static void gen_funcbody(struct ast *ast, struct sym *sym)
 {
     ast->funcdef.endlbl = label();
 
-    struct sym *sym = sym_lookup(s_currscope, ast->funcdef.name);
-    asm_symbol(sym_lookup(s_currscope, ast->funcdef.name));
+    unsigned int gprs = 0, xmms = 0;
+    for (unsigned int i = 0; i < sym->type.func.paramcnt; i++)
+    {
+        struct sym *sym = sym_lookup(&ast->funcdef.block->block.symtab, ast->funcdef.params[i]);
+        int r = argreg(sym->type, &gprs, &xmms);
+
+        if (r == NOREG) continue;
+        if (asm_isfloat(sym->type))
+            fprintf(g_outf, "\tmovs%c %s, %s\n", fsfx(sym->type), xmmregs[r], asm_local(sym));
+        else
+            fprintf(g_outf, "\tmov %s, %s\n", regs[asm_sizeof(sym->type)][r], asm_local(sym));
+    }
 
-    size_t st = ast->funcdef.block->block.symtab.curr_stackoff;
+    gen_block(ast->funcdef.block);
+    asm_label(ast->funcdef.endlbl);
+}
 
-    asm_funcpre(st);
+// Copies parameters passed on the stack into their locals. They sit just above
+// the return address, so this has to wait until the prologue is known
+static void gen_stackparams(struct ast *ast, struct sym *sym)
+{
+    size_t base = asm_hasframe() ? asm_pushed() : s_frame.size + asm_pushed();
+    unsigned int gprs = 0, xmms = 0;
 
+    // Floats are copied bit for bit through %rax as well, the XMM argument
+    // registers haven't been stored yet
     for (unsigned int i = 0; i < sym->type.func.paramcnt; i++)
     {
         struct sym *sym = sym_lookup(&ast->funcdef.block->block.symtab, ast->funcdef.params[i]);
         size_t size = asm_sizeof(sym->type);
-        fprintf(g_outf, "\tmov %s, -%lu(%%rbp)\n", paramregs[size][i], sym->stackoff);
+
+        if (argreg(sym->type, &gprs, &xmms) != NOREG) continue;
+
+        fprintf(g_outf, "\tmov %lu(%s), %s\n", base, asm_hasframe() ? "%rbp" : "%rsp", regs[size][RAX]);
+        fprintf(g_outf, "\tmov %s, %s\n", regs[size][RAX], asm_local(sym));
+        base += 8;
     }
+}
 
-    gen_block(ast->funcdef.block);
-    asm_label(ast->funcdef.endlbl);
-    asm_funcpost(st);
+static int gen_funcdef(struct ast *ast)
+{
+    struct sym *sym = sym_lookup(s_currscope, ast->funcdef.name);
+
+    s_frame = (struct frame)
+    {
+        .locals = ast->funcdef.block->block.symtab.curr_stackoff,
+        .leaf   = !hascall(ast->funcdef.block),
+        .omitfp = g_opts & OPT_OMITFP
+    };
+    s_frame.redzone = s_frame.leaf && s_frame.locals <= REDZONE;
+
+    // The body goes to a buffer, the prologue depends on what it ends up using
+    FILE *out = g_outf;
+    char *body;
+    size_t len;
+
+    while (1)
+    {
+        if (s_frame.redzone)
+            s_frame.locals = s_frame.omitfp ? 0 : s_frame.locals;
+        else if (!s_frame.leaf)
+            s_frame.locals = align16(s_frame.locals);
+
+        g_outf = open_memstream(&body, &len);
+        gen_funcbody(ast, sym);
+        fclose(g_outf);
+
+        // Pushing a spilled register would clobber locals in the red zone, so
+        // this function needs a real frame after all
+        if (!s_frame.redzone || !s_frame.spilled) break;
+
+        free(body);
+        s_frame.redzone = s_frame.spilled = s_frame.saved = 0;
+        s_frame.locals = ast->funcdef.block->block.symtab.curr_stackoff;
+    }
 
+    g_outf = out;
+
+    if (!s_frame.redzone)
+    {
+        // Keep %rsp 16-byte aligned at call sites, the return address and
+        // saved registers sit above the locals
+        s_frame.size = s_frame.locals;
+        if (!s_frame.leaf && (asm_pushed() + s_frame.size) % 16)
+            s_frame.size += 8;
+    }
+
+    if (g_opts & OPT_FUNCSECTS) asm_ownsection(".text", sym);
+    asm_align(g_alignfuncs);
+    asm_symbol(sym, "function");
+    asm_funcpre();
+    gen_stackparams(ast, sym);
+    fwrite(body, 1, len, g_outf);
+    asm_funcpost();
+    asm_symsize(sym);
+
+    free(body);
     return NOREG;
 }
 
@@ -743,54 +1390,190 @@ static int gen_inlineasm(struct ast *ast)
     return NOREG;
 }
 
+// Values that can be loaded straight into any register, without scratch
+// registers or clobbering anything else
+static int issimple(struct ast *ast)
+{
+    switch (ast->type)
+    {
+        case A_INTLIT:
+        case A_FLTLIT:
+        case A_STRLIT:
+        case A_SIZEOF:
+        case A_IDENT:   return 1;
+        case A_CAST:    return !isconv(ast) && issimple(ast->cast.val);
+        case A_UNARY:   return ast->unary.op == OP_ADDROF;
+    }
+
+    return 0;
+}
+
+// Generate a simple value into a specific register
+static int gen_simple(struct ast *ast, int r)
+{
+    switch (ast->type)
+    {
+        case A_INTLIT:  return asm_loadint(ast->intlit.ival, r);
+        case A_FLTLIT:  return gen_fltlit(ast, r);
+        case A_STRLIT:  return gen_strlit(ast, r);
+        case A_SIZEOF:  return gen_sizeof(ast, r);
+        case A_IDENT:   return asm_load(sym_lookup(s_currscope, ast->ident.name), r);
+        case A_CAST:    return gen_simple(ast->cast.val, r);
+        case A_UNARY:   return gen_addrof(ast, r);
+    }
+
+    return NOREG;
+}
+
 static int gen_call(struct ast *ast)
 {
+    // Scratch registers holding values across the call. Callee-saved ones are
+    // preserved by the callee itself
+    int live[GPRCNT], livecnt = 0;
+    for (unsigned int i = 0; i < s_frame.poolcnt; i++)
+    {
+        int r = s_frame.pool[i];
+        if (reglist[r] && !(CALLEESAVED & (1 << r)))
+        {
+            asm_push(regs64[r]);
+            live[livecnt++] = r;
+        }
+    }
+
+    int xlive[XMMCNT], xlivecnt = 0;
+    for (size_t i = 0; i < ARRLEN(s_xmmpool); i++)
+    {
+        if (xreglist[s_xmmpool[i]])
+        {
+            asm_xpush(s_xmmpool[i]);
+            xlive[xlivecnt++] = s_xmmpool[i];
+        }
+    }
+
+    // Argument registers, NOREG for those passed on the stack
+    int *argregs = malloc(ast->call.paramcnt * sizeof(int));
+    unsigned int gprs = 0, xmms = 0;
+    size_t stackargs = 0;
+
+    for (unsigned int i = 0; i < ast->call.paramcnt; i++)
+    {
+        argregs[i] = argreg(ast->call.params[i]->vtype, &gprs, &xmms);
+        if (argregs[i] == NOREG) stackargs += 8;
+    }
+
+    // Stack arguments are pushed right to left, padded so %rsp is 16-byte
+    // aligned at the call
+    size_t pad = (s_frame.depth + stackargs) % 16;
+
+    if (pad)
+    {
+        fprintf(g_outf, "\tsub $%lu, %%rsp\n", pad);
+        s_frame.depth += pad;
+    }
+
+    for (unsigned int i = ast->call.paramcnt; i-- > 0;)
+    {
+        if (argregs[i] != NOREG) continue;
+
+        struct ast *param = ast->call.params[i];
+        int r = gen_code(param);
+        if (asm_isfloat(param->vtype)) asm_xpush(r);
+        else asm_push(regs64[r]);
+        valfree(param, r);
+    }
+
+    // Arguments needing registers of their own (and possibly making calls) are
+    // evaluated next. This is only safe because the statement holding the call
+    // got s_callregs from mkpool(), which has no argument registers, so the
+    // moves below can't overwrite a pending source. s_scratchregs has r8/r9
+    int *args = malloc(ast->call.paramcnt * sizeof(int));
     for (unsigned int i = 0; i < ast->call.paramcnt; i++)
     {
-        int par = gen_code(ast->call.params[i]);
-        size_t s = asm_sizeof(ast->call.params[i]->vtype);
-        fprintf(g_outf, "\tmov %s, %s\n", regs[s][par], paramregs[s][i]);
-        regfree(par);
+        struct ast *param = ast->call.params[i];
+        args[i] = argregs[i] == NOREG || issimple(param) ? NOREG : gen_code(param);
     }
 
+    int fnr = NOREG;
     const char *fn;
     if (ast->call.ast->type == A_UNARY && ast->call.ast->unary.op == OP_ADDROF
         && ast->call.ast->unary.val->type == A_IDENT)
         fn = ast->call.ast->unary.val->ident.name;
     else
     {
-        int r = gen_code(ast->call.ast);
-        fn = regs64[r];
-        regfree(r); // A bit dodgy, makes for better looking code
+        fnr = gen_code(ast->call.ast);
+        fn = regs64[fnr];
     }
 
-    for (int i = 0; i < (int)REGCNT; i++)
+    for (unsigned int i = 0; i < ast->call.paramcnt; i++)
     {
-        if (reglist[i])
-            fprintf(g_outf, " push\t%s\n", regs64[i]);
+        struct ast *param = ast->call.params[i];
+        size_t s = asm_sizeof(param->vtype);
+
+        if (argregs[i] == NOREG) continue;
+
+        if (args[i] == NOREG)
+            gen_simple(param, argregs[i]);
+        else if (asm_isfloat(param->vtype))
+        {
+            asm_xmove(args[i], argregs[i]);
+            xregfree(args[i]);
+        }
+        else
+        {
+            fprintf(g_outf, "\tmov %s, %s\n", regs[s][args[i]], regs[s][argregs[i]]);
+            regfree(args[i]);
+        }
     }
 
+    free(argregs);
+    free(args);
+
+    // %al holds the number of vector registers used by a variadic call
     if (ast->call.ast->vtype.func.variadic)
-        fprintf(g_outf, "\txor %%rax, %%rax\n");
+    {
+        if (xmms) fprintf(g_outf, "\tmov $%u, %%eax\n", xmms);
+        else fprintf(g_outf, "\txor %%rax, %%rax\n");
+    }
     fprintf(g_outf, "\tcall $%s\n", fn);
 
-    for (int i = REGCNT - 1; i >= 0; i--)
+    if (fnr != NOREG) regfree(fnr);
+
+    if (stackargs + pad)
     {
-        if (reglist[i])
-            fprintf(g_outf, "\tpop %s\n", regs64[i]);
+        fprintf(g_outf, "\tadd $%lu, %%rsp\n", stackargs + pad);
+        s_frame.depth -= stackargs + pad;
     }
 
+    while (xlivecnt--)
+        asm_xpop(xlive[xlivecnt]);
+
+    while (livecnt--)
+        asm_pop(regs64[live[livecnt]]);
+
     if (ast->vtype.name == TYPE_VOID && !ast->vtype.ptr)
         return NOREG;
 
+    if (asm_isfloat(ast->vtype))
+    {
+        int x = xregalloc();
+        asm_xmove(0, x);
+        return x;
+    }
+
     int r = regalloc();
     fprintf(g_outf, "\tmov %%rax, %s\n", regs64[r]);
     return r;
 }
 
-void asm_retval(int r, size_t s)
+void asm_retval(int r, struct type t)
 {
-    switch (s)
+    if (asm_isfloat(t))
+    {
+        asm_xmove(r, 0);
+        return;
+    }
+
+    switch (asm_sizeof(t))
     {
         case 1: fprintf(g_outf, "\tmovzbl %s, %%eax\n", regs8[r]); break;
         case 2: fprintf(g_outf, "\tmovzwl %s, %%eax\n", regs16[r]); break;
@@ -798,14 +1581,13 @@ void asm_retval(int r, size_t s)
         case 8: fprintf(g_outf, "\tmov %s, %%rax\n", regs64[r]); break;
     }
 }
-
 static int gen_return(struct ast *ast)
 {
     if (ast->ret.val)
     {
         int r = gen_code(ast->ret.val);
-        asm_retval(r, asm_sizeof(ast->ret.val->vtype));
-        regfree(r);
+        asm_retval(r, ast->ret.val->vtype);
+        valfree(ast->ret.val, r);
     }
 
     asm_jump(ast->ret.func->funcdef.endlbl);
@@ -820,6 +1602,7 @@ static int gen_ifelse(struct ast *ast)
     int endlbl = label();
 
     struct ast *cond = ast->ifelse.cond;
+    mkpool(cond);
     if (CMPEXPR(cond))
     {
         if (cond->binop.op == OP_LAND || cond->binop.op == OP_LOR)
@@ -828,23 +1611,26 @@ static int gen_ifelse(struct ast *ast)
         {
             int r1 = gen_code(cond->binop.lhs);
             int r2 = gen_code(cond->binop.rhs);
-            asm_cmpandjmp(r1, r2, cond->binop.op, elselbl != -1 ? elselbl : endlbl);
+            if (asm_isfloat(cond->binop.lhs->vtype))
+                asm_fcmpandjmp(r1, r2, cond->binop.op, elselbl != -1 ? elselbl : endlbl, cond->binop.lhs->vtype);
+            else
+                asm_cmpandjmp(r1, r2, cond->binop.op, elselbl != -1 ? elselbl : endlbl);
         }
     }
     else
     {
-        int r = gen_code(cond);
+        int r = gen_cond(cond);
         asm_testandjmp(r, elselbl != -1 ? elselbl : endlbl, 1);
         regfree(r);
     }
 
-    DISCARD(gen_code(ast->ifelse.ifblock));
+    DISCARD(ast->ifelse.ifblock);
     
     if (elselbl != -1)
     {
         asm_jump(endlbl);
         asm_label(elselbl);
-        DISCARD(gen_code(ast->ifelse.elseblock));
+        DISCARD(ast->ifelse.elseblock);
     }
 
     asm_label(endlbl);
@@ -855,20 +1641,323 @@ static int gen_while(struct ast *ast)
 {
     int looplbl = label(), endlbl = label();
 
-    asm_label(looplbl);
-    int r = gen_code(ast->ifelse.cond);
+    asm_looplabel(looplbl);
+    mkpool(ast->whileloop.cond);
+    int r = gen_cond(ast->whileloop.cond);
    
     asm_testandjmp(r, endlbl, 1);
 
     regfree(r);
 
-    DISCARD(gen_code(ast->whileloop.body));
+    DISCARD(ast->whileloop.body);
 
     asm_jump(looplbl);
     asm_label(endlbl);
     return NOREG;
 }
 
+// Loop vectorization
+//
+// A for loop counting i up by one to a loop-invariant bound, whose body only
+// stores to array elements at index i, computed from elements at index i,
+// constants and scalar variables, is run a whole vector of elements at a
+// time: 16 bytes with SSE2, 32 with AVX2 (-mavx2). The scalar loop then
+// finishes the remaining iterations. Arrays are named arrays, never
+// pointers, so nothing aliases, and with every access at exactly i no
+// iteration depends on another. Scalars can't change, the body stores to
+// array elements only
+
+#define VECARRS 4 // Distinct arrays kept in registers
+
+struct vecloop
+{
+    struct sym *iv;   // Induction variable
+    struct type elem; // Element type shared by every array
+    size_t width;     // Vector width in bytes
+    int ri;           // Induction variable register
+
+    struct sym *arrs[VECARRS];
+    int arrregs[VECARRS]; // Base addresses
+    unsigned int arrcnt;
+};
+
+static struct vecloop s_vec;
+
+static int vec_isiv(struct ast *ast)
+{
+    return ast->type == A_IDENT && sym_lookup(s_currscope, ast->ident.name) == s_vec.iv;
+}
+
+// Index of the array accessed by a[i], or -1
+static int vec_elem(struct ast *ast)
+{
+    if (ast->type != A_UNARY || ast->unary.op != OP_DEREF) return -1;
+
+    struct ast *addr = ast->unary.val;
+    if (addr->type != A_BINOP || addr->binop.op != OP_PLUS) return -1;
+    if (addr->binop.lhs->type != A_IDENT || addr->binop.rhs->type != A_SCALE) return -1;
+    if (!vec_isiv(addr->binop.rhs->scale.val)) return -1;
+
+    struct sym *sym = sym_lookup(s_currscope, addr->binop.lhs->ident.name);
+    if (!sym->type.arrlen || sym->type.ptr || sym->type.name != s_vec.elem.name) return -1;
+
+    for (unsigned int i = 0; i < s_vec.arrcnt; i++)
+        if (s_vec.arrs[i] == sym) return i;
+
+    if (s_vec.arrcnt == VECARRS) return -1;
+    s_vec.arrs[s_vec.arrcnt] = sym;
+    return s_vec.arrcnt++;
+}
+
+// Packed instruction for 'op' on the element type, NULL if there is none
+static const char *vec_inst(int op)
+{
+    int flt = s_vec.elem.name == TYPE_FLOAT32;
+    int byte = asm_sizeof(s_vec.elem) == 1;
+
+    switch (op)
+    {
+        case OP_PLUS:   return flt ? "addps" : byte ? "paddb" : "paddd";
+        case OP_MINUS:  return flt ? "subps" : byte ? "psubb" : "psubd";
+        case OP_MUL:    return flt ? "mulps" : byte ? NULL : s_vec.width == 32 ? "pmulld" : NULL; // pmulld is SSE4.1
+        case OP_DIV:    return flt ? "divps" : NULL;
+        case OP_BITAND: return flt ? NULL : "pand";
+        case OP_BITOR:  return flt ? NULL : "por";
+        case OP_BITXOR: return flt ? NULL : "pxor";
+    }
+
+    return NULL;
+}
+
+// Vector registers needed to evaluate 'ast', 0 if it can't be vectorized
+static unsigned int vec_expr(struct ast *ast)
+{
+    switch (ast->type)
+    {
+        case A_INTLIT:
+            return s_vec.elem.name != TYPE_FLOAT32;
+        case A_FLTLIT:
+            return ast->vtype.name == TYPE_FLOAT32 && s_vec.elem.name == TYPE_FLOAT32;
+        case A_IDENT:
+        {
+            struct sym *sym = sym_lookup(s_currscope, ast->ident.name);
+            return sym != s_vec.iv && !sym->type.arrlen && !sym->type.ptr
+                && sym->type.name == s_vec.elem.name && asm_sizeof(sym->type) == 4;
+        }
+        case A_UNARY:
+            return vec_elem(ast) != -1;
+        case A_BINOP:
+        {
+            if (!vec_inst(ast->binop.op)) return 0;
+
+            unsigned int l = vec_expr(ast->binop.lhs), r = vec_expr(ast->binop.rhs);
+            if (!l || !r) return 0;
+            return l > r ? l : r + 1;
+        }
+    }
+
+    return 0;
+}
+
+// Whether 'ast' is a for loop the vectorizer handles, fills in s_vec
+static int vec_loop(struct ast *ast)
+{
+    if (g_opts & OPT_NOVECTORIZE) return 0;
+
+    struct ast *cond = ast->forloop.cond, *update = ast->forloop.update, *body = ast->forloop.body;
+    if (!cond || !update || cond->type != A_BINOP || cond->binop.op != OP_LT) return 0;
+    if (cond->binop.lhs->type != A_IDENT) return 0;
+
+    s_vec = (struct vecloop) { .iv = sym_lookup(s_currscope, cond->binop.lhs->ident.name) };
+    s_vec.width = g_opts & OPT_AVX2 ? 32 : 16;
+
+    struct type t = s_vec.iv->type;
+    if (t.ptr || t.arrlen || t.name > TYPE_UINT64 || asm_sizeof(t) != 8) return 0;
+
+    // Bound is evaluated once, before the loop
+    struct ast *end = cond->binop.rhs;
+    if (end->type == A_IDENT)
+    {
+        struct sym *sym = sym_lookup(s_currscope, end->ident.name);
+        if (sym == s_vec.iv || sym->type.ptr || sym->type.arrlen || sym->type.name > TYPE_UINT64) return 0;
+        if (asm_sizeof(sym->type) < 4) return 0;
+    }
+    else if (end->type != A_INTLIT) return 0;
+
+    int inc = ((update->type == A_PREINC || update->type == A_POSTINC) && vec_isiv(update->incdec.val))
+        || (update->type == A_BINOP && update->binop.op == OP_PLUSEQ && vec_isiv(update->binop.lhs)
+            && update->binop.rhs->type == A_INTLIT && update->binop.rhs->intlit.ival == 1);
+    if (!inc || body->type != A_BLOCK || !body->block.cnt) return 0;
+
+    // The first store decides the element type
+    for (unsigned int i = 0; i < body->block.cnt; i++)
+    {
+        struct ast *stmt = body->block.statements[i];
+        if (stmt->type != A_BINOP || stmt->binop.op != OP_ASSIGN) return 0;
+
+        struct ast *dst = stmt->binop.lhs;
+        if (!i)
+        {
+            s_vec.elem = dst->vtype;
+            switch (s_vec.elem.name)
+            {
+                case TYPE_INT8: case TYPE_UINT8: case TYPE_INT32: case TYPE_UINT32: case TYPE_FLOAT32: break;
+                default: return 0;
+            }
+        }
+
+        unsigned int need = vec_expr(stmt->binop.rhs);
+        if (vec_elem(dst) == -1 || !need || need > ARRLEN(s_xmmpool)) return 0;
+    }
+
+    return 1;
+}
+
+static const char *vreg(int x)
+{
+    return s_vec.width == 32 ? ymmregs[x] : xmmregs[x];
+}
+
+// Memory operand of a[i]
+static const char *vec_addr(struct ast *ast)
+{
+    static char buf[32];
+    snprintf(buf, sizeof(buf), "(%s,%s,%lu)", regs64[s_vec.arrregs[vec_elem(ast)]], regs64[s_vec.ri], asm_sizeof(s_vec.elem));
+    return buf;
+}
+
+// Copy the 32 bits in %eax to every lane of 'x'
+static void asm_vbroadcast(int x)
+{
+    if (s_vec.width == 32)
+    {
+        fprintf(g_outf, "\tvmovd %%eax, %s\n", xmmregs[x]);
+        fprintf(g_outf, "\tvpbroadcastd %s, %s\n", xmmregs[x], ymmregs[x]);
+    }
+    else
+    {
+        fprintf(g_outf, "\tmovd %%eax, %s\n", xmmregs[x]);
+        fprintf(g_outf, "\tpshufd $0, %s, %s\n", xmmregs[x], xmmregs[x]);
+    }
+}
+
+static int gen_vexpr(struct ast *ast)
+{
+    const char *v = s_vec.width == 32 ? "v" : "";
+    int x;
+
+    switch (ast->type)
+    {
+        case A_INTLIT:
+        {
+            uint32_t bits = ast->intlit.ival;
+            if (asm_sizeof(s_vec.elem) == 1) bits = (bits & 0xff) * 0x01010101;
+
+            x = xregalloc();
+            fprintf(g_outf, "\tmov $%u, %%eax\n", bits);
+            asm_vbroadcast(x);
+            return x;
+        }
+        case A_FLTLIT:
+        {
+            float val = s_globlscope->block.flts[ast->fltlit.idx].val;
+            uint32_t bits;
+            memcpy(&bits, &val, sizeof(bits));
+
+            x = xregalloc();
+            fprintf(g_outf, "\tmov $%u, %%eax\n", bits);
+            asm_vbroadcast(x);
+            return x;
+        }
+        case A_IDENT:
+        {
+            struct sym *sym = sym_lookup(s_currscope, ast->ident.name);
+
+            x = xregalloc();
+            fprintf(g_outf, "\tmov %s, %%eax\n", sym->attr & SYM_LOCAL ? asm_local(sym) : asm_global(sym));
+            asm_vbroadcast(x);
+            return x;
+        }
+        case A_UNARY:
+            x = xregalloc();
+            fprintf(g_outf, "\t%smov%s %s, %s\n", v, s_vec.elem.name == TYPE_FLOAT32 ? "ups" : "dqu", vec_addr(ast), vreg(x));
+            return x;
+        case A_BINOP:
+        {
+            int x2;
+            x = gen_vexpr(ast->binop.lhs);
+            x2 = gen_vexpr(ast->binop.rhs);
+
+            if (s_vec.width == 32)
+                fprintf(g_outf, "\tv%s %s, %s, %s\n", vec_inst(ast->binop.op), vreg(x2), vreg(x), vreg(x));
+            else
+                fprintf(g_outf, "\t%s %s, %s\n", vec_inst(ast->binop.op), vreg(x2), vreg(x));
+
+            xregfree(x2);
+            return x;
+        }
+    }
+
+    return NOREG;
+}
+
+// Vector loop, leaves the induction variable at the first iteration it didn't
+// do for the scalar loop that follows
+static void gen_vecloop(struct ast *ast)
+{
+    int looplbl = label(), endlbl = label();
+    size_t esize = asm_sizeof(s_vec.elem);
+    size_t vf = s_vec.width / esize;
+    struct ast *end = ast->forloop.cond->binop.rhs;
+    struct ast *body = ast->forloop.body;
+
+    s_vec.ri = asm_load(s_vec.iv, regalloc());
+
+    // Last index a full vector can start at
+    int rlast = regalloc();
+    if (end->type == A_INTLIT)
+        asm_loadint(end->intlit.ival, rlast);
+    else
+    {
+        struct sym *sym = sym_lookup(s_currscope, end->ident.name);
+        if (asm_sizeof(sym->type) == 4 && issigned(sym->type))
+            fprintf(g_outf, "\tmovsx u32 %s, %s\n", sym->attr & SYM_LOCAL ? asm_local(sym) : asm_global(sym), regs64[rlast]);
+        else
+            asm_load(sym, rlast);
+    }
+    fprintf(g_outf, "\tsub $%lu, %s\n", vf, regs64[rlast]);
+
+    for (unsigned int i = 0; i < s_vec.arrcnt; i++)
+        s_vec.arrregs[i] = asm_addrof(s_vec.arrs[i], regalloc());
+
+    asm_looplabel(looplbl);
+    fprintf(g_outf, "\tcmp %s, %s\n", regs64[rlast], regs64[s_vec.ri]);
+    fprintf(g_outf, "\tjg $L%d\n", endlbl);
+
+    for (unsigned int i = 0; i < body->block.cnt; i++)
+    {
+        struct ast *stmt = body->block.statements[i];
+        int x = gen_vexpr(stmt->binop.rhs);
+        fprintf(g_outf, "\t%smov%s %s, %s\n", s_vec.width == 32 ? "v" : "",
+                s_vec.elem.name == TYPE_FLOAT32 ? "ups" : "dqu", vreg(x), vec_addr(stmt->binop.lhs));
+        xregfree(x);
+    }
+
+    fprintf(g_outf, "\tadd $%lu, %s\n", vf, regs64[s_vec.ri]);
+    asm_jump(looplbl);
+    asm_label(endlbl);
+
+    // Avoid the AVX-SSE transition penalty in whatever runs next
+    if (s_vec.width == 32) fprintf(g_outf, "\tvzeroupper\n");
+
+    asm_store(s_vec.iv, s_vec.ri);
+
+    for (unsigned int i = s_vec.arrcnt; i-- > 0;)
+        regfree(s_vec.arrregs[i]);
+    regfree(rlast);
+    regfree(s_vec.ri);
+}
+
 // TODO: refactor block/symtab stuff, because the code that follows is very ugly and hacky
 
 static int gen_for(struct ast *ast)
@@ -876,19 +1965,24 @@ static int gen_for(struct ast *ast)
     int looplbl = label(), endlbl = label();
 
     s_currscope = &ast->forloop.body->block.symtab;
-    DISCARD(gen_code(ast->forloop.init));
+    DISCARD(ast->forloop.init);
 
-    asm_label(looplbl);
-    int r = gen_code(ast->forloop.cond);
+    // The scalar loop runs whatever iterations are left over
+    mkpool(ast);
+    if (vec_loop(ast)) gen_vecloop(ast);
+
+    asm_looplabel(looplbl);
+    mkpool(ast->forloop.cond);
+    int r = gen_cond(ast->forloop.cond);
 
     asm_testandjmp(r, endlbl, 1);
 
     regfree(r);
 
-    DISCARD(gen_code(ast->forloop.body));
+    DISCARD(ast->forloop.body);
     // TODO: this is hacky
     s_currscope = &ast->forloop.body->block.symtab;
-    DISCARD(gen_code(ast->forloop.update));
+    DISCARD(ast->forloop.update);
 
     s_currscope = ast->forloop.body->block.symtab.parent;
     
@@ -897,21 +1991,6 @@ static int gen_for(struct ast *ast)
     return NOREG;
 }
 
-static int gen_strlit(struct ast *ast)
-{
-    int r = regalloc();
-    fprintf(g_outf, "\tmov $L%d, %s\n", s_globlscope->block.strs[ast->strlit.idx].lbl, regs64[r]);
-    //fprintf(g_outf, "\tleaq\tL%d(%%rip), %s\n", s_globlscope->block.strs[ast->strlit.idx].lbl, regs64[r]);
-    return r;
-}
-
-static int gen_sizeof(struct ast *ast)
-{
-    int r = regalloc();
-    fprintf(g_outf, "\tmov $%lu, %s\n", asm_sizeof(ast->sizeofop.t), regs64[r]);
-    return r;
-}
-
 void asm_labeln(const char *name)
 {
     fprintf(g_outf, "%s:\n", name);
@@ -972,29 +2051,32 @@ int gen_post(struct ast *ast)
 int gen_scale(struct ast *ast)
 {
     int r = gen_code(ast->scale.val);
-    fprintf(g_outf, "\timul $%u, %s\n", ast->scale.num, regs64[r]);
+    fprintf(g_outf, "\timul $%u, %s, %s\n", ast->scale.num, regs64[r], regs64[r]);
     return r;
 }
 
 int gen_ternary(struct ast *ast)
 {
     int l1 = label(), l2 = label();
-    int r1 = gen_code(ast->ternary.cond);
-    int r2 = regalloc();
+    int flt = asm_isfloat(ast->vtype);
+    int r1 = gen_cond(ast->ternary.cond);
+    int r2 = flt ? xregalloc() : regalloc();
 
     asm_testandjmp(r1, l1, 1);
     regfree(r1);
 
     int r3 = gen_code(ast->ternary.lhs);
-    asm_move(r3, r2, 8, 8);
-    regfree(r3);
+    if (flt) asm_xmove(r3, r2);
+    else asm_move(r3, r2, 8, 8);
+    valfree(ast->ternary.lhs, r3);
 
     asm_jump(l2);
     asm_label(l1);
     
     r3 = gen_code(ast->ternary.rhs);
-    asm_move(r3, r2, 8, 8);
-    regfree(r3);
+    if (flt) asm_xmove(r3, r2);
+    else asm_move(r3, r2, 8, 8);
+    valfree(ast->ternary.rhs, r3);
 
     asm_label(l2);
     return r2;
@@ -1007,12 +2089,13 @@ int gen_code(struct ast *ast)
     {
         case A_BINOP:   return gen_binop(ast);
         case A_UNARY:   return gen_unary(ast);
-        case A_INTLIT:  return asm_loadint(ast->intlit.ival);
+        case A_INTLIT:  return asm_loadint(ast->intlit.ival, regalloc());
+        case A_FLTLIT:  return gen_fltlit(ast, xregalloc());
         case A_CALL:    return gen_call(ast);
         case A_IDENT:   return gen_ident(ast);
-        case A_STRLIT:  return gen_strlit(ast);
-        case A_SIZEOF:  return gen_sizeof(ast);
-        case A_CAST:    return gen_code(ast->cast.val);
+        case A_STRLIT:  return gen_strlit(ast, regalloc());
+        case A_SIZEOF:  return gen_sizeof(ast, regalloc());
+        case A_CAST:    return gen_cast(ast);
         case A_PREINC:
         case A_PREDEC:  return gen_pre(ast);
         case A_POSTINC:
@@ -1033,22 +2116,51 @@ int gen_code(struct ast *ast)
     return NOREG;
 }
 
-void gen_datavar(struct type t)
+// Bytes a global takes up, asm_sizeof() only counts one element of an array of structs or pointers
+static size_t datasize(struct type t)
 {
-    if (t.arrlen)
-    {
-        struct type base = t;
-        base.arrlen = 0;
+    if (!t.arrlen) return asm_sizeof(t);
 
-        for (int i = 0; i < t.arrlen; i++)
-            gen_datavar(base);
-    }
-    else if (t.name == TYPE_STRUCT)
-    {
-        for (unsigned int i = 0; i < t.struc.memcnt; i++)
-            gen_datavar(t.struc.members[i].type);
-    }
-    else asm_dataprim(t);
+    struct type base = t;
+    base.arrlen = 0;
+    return t.arrlen * asm_sizeof(base);
+}
+
+// A global variable this object defines, 'extern' ones are defined by another
+static int isvar(struct sym *sym)
+{
+    return sym->attr & SYM_GLOBAL && !(sym->attr & SYM_EXTERN) && !(sym->type.name == TYPE_FUNC && !sym->type.ptr);
+}
+
+// Zero-initialised globals go to .bss, which takes no space in the object file
+void gen_bssvar(struct sym *sym)
+{
+    size_t size = datasize(sym->type), align = 1;
+    while (align < size && align < 16) align <<= 1;
+
+    if (g_opts & OPT_DATASECTS) asm_ownsection(".bss", sym);
+    asm_align(align);
+    asm_symbol(sym, "object");
+    fprintf(g_outf, "\t.zero %lu\n", size);
+    asm_symsize(sym);
+}
+
+// An initialised global, its constant goes to .data
+void gen_datavar(struct sym *sym)
+{
+    static const char *dirs[] = { [1] = ".byte", [2] = ".word", [4] = ".long", [8] = ".quad" };
+    struct ast *init = sym->init;
+    size_t size = datasize(sym->type);
+
+    if (g_opts & OPT_DATASECTS) asm_ownsection(".data", sym);
+    asm_align(size < 16 ? size : 16);
+    asm_symbol(sym, "object");
+
+    if (init->type == A_FLTLIT) asm_fltconst(&g_ast->block.flts[init->fltlit.idx]);
+    else if (init->type == A_STRLIT) fprintf(g_outf, "\t.quad L%d\n", g_ast->block.strs[init->strlit.idx].lbl);
+    else fprintf(g_outf, "\t%s %lu\n", dirs[size], init->intlit.ival);
+
+    asm_symsize(sym);
 }
 
 void gen_ast()
@@ -1063,16 +2175,28 @@ void gen_ast()
         asm_string(g_ast->block.strs[i].val);
     }
 
-    asm_section(".data");
+    for (unsigned int i = 0; i < g_ast->block.fltcnt; i++)
+    {
+        asm_label(g_ast->block.flts[i].lbl = label());
+        asm_fltconst(&g_ast->block.flts[i]);
+    }
 
+    int data = 0;
     for (unsigned int i = 0; i < g_ast->block.symtab.cnt; i++)
     {
         struct sym *sym = &g_ast->block.symtab.syms[i];
-        if (sym->attr & SYM_GLOBAL && !(sym->type.name == TYPE_FUNC && !sym->type.ptr))
-        {
-            asm_symbol(sym);
-            gen_datavar(sym->type); 
-        }
+        if (!isvar(sym) || !sym->init) continue;
+
+        if (!data++) asm_section(".data");
+        gen_datavar(sym);
+    }
+
+    asm_section(".bss");
+
+    for (unsigned int i = 0; i < g_ast->block.symtab.cnt; i++)
+    {
+        struct sym *sym = &g_ast->block.symtab.syms[i];
+        if (isvar(sym) && !sym->init) gen_bssvar(sym);
     }
 
     asm_section(".text");
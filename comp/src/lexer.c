@@ -89,6 +89,20 @@ static void pushi(unsigned long i)
     push((struct token) { .type = T_INTLIT, .v.ival = i });
 }
 
+// Integer or floating-point literal, the latter has a fraction or an exponent
+static void pushnum()
+{
+    char *end;
+    unsigned long i = strtoull(s_lexer.str, &end, 10);
+
+    if ((*end == '.' && isdigit(end[1])) || *end == 'e' || *end == 'E')
+        push((struct token) { .type = T_FLTLIT, .v.fval = strtod(s_lexer.str, &end) });
+    else
+        pushi(i);
+
+    s_lexer.str = end;
+}
+
 static void pushasm()
 {
     while (*s_lexer.str++ != '{');
@@ -176,7 +190,7 @@ int tokenize(const char *str)
             case '-':
             {
                 if (isdigit(*(s_lexer.str + 1)))
-                    pushi(strtoll(s_lexer.str, (char**)&s_lexer.str, 10));
+                    pushnum();
                 else switch (*(++s_lexer.str))
                 {
                     case '-': pushnv(T_DEC); s_lexer.str++; break;
@@ -340,7 +354,7 @@ int tokenize(const char *str)
             s_lexer.str++;
         }
         else if (isdigit(*s_lexer.str))
-            pushi(strtoull(s_lexer.str, (char**)&s_lexer.str, 10));
+            pushnum();
         else if (isalpha(*s_lexer.str) || *s_lexer.str == '_')
         {
             char ident[64];
@@ -15,6 +15,57 @@
 
 char *infile = NULL, *outfile = NULL;
 
+struct genopt
+{
+    const char *name;
+    int flag;
+    int *val; // Options with a value, <option>[=N]
+};
+
+static struct genopt s_options[] =
+{
+    { "omit-frame-pointer", OPT_OMITFP,      NULL },
+    { "no-tree-vectorize",  OPT_NOVECTORIZE, NULL },
+    { "function-sections",  OPT_FUNCSECTS,   NULL },
+    { "data-sections",      OPT_DATASECTS,   NULL },
+    { "align-functions",    0,               &g_alignfuncs },
+    { "align-loops",        0,               &g_alignloops },
+};
+
+// Target options (-m<option>)
+static struct genopt s_machopts[] =
+{
+    { "avx2", OPT_AVX2, NULL },
+};
+
+// Set the flag or value of option 'name' from 'opts', 0 if there is no such option
+static int setopt(struct genopt *opts, size_t cnt, const char *name)
+{
+    size_t len = strcspn(name, "=");
+    for (size_t i = 0; i < cnt; i++)
+    {
+        if (strlen(opts[i].name) != len || strncmp(opts[i].name, name, len))
+            continue;
+
+        // Alignments are the only values so far, 16 unless given
+        if (opts[i].val)
+        {
+            int val = name[len] ? atoi(name + len + 1) : 16;
+            if (val <= 0 || val & (val - 1)) return 0;
+
+            *opts[i].val = val;
+            return 1;
+        }
+
+        if (name[len]) return 0;
+
+        g_opts |= opts[i].flag;
+        return 1;
+    }
+
+    return 0;
+}
+
 char *readfile(FILE *f)
 {
     fseek(f, 0, SEEK_END);
@@ -34,7 +85,7 @@ char *readfile(FILE *f)
 int main(int argc, char **argv)
 {
     char opt;
-    while ((opt = getopt(argc, argv, "o:s:")) != -1)
+    while ((opt = getopt(argc, argv, "o:s:f:m:")) != -1)
     {
         switch (opt)
         {
@@ -44,6 +95,20 @@ int main(int argc, char **argv)
             case 's':
                 infile = strdup(optarg);
                 break;
+            case 'f':
+                if (!setopt(s_options, ARRLEN(s_options), optarg))
+                {
+                    printf("Invalid option '-f%s'\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'm':
+                if (!setopt(s_machopts, ARRLEN(s_machopts), optarg))
+                {
+                    printf("Invalid option '-m%s'\n", optarg);
+                    return -1;
+                }
+                break;
             default:
                 printf("Invalid option '%c'\n", opt);
                 return -1;
@@ -73,6 +73,7 @@ static const char *tokstrs[] =
     [T_STAR]    = "*",
     [T_SLASH]   = "/",
     [T_INTLIT]  = "int literal",
+    [T_FLTLIT]  = "float literal",
     [T_STRLIT]  = "string literal",
     [T_SEMI]    = ";",
     [T_COMMA]   = ",",
@@ -215,8 +216,8 @@ static struct type parsetype()
             
             while (curr()->type != T_RPAREN)
             {
-                t.func.params[t.func.paramcnt] = calloc(1, sizeof(struct type));
-                *t.func.params[t.func.paramcnt++] = parsetype();
+                t.func.params = realloc(t.func.params, (t.func.paramcnt + 1) * sizeof(struct type));
+                t.func.params[t.func.paramcnt++] = parsetype();
                 if (curr()->type != T_RPAREN) expect(T_COMMA);
             }
 
@@ -287,6 +288,64 @@ static int type_compatible(struct type t1, struct type t2)
     return 0;
 }
 
+// Floating-point literal of type 't', placed in the constant pool
+static struct ast *fltlit(double val, struct type t)
+{
+    struct ast *glob = s_parser.globlscope;
+    int size = asm_sizeof(t);
+
+    struct ast *ast = mkast(A_FLTLIT);
+    ast->vtype = t;
+    ast->fltlit.idx = UINT32_MAX;
+
+    // Compared bitwise so 0.0 and -0.0 stay apart
+    for (unsigned int i = 0; i < glob->block.fltcnt; i++)
+    {
+        if (glob->block.flts[i].size == size && !memcmp(&glob->block.flts[i].val, &val, sizeof(val)))
+        {
+            ast->fltlit.idx = i;
+            return ast;
+        }
+    }
+
+    ast->fltlit.idx = glob->block.fltcnt;
+
+    glob->block.flts = realloc(glob->block.flts, (glob->block.fltcnt + 1) * sizeof(struct roflt));
+    glob->block.flts[glob->block.fltcnt++] = (struct roflt)
+    {
+        .val  = val,
+        .size = size
+    };
+    return ast;
+}
+
+// Implicit conversion to 't' when an integer meets a float or two float widths
+// meet. Constants are converted right away, everything else gets a cast
+static struct ast *convert(struct ast *ast, struct type t)
+{
+    if (!asm_isfloat(t) && !asm_isfloat(ast->vtype)) return ast;
+    if (t.name == ast->vtype.name && t.ptr == ast->vtype.ptr) return ast;
+
+    if (asm_isfloat(t) && ast->type == A_INTLIT)
+        return fltlit((long)ast->intlit.ival, t);
+    if (asm_isfloat(t) && ast->type == A_FLTLIT)
+        return fltlit(s_parser.globlscope->block.flts[ast->fltlit.idx].val, t);
+
+    struct ast *cast = mkast(A_CAST);
+    cast->vtype = t;
+    cast->cast.type = t;
+    cast->cast.val  = ast;
+    return cast;
+}
+
+// The wider of two types, for arithmetic on mixed integer and float operands
+static struct type floattype(struct type t1, struct type t2)
+{
+    if (t1.name == TYPE_FLOAT64 || t2.name == TYPE_FLOAT64)
+        return mktype(TYPE_FLOAT64, 0, 0);
+    return mktype(TYPE_FLOAT32, 0, 0);
+}
+
 static void add_typedef(const char *name, struct type type)
 {
     s_typedefs = realloc(s_typedefs, (s_typedefcnt + 1) * sizeof(struct sym));
@@ -314,6 +373,9 @@ static struct ast *parenexpr()
         expect(T_RPAREN);
         struct ast *val = pre();
 
+        if (asm_isfloat(t) || asm_isfloat(val->vtype))
+            return convert(val, t);
+
         struct ast *ast = mkast(A_CAST);
         ast->vtype = t;
         ast->cast.type = t;
@@ -361,12 +423,14 @@ static struct ast *pre()
             ast = mkunary(OP_LOGNOT, val, val->vtype);
             if (!isintegral(ast->vtype) && !ast->vtype.ptr)
                 error("Logical not on non-integral or pointer type.\n");
+            if (asm_isfloat(ast->vtype))
+                ast->vtype = mktype(TYPE_INT32, 0, 0);
             return ast;
         case T_BITNOT:
             next();
             val = pre();
             ast = mkunary(OP_BITNOT, val, val->vtype);
-            if (!isintegral(ast->vtype))
+            if (!isintegral(ast->vtype) || asm_isfloat(ast->vtype))
                 error("Bitwise not on non-integral type.\n");
             return ast;
         case T_MINUS:
@@ -383,6 +447,8 @@ static struct ast *pre()
             next();
             ast->incdec.val = pre();
             ast->vtype = ast->incdec.val->vtype;
+            if (asm_isfloat(ast->vtype))
+                error("Increment or decrement of floating-point type.\n");
             return ast;
         default:
             return post(primary());
@@ -499,7 +565,7 @@ static struct ast *post(struct ast *branch)
                 unsigned int i;
                 for (i = 0; curr()->type != T_RPAREN; i++)
                 {
-                    call->call.params = realloc(call->call.params, (ast->call.paramcnt + 1) * sizeof(struct ast*));
+                    call->call.params = realloc(call->call.params, (call->call.paramcnt + 1) * sizeof(struct ast*));
                     call->call.params[call->call.paramcnt++] = binexpr();
 
                     if (curr()->type != T_RPAREN) expect(T_COMMA);
@@ -511,6 +577,15 @@ static struct ast *post(struct ast *branch)
                 else if (i > ast->vtype.func.paramcnt && !ast->vtype.func.variadic)
                     error("Too many parameters in call to function\n");
 
+                // Variadic float32 arguments are promoted to float64, like C
+                for (i = 0; i < call->call.paramcnt; i++)
+                {
+                    struct type t = i < ast->vtype.func.paramcnt ? ast->vtype.func.params[i]
+                                  : mktype(TYPE_FLOAT64, 0, 0);
+                    if (i < ast->vtype.func.paramcnt || asm_isfloat(call->call.params[i]->vtype))
+                        call->call.params[i] = convert(call->call.params[i], t);
+                }
+
                 ast = call;
                 break;
             }
@@ -521,6 +596,8 @@ static struct ast *post(struct ast *branch)
             case T_DEC:
             {
                 struct ast *inc = mkast(curr()->type == T_INC ? A_POSTINC : A_POSTDEC);
+                if (asm_isfloat(ast->vtype))
+                    error("Increment or decrement of floating-point type.\n");
                 next();
                 inc->vtype = ast->vtype;
                 inc->incdec.val = ast;
@@ -554,6 +631,10 @@ static struct ast *primary()
             ast = intlit();
             next();
             return ast;
+        case T_FLTLIT:
+            ast = fltlit(curr()->v.fval, mktype(TYPE_FLOAT64, 0, 0));
+            next();
+            return ast;
         case T_STRLIT:
             ast = mkast(A_STRLIT);
             ast->vtype = mktype(TYPE_INT8, 0, 1); // int8*
@@ -668,14 +749,47 @@ static struct ast *recurse_binexpr(int ptp)
             ternary->ternary.lhs  = rhs;
             ternary->ternary.cond = lhs;
             ternary->ternary.rhs  = binexpr();
+            ternary->vtype        = rhs->vtype;
+
+            if (asm_isfloat(rhs->vtype) || asm_isfloat(ternary->ternary.rhs->vtype))
+            {
+                ternary->vtype = floattype(rhs->vtype, ternary->ternary.rhs->vtype);
+                ternary->ternary.lhs = convert(ternary->ternary.lhs, ternary->vtype);
+                ternary->ternary.rhs = convert(ternary->ternary.rhs, ternary->vtype);
+            }
             return ternary;
         }
 
-        struct ast *expr = mkbinop(op, lhs, rhs, lhs->vtype);
-
         if (!type_compatible(lhs->vtype, rhs->vtype))
             error("Incompatible types in binary expression.\n");
 
+        if (asm_isfloat(lhs->vtype) || asm_isfloat(rhs->vtype))
+        {
+            switch (op)
+            {
+                case OP_MOD: case OP_SHL: case OP_SHR: case OP_BITAND: case OP_BITOR: case OP_BITXOR:
+                case OP_MODEQ: case OP_SHLEQ: case OP_SHREQ: case OP_BITANDEQ: case OP_BITOREQ: case OP_BITXOREQ:
+                    error("Invalid operator on floating-point type.\n");
+            }
+
+            // Assignments convert to the destination, everything else to the
+            // wider operand. Comparisons and logical operators yield integers
+            if (rightassoc(op))
+                rhs = convert(rhs, lhs->vtype);
+            else if (op != OP_LAND && op != OP_LOR)
+            {
+                struct type t = floattype(lhs->vtype, rhs->vtype);
+                lhs = convert(lhs, t);
+                rhs = convert(rhs, t);
+            }
+        }
+
+        struct ast *expr = mkbinop(op, lhs, rhs, lhs->vtype);
+        if (ISCMPOP(op) && asm_isfloat(lhs->vtype))
+            expr->vtype = mktype(TYPE_INT32, 0, 0);
+        else if ((op == OP_LAND || op == OP_LOR) && (asm_isfloat(lhs->vtype) || asm_isfloat(rhs->vtype)))
+            expr->vtype = mktype(TYPE_INT32, 0, 0);
+
         if (op == OP_ASSIGN)
         {
             if (!(lhs->type == A_UNARY && lhs->unary.op == OP_DEREF) && lhs->type != A_IDENT)
@@ -747,6 +861,9 @@ static struct ast *funcdecl()
             break;
         }
 
+        ast->funcdef.params = realloc(ast->funcdef.params, (sym.type.func.paramcnt + 1) * sizeof(char*));
+        ast->funcdef.params[sym.type.func.paramcnt] = NULL;
+
         if (curr()->type == T_IDENT)
         {
             ast->funcdef.params[sym.type.func.paramcnt] = strdup(curr()->v.sval);
@@ -754,8 +871,8 @@ static struct ast *funcdecl()
             expect(T_COLON);
         }
         
-        sym.type.func.params[sym.type.func.paramcnt] = calloc(1, sizeof(struct type));
-        *sym.type.func.params[sym.type.func.paramcnt++] = parsetype();
+        sym.type.func.params = realloc(sym.type.func.params, (sym.type.func.paramcnt + 1) * sizeof(struct type));
+        sym.type.func.params[sym.type.func.paramcnt++] = parsetype();
         if (curr()->type != T_RPAREN) expect(T_COMMA);
     }
     
@@ -789,7 +906,7 @@ static struct ast *funcdecl()
         ast->funcdef.block->block.symtab.type = SYMTAB_FUNC;
 
         for (unsigned int i = 0; i < sym.type.func.paramcnt; i++)
-            sym_put(&ast->funcdef.block->block.symtab, ast->funcdef.params[i], *sym.type.func.params[i], 0);
+            sym_put(&ast->funcdef.block->block.symtab, ast->funcdef.params[i], sym.type.func.params[i], 0);
         
         block(ast->funcdef.block, SYMTAB_FUNC);
         expect(T_RBRACE);
@@ -855,8 +972,22 @@ static struct ast *vardecl()
         if (autov)
             t = init->vtype;
         else
+        {
             if (!type_compatible(init->vtype, t))
                 error("Incompatible types in variable initialization\n");
+            init = convert(init, t);
+        }
+
+        // Globals are data, there is no code to run an initializer in
+        if (s_parser.currscope->type == SYMTAB_GLOB)
+        {
+            if (init->type != A_INTLIT && init->type != A_FLTLIT && init->type != A_STRLIT)
+                error("Initializer of global variable '%s' must be a constant\n", name);
+
+            sym_put(s_parser.currscope, name, t, attr);
+            s_parser.currscope->syms[s_parser.currscope->cnt - 1].init = init;
+            return mkast(A_VARDEF);
+        }
 
         ast = mkbinop(OP_ASSIGN, mkast(A_IDENT), init, t);
         ast->binop.lhs->ident.name = strdup(name);
@@ -969,6 +1100,7 @@ static struct ast *return_statement()
 
         if (!type_compatible(ast->ret.val->vtype, t))
             error("Incompatible return type in function '%s'.\n", sym->name);
+        ast->ret.val = convert(ast->ret.val, t);
     }
 
     return ast;
@@ -1129,6 +1261,10 @@ static struct ast *block(struct ast *block, int type)
         struct ast *ast = statement();
         if (!ast) continue; // Could be a declaration - TODO: distinguish global block from function blocks
 
+        // There is no function for code out here to run in
+        if (type == SYMTAB_GLOB && ast->type != A_FUNCDEF && ast->type != A_VARDEF && ast->type != A_ASM)
+            error("Statement outside of a function\n");
+
         if (ast->type != A_FUNCDEF && ast->type != A_ASM && ast->type != A_IFELSE
             && ast->type != A_FOR && ast->type != A_WHILE && ast->type != A_LABEL)
             expect(T_SEMI);
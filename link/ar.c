@@ -0,0 +1,150 @@
+#include "ar.h"
+#include "obj.h"
+#include "lib.h"
+
+#include <ar.h>
+#include <endian.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A static library, mapped whole like objects. Members are only read when
+// they define something that's needed
+struct archive
+{
+    const char *name;
+    uint8_t *buf;
+    size_t size;
+    const char *longnames; // The "//" member, each name ends in "/\n"
+    size_t longsize;
+    struct htab index;     // Symbol -> offset of the member defining it, plus one
+};
+
+int isarchive(uint8_t *buf, size_t size)
+{
+    return size >= SARMAG && !memcmp(buf, ARMAG, SARMAG);
+}
+
+// Member header at 'off', '*len' is the size of what follows it
+static struct ar_hdr *header(struct archive *ar, uint64_t off, size_t *len)
+{
+    if (off > ar->size || ar->size - off < sizeof(struct ar_hdr))
+        error("link: %s: Malformed archive\n", ar->name);
+
+    struct ar_hdr *hdr = (struct ar_hdr*)(ar->buf + off);
+    char size[sizeof(hdr->ar_size) + 1] = { 0 };
+    memcpy(size, hdr->ar_size, sizeof(hdr->ar_size));
+    *len = strtoul(size, NULL, 10);
+
+    if (memcmp(hdr->ar_fmag, ARFMAG, sizeof(hdr->ar_fmag)) || *len > ar->size - off - sizeof(struct ar_hdr))
+        error("link: %s: Malformed archive\n", ar->name);
+    return hdr;
+}
+
+static int isnamed(struct ar_hdr *hdr, const char *name)
+{
+    size_t len = strlen(name);
+    return !memcmp(hdr->ar_name, name, len) && hdr->ar_name[len] == ' ';
+}
+
+// "lib.a(member.o)", for messages and the map. Long names are "/<offset>"
+// into the "//" member, short ones end in '/'
+static const char *member_name(struct archive *ar, struct ar_hdr *hdr)
+{
+    const char *name = hdr->ar_name;
+    size_t len = strcspn(name, "/ ");
+    if (len > sizeof(hdr->ar_name)) len = sizeof(hdr->ar_name);
+
+    if (name[0] == '/' && ar->longnames)
+    {
+        size_t off = strtoul(name + 1, NULL, 10);
+        if (off >= ar->longsize)
+            error("link: %s: Malformed archive\n", ar->name);
+
+        name = ar->longnames + off;
+        len = 0;
+        while (off + len < ar->longsize && name[len] != '/' && name[len] != '\n') len++;
+    }
+
+    char *full = malloc(strlen(ar->name) + len + 3);
+    sprintf(full, "%s(%.*s)", ar->name, (int)len, name);
+    return full;
+}
+
+// The GNU symbol index, "/", is a big-endian count, that many member offsets,
+// then the names they define. "/SYM64/" is the same with 64-bit numbers. The
+// names stay in the mapping, the table just points at them
+static void read_index(struct archive *ar, uint8_t *data, size_t size, size_t width)
+{
+    uint64_t cnt = 0;
+    if (size >= width) memcpy((uint8_t*)&cnt + 8 - width, data, width);
+    cnt = be64toh(cnt);
+
+    if (size < width || cnt > (size - width) / width)
+        error("link: %s: Malformed archive symbol index\n", ar->name);
+
+    const char *names = (char*)data + width + cnt * width;
+    const char *end = (char*)data + size;
+    for (uint64_t i = 0; i < cnt; i++)
+    {
+        uint64_t off = 0;
+        memcpy((uint8_t*)&off + 8 - width, data + width + i * width, width);
+        off = be64toh(off);
+
+        const char *nul = memchr(names, 0, end - names);
+        if (!nul)
+            error("link: %s: Malformed archive symbol index\n", ar->name);
+
+        // The first member to define a symbol is the one that's used
+        if (!htab_get(&ar->index, names)) htab_put(&ar->index, names, (void*)(off + 1));
+        names = nul + 1;
+    }
+}
+
+// The special members all come first
+struct archive *read_archive(const char *name, uint8_t *buf, size_t size)
+{
+    struct archive *ar = calloc(1, sizeof(struct archive));
+    ar->name = name;
+    ar->buf = buf;
+    ar->size = size;
+
+    int indexed = 0;
+    for (uint64_t off = SARMAG; off < size; )
+    {
+        size_t len;
+        struct ar_hdr *hdr = header(ar, off, &len);
+        uint8_t *data = (uint8_t*)(hdr + 1);
+
+        if (isnamed(hdr, "/") || isnamed(hdr, "/SYM64/"))
+        {
+            read_index(ar, data, len, hdr->ar_name[1] == 'S' ? 8 : 4);
+            indexed = 1;
+        }
+        else if (isnamed(hdr, "//"))
+        {
+            ar->longnames = (char*)data;
+            ar->longsize = len;
+        }
+        else break;
+
+        off += sizeof(struct ar_hdr) + alignup(len, 2);
+    }
+
+    if (!indexed && size > SARMAG)
+        error("link: %s: Archive has no symbol index, run ranlib on it\n", name);
+    return ar;
+}
+
+// The member that defines 'sym', NULL if none does. Each symbol pulls its
+// member in once, so a bad index can't make this go on forever
+struct object *archive_member(struct archive *ar, const char *sym)
+{
+    size_t off = (size_t)htab_get(&ar->index, sym);
+    if (!off) return NULL;
+    htab_put(&ar->index, sym, NULL);
+
+    size_t len;
+    struct ar_hdr *hdr = header(ar, off - 1, &len);
+    return read_object(member_name(ar, hdr), (uint8_t*)(hdr + 1), len);
+}
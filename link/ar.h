@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct archive;
+struct object;
+
+int isarchive(uint8_t *buf, size_t size);
+struct archive *read_archive(const char *name, uint8_t *buf, size_t size);
+struct object *archive_member(struct archive *ar, const char *sym);
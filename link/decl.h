@@ -1,10 +1,24 @@
 #pragma once
 
 #include <stdio.h>
+#include <stdint.h>
 
 #ifndef extern_
 #define extern_ extern
 #endif
 
-extern_ FILE *g_outf;
-extern_ FILE *g_inf;
+struct object;
+struct gsym;
+
+extern_ FILE *g_outf; // Output file
+extern_ struct object **g_objs; // Input objects, in command line order
+extern_ size_t g_objcnt;
+extern_ size_t g_archcnt; // Archives among the inputs, their members are in g_objs
+extern_ struct gsym **g_gsyms; // Global symbols, in the order they were first seen
+extern_ size_t g_gsymcnt;
+extern_ int g_threads; // Worker threads, 0 for one per core
+extern_ int g_gcsections; // Drop input sections nothing reaches from the entry
+extern_ int g_printgc; // And say which
+extern_ const char *g_orderfile; // Symbols whose sections go first, hottest first
+extern_ int g_incremental; // Keep a state file next to the output, patch it when one object changes
+extern_ uint64_t g_symoff; // Where the tables after the loaded sections start in the output
@@ -1,6 +1,283 @@
 #include "link.h"
+#include "decl.h"
+#include "obj.h"
+#include "sym.h"
+#include "lib.h"
 
-void link_elf()
+#include <elf.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define PAGESIZE 0x1000
+
+static Elf64_Ehdr s_ehdr;
+static Elf64_Phdr s_phdrs[OUT_CNT];
+static size_t s_phnum;
+
+static uint32_t segflags(struct outsect *out)
+{
+    return PF_R | (out->flags & SHF_EXECINSTR ? PF_X : 0) | (out->flags & SHF_WRITE ? PF_W : 0);
+}
+
+// One PT_LOAD per run of output sections with the same permissions, each on its own
+// page. Addresses are 'base' plus the file offset, the headers load with the first
+// segment. .bss comes last and only takes memory
+static void layout(uint64_t base)
+{
+    if (base & (PAGESIZE - 1))
+        error("link: Base address 0x%lx is not page aligned\n", base);
+
+    uint32_t flags = 0;
+    for (size_t i = 0; i < OUT_CNT; i++)
+    {
+        if (!g_outs[i].size) continue;
+        if (segflags(&g_outs[i]) != flags) s_phnum++;
+        flags = segflags(&g_outs[i]);
+    }
+
+    uint64_t off = sizeof(Elf64_Ehdr) + s_phnum * sizeof(Elf64_Phdr);
+    Elf64_Phdr *ph = NULL;
+    for (size_t i = 0; i < OUT_CNT; i++)
+    {
+        struct outsect *out = &g_outs[i];
+        if (!out->size) continue;
+
+        if (!ph || segflags(out) != ph->p_flags)
+        {
+            ph = ph ? ph + 1 : s_phdrs;
+            if (ph != s_phdrs) off = alignup(off, PAGESIZE);
+
+            *ph = (Elf64_Phdr) {
+                .p_type = PT_LOAD,
+                .p_flags = segflags(out),
+                .p_offset = ph == s_phdrs ? 0 : off,
+                .p_vaddr = base + (ph == s_phdrs ? 0 : off),
+                .p_align = PAGESIZE
+            };
+            ph->p_paddr = ph->p_vaddr;
+        }
+
+        out->offset = off = alignup(off, out->align);
+        out->addr = base + off;
+        if (out->type != SHT_NOBITS)
+        {
+            off += out->size;
+            ph->p_filesz = off - ph->p_offset;
+        }
+        ph->p_memsz = out->addr + out->size - ph->p_vaddr;
+    }
+}
+
+// The name is a strtab id until name_symbols(). Only locals can repeat a name
+static void add_symbol(struct buf *symtab, struct strtab *strtab, const char *name, int bind, Elf64_Sym *sym, uint64_t addr, size_t shndx)
+{
+    Elf64_Sym out = {
+        .st_name = bind == STB_LOCAL ? strtab_add(strtab, name) : strtab_addnew(strtab, name),
+        .st_info = ELF64_ST_INFO(bind, ELF64_ST_TYPE(sym->st_info)),
+        .st_shndx = shndx,
+        .st_value = addr,
+        .st_size = sym->st_size
+    };
+    memcpy(buf_reserve(symtab, sizeof(Elf64_Sym)), &out, sizeof(Elf64_Sym));
+}
+
+// Output section index for a symbol defined in 'sect' of 'obj', 0 if it was dropped
+static size_t symshndx(struct object *obj, Elf64_Sym *sym)
+{
+    if (sym->st_shndx == SHN_ABS) return SHN_ABS;
+    if (sym->st_shndx == SHN_UNDEF || sym->st_shndx >= obj->sectcnt) return 0;
+
+    struct insect *sect = &obj->sects[sym->st_shndx];
+    return sect->out ? sect->out->idx : 0;
+}
+
+void add_locals(struct buf *symtab, struct strtab *strtab, struct object *obj)
+{
+    obj->locfirst = symtab->size / sizeof(Elf64_Sym);
+    for (size_t j = 1; j < obj->symcnt; j++)
+    {
+        Elf64_Sym *sym = &obj->syms[j];
+        int type = ELF64_ST_TYPE(sym->st_info);
+        if (ELF64_ST_BIND(sym->st_info) != STB_LOCAL || type == STT_SECTION || type == STT_FILE) continue;
+
+        size_t shndx = symshndx(obj, sym);
+        if (shndx) add_symbol(symtab, strtab, sym_name(obj, sym), STB_LOCAL, sym, symaddr(obj, j), shndx);
+    }
+    obj->loccnt = symtab->size / sizeof(Elf64_Sym) - obj->locfirst;
+}
+
+// Lay out 'strtab' and swap the ids in 'symtab' for offsets into it
+void name_symbols(struct buf *symtab, struct strtab *strtab)
+{
+    strtab_finish(strtab);
+
+    Elf64_Sym *syms = (Elf64_Sym*)symtab->data;
+    for (size_t i = 0; i < symtab->size / sizeof(Elf64_Sym); i++)
+        syms[i].st_name = strtab->offs[syms[i].st_name];
+}
+
+// Locals first, as ELF wants, then every defined global. Returns the index of
+// the first global
+static size_t build_symtab(struct buf *symtab, struct strtab *strtab)
+{
+    memset(buf_reserve(symtab, sizeof(Elf64_Sym)), 0, sizeof(Elf64_Sym));
+    strtab_add(strtab, "");
+
+    for (size_t i = 0; i < g_objcnt; i++)
+        add_locals(symtab, strtab, g_objs[i]);
+
+    size_t firstglob = symtab->size / sizeof(Elf64_Sym);
+    for (size_t i = 0; i < g_gsymcnt; i++)
+    {
+        struct gsym *gsym = g_gsyms[i];
+        if (!gsym->sym) continue;
+
+        size_t shndx = symshndx(gsym->obj, gsym->sym);
+        if (!shndx) continue;
+
+        uint64_t addr = shndx == SHN_ABS ? gsym->sym->st_value : symaddr(gsym->obj, gsym->sym - gsym->obj->syms);
+        gsym->outsym = symtab->size / sizeof(Elf64_Sym);
+        add_symbol(symtab, strtab, gsym->name, ELF64_ST_BIND(gsym->sym->st_info), gsym->sym, addr, shndx);
+    }
+
+    name_symbols(symtab, strtab);
+    return firstglob;
+}
+
+static uint8_t *s_image; // The whole output file
+static size_t s_imagesize;
+
+static struct buf s_symtab;
+static struct strtab s_strtab = { .exact = 1 }, s_shstrtab; // Too many symbols to sort the names
+static size_t s_firstglob;
+static uint64_t s_stroff, s_shstroff;
+static size_t s_shnum;
+static size_t s_symname, s_strname, s_shstrname;
+
+// After the loaded sections come the symbol table, its strings, the section names
+// and the section headers. The file is built in memory, loaded sections go
+// straight to their place in it
+static void layout_file()
+{
+    s_shnum = 1;
+    for (size_t i = 0; i < OUT_CNT; i++)
+        if (g_outs[i].size) g_outs[i].idx = s_shnum++;
+
+    s_firstglob = build_symtab(&s_symtab, &s_strtab);
+
+    for (size_t i = 0; i < OUT_CNT; i++)
+        g_outs[i].namei = strtab_add(&s_shstrtab, g_outs[i].name);
+    s_symname = strtab_add(&s_shstrtab, ".symtab");
+    s_strname = strtab_add(&s_shstrtab, ".strtab");
+    s_shstrname = strtab_add(&s_shstrtab, ".shstrtab");
+
+    strtab_finish(&s_shstrtab);
+    for (size_t i = 0; i < OUT_CNT; i++)
+        g_outs[i].namei = s_shstrtab.offs[g_outs[i].namei];
+    s_symname = s_shstrtab.offs[s_symname];
+    s_strname = s_shstrtab.offs[s_strname];
+    s_shstrname = s_shstrtab.offs[s_shstrname];
+
+    uint64_t off = sizeof(Elf64_Ehdr) + s_phnum * sizeof(Elf64_Phdr);
+    for (size_t i = 0; i < OUT_CNT; i++)
+        if (g_outs[i].size && g_outs[i].type != SHT_NOBITS) off = g_outs[i].offset + g_outs[i].size;
+
+    g_symoff = alignup(off, 8);
+    s_stroff = g_symoff + s_symtab.size;
+    s_shstroff = s_stroff + s_strtab.size;
+
+    s_ehdr.e_shoff = alignup(s_shstroff + s_shstrtab.size, 8);
+    s_ehdr.e_shnum = s_shnum + 3;
+    s_imagesize = s_ehdr.e_shoff + s_ehdr.e_shnum * sizeof(Elf64_Shdr);
+
+    s_image = calloc(1, s_imagesize);
+    for (size_t i = 0; i < OUT_CNT; i++)
+        if (g_outs[i].size && g_outs[i].type != SHT_NOBITS) g_outs[i].data = s_image + g_outs[i].offset;
+}
+
+// Headers and tables go into the image, which is then written in one go
+static void write_file(uint64_t entry)
 {
+    unsigned char ident[EI_NIDENT] = {
+        [EI_MAG0]       = ELFMAG0,
+        [EI_MAG1]       = ELFMAG1,
+        [EI_MAG2]       = ELFMAG2,
+        [EI_MAG3]       = ELFMAG3,
+        [EI_CLASS]      = ELFCLASS64,
+        [EI_DATA]       = ELFDATA2LSB,
+        [EI_VERSION]    = EV_CURRENT,
+        [EI_OSABI]      = ELFOSABI_LINUX,
+        [EI_ABIVERSION] = 0
+    };
+    memcpy(&s_ehdr.e_ident, ident, sizeof(ident));
+    s_ehdr.e_type      = ET_EXEC;
+    s_ehdr.e_machine   = EM_X86_64;
+    s_ehdr.e_version   = EV_CURRENT;
+    s_ehdr.e_entry     = entry;
+    s_ehdr.e_phoff     = sizeof(Elf64_Ehdr);
+    s_ehdr.e_ehsize    = sizeof(Elf64_Ehdr);
+    s_ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    s_ehdr.e_phnum     = s_phnum;
+    s_ehdr.e_shentsize = sizeof(Elf64_Shdr);
+    s_ehdr.e_shstrndx  = s_shnum + 2;
+
+    memcpy(s_image, &s_ehdr, sizeof(Elf64_Ehdr));
+    memcpy(s_image + sizeof(Elf64_Ehdr), s_phdrs, s_phnum * sizeof(Elf64_Phdr));
+    memcpy(s_image + g_symoff, s_symtab.data, s_symtab.size);
+    strtab_write(&s_strtab, s_image + s_stroff);
+    strtab_write(&s_shstrtab, s_image + s_shstroff);
+
+    Elf64_Shdr *shdr = (Elf64_Shdr*)(s_image + s_ehdr.e_shoff) + 1;
+    for (size_t i = 0; i < OUT_CNT; i++)
+    {
+        struct outsect *out = &g_outs[i];
+        if (!out->size) continue;
+
+        *shdr++ = (Elf64_Shdr) {
+            .sh_name = out->namei,
+            .sh_type = out->type,
+            .sh_flags = out->flags,
+            .sh_addr = out->addr,
+            .sh_offset = out->offset,
+            .sh_size = out->size,
+            .sh_addralign = out->align
+        };
+    }
+
+    *shdr++ = (Elf64_Shdr) {
+        .sh_name = s_symname,
+        .sh_type = SHT_SYMTAB,
+        .sh_offset = g_symoff,
+        .sh_size = s_symtab.size,
+        .sh_link = s_shnum + 1,
+        .sh_info = s_firstglob,
+        .sh_addralign = 8,
+        .sh_entsize = sizeof(Elf64_Sym)
+    };
+    *shdr++ = (Elf64_Shdr) { .sh_name = s_strname, .sh_type = SHT_STRTAB, .sh_offset = s_stroff, .sh_size = s_strtab.size, .sh_addralign = 1 };
+    *shdr++ = (Elf64_Shdr) { .sh_name = s_shstrname, .sh_type = SHT_STRTAB, .sh_offset = s_shstroff, .sh_size = s_shstrtab.size, .sh_addralign = 1 };
+
+    fwrite(s_image, 1, s_imagesize, g_outf);
+    fchmod(fileno(g_outf), 0755);
+}
+
+// Static executable from the objects in 'paths', starting at symbol 'entry'
+size_t link_elf(char **paths, size_t cnt, uint64_t base, const char *entry)
+{
+    load_inputs(paths, cnt);
+
+    struct gsym *start = findgsym(entry);
+    if (!start || !start->sym)
+        error("link: Entry symbol '%s' is not defined\n", entry);
+
+    if (g_gcsections) gc_sections(entry);
+    place_sections();
+    layout(base);
+    layout_file();
+
+    size_t relocs = fill_output();
 
+    write_file(symaddr(start->obj, start->sym - start->obj->syms));
+    return relocs;
 }
@@ -0,0 +1,615 @@
+#include "link.h"
+#include "decl.h"
+#include "obj.h"
+#include "sym.h"
+#include "ar.h"
+#include "lib.h"
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define STATE_MAGIC 0x31434e494b4e494cUL // "LINKINC1"
+
+// Where an input section went
+struct stsect
+{
+    int64_t out;  // Output section, -1 if it was left out
+    int64_t kind; // Output section it would go to, -1 if none
+    uint64_t off, room;
+};
+
+struct stobj
+{
+    char *path;
+    uint64_t hash;
+    uint64_t sectcnt;
+    struct stsect *sects;
+    uint64_t locfirst, loccnt; // Its locals in the output .symtab
+};
+
+// A global as the last link resolved it. 'obj' is -1 for an undefined weak
+struct stglob
+{
+    char *name;
+    uint64_t addr;
+    int64_t obj;
+    uint64_t outsym;
+};
+
+// What the last --incremental link did, kept in <output>.state. Enough to
+// put a new version of one object where the old one was without the others
+static struct
+{
+    uint64_t opthash;
+    uint64_t outsize;
+    uint64_t symoff;
+    struct { uint64_t addr, offset, idx; } outs[OUT_CNT];
+    uint64_t objcnt, globcnt;
+    struct stobj *objs;
+    struct stglob *globs;
+} s_state;
+
+static char *state_path(const char *out)
+{
+    char *path = malloc(strlen(out) + sizeof(".state"));
+    sprintf(path, "%s.state", out);
+    return path;
+}
+
+static uint64_t hashfile(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        if (fd >= 0) close(fd);
+        return 0;
+    }
+
+    uint64_t h = memhash(NULL, 0);
+    void *data = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    if (data != MAP_FAILED)
+    {
+        h = memhash(data, st.st_size);
+        munmap(data, st.st_size);
+    }
+
+    close(fd);
+    return h;
+}
+
+// Anything that changes the layout when the objects don't
+static uint64_t opthash(uint64_t base, const char *entry)
+{
+    struct buf buf = { 0 };
+    memcpy(buf_reserve(&buf, sizeof(base)), &base, sizeof(base));
+    buf_addstr(&buf, entry);
+    buf_addstr(&buf, g_gcsections ? "gc" : "");
+
+    uint64_t order = g_orderfile ? hashfile(g_orderfile) : 0;
+    memcpy(buf_reserve(&buf, sizeof(order)), &order, sizeof(order));
+
+    uint64_t h = memhash(buf.data, buf.size);
+    free(buf.data);
+    return h;
+}
+
+static void put64(FILE *f, uint64_t v)
+{
+    fwrite(&v, sizeof(v), 1, f);
+}
+
+static void putstr(FILE *f, const char *str)
+{
+    put64(f, strlen(str));
+    fputs(str, f);
+}
+
+static void write_state(const char *out)
+{
+    char *path = state_path(out);
+    FILE *f = xfopen(path, "w");
+
+    put64(f, STATE_MAGIC);
+    put64(f, s_state.opthash);
+    put64(f, s_state.outsize);
+    put64(f, s_state.symoff);
+    for (size_t i = 0; i < OUT_CNT; i++)
+    {
+        put64(f, s_state.outs[i].addr);
+        put64(f, s_state.outs[i].offset);
+        put64(f, s_state.outs[i].idx);
+    }
+
+    put64(f, s_state.objcnt);
+    for (size_t i = 0; i < s_state.objcnt; i++)
+    {
+        struct stobj *obj = &s_state.objs[i];
+        putstr(f, obj->path);
+        put64(f, obj->hash);
+        put64(f, obj->locfirst);
+        put64(f, obj->loccnt);
+        put64(f, obj->sectcnt);
+        fwrite(obj->sects, sizeof(struct stsect), obj->sectcnt, f);
+    }
+
+    put64(f, s_state.globcnt);
+    for (size_t i = 0; i < s_state.globcnt; i++)
+    {
+        putstr(f, s_state.globs[i].name);
+        put64(f, s_state.globs[i].addr);
+        put64(f, s_state.globs[i].obj);
+        put64(f, s_state.globs[i].outsym);
+    }
+
+    fclose(f);
+    free(path);
+}
+
+static uint8_t *s_rd, *s_rdend;
+static int s_bad; // Ran past the end, the state is cut short or not ours
+
+static uint64_t get64()
+{
+    uint64_t v = 0;
+    if (s_bad || s_rdend - s_rd < (ptrdiff_t)sizeof(v)) s_bad = 1;
+    else
+    {
+        memcpy(&v, s_rd, sizeof(v));
+        s_rd += sizeof(v);
+    }
+    return v;
+}
+
+// Room for 'cnt' items of 'size' bytes is left in the file
+static int fits_state(uint64_t cnt, size_t size)
+{
+    if (cnt > (uint64_t)(s_rdend - s_rd) / size) s_bad = 1;
+    return !s_bad;
+}
+
+static char *getstr()
+{
+    uint64_t len = get64();
+    if (!fits_state(len, 1)) return strdup("");
+
+    char *str = strndup((char*)s_rd, len);
+    s_rd += len;
+    return str;
+}
+
+// 0 if there's no usable state
+static int read_state(const char *out)
+{
+    char *path = state_path(out);
+    FILE *f = fopen(path, "r");
+    free(path);
+    if (!f) return 0;
+
+    struct buf buf = { 0 };
+    size_t n;
+    do n = fread(buf_reserve(&buf, 4096), 1, 4096, f);
+    while (n == 4096);
+    buf.size -= 4096 - n;
+    fclose(f);
+
+    s_rd = buf.data;
+    s_rdend = buf.data + buf.size;
+    s_bad = get64() != STATE_MAGIC;
+
+    s_state.opthash = get64();
+    s_state.outsize = get64();
+    s_state.symoff = get64();
+    for (size_t i = 0; i < OUT_CNT; i++)
+    {
+        s_state.outs[i].addr = get64();
+        s_state.outs[i].offset = get64();
+        s_state.outs[i].idx = get64();
+    }
+
+    s_state.objcnt = get64();
+    if (!fits_state(s_state.objcnt, sizeof(uint64_t))) return 0;
+
+    s_state.objs = calloc(s_state.objcnt, sizeof(struct stobj));
+    for (size_t i = 0; i < s_state.objcnt && !s_bad; i++)
+    {
+        struct stobj *obj = &s_state.objs[i];
+        obj->path = getstr();
+        obj->hash = get64();
+        obj->locfirst = get64();
+        obj->loccnt = get64();
+        obj->sectcnt = get64();
+        if (!fits_state(obj->sectcnt, sizeof(struct stsect))) break;
+
+        obj->sects = malloc(obj->sectcnt * sizeof(struct stsect));
+        memcpy(obj->sects, s_rd, obj->sectcnt * sizeof(struct stsect));
+        s_rd += obj->sectcnt * sizeof(struct stsect);
+    }
+
+    s_state.globcnt = get64();
+    if (!fits_state(s_state.globcnt, sizeof(uint64_t))) return 0;
+
+    s_state.globs = calloc(s_state.globcnt, sizeof(struct stglob));
+    for (size_t i = 0; i < s_state.globcnt && !s_bad; i++)
+    {
+        s_state.globs[i].name = getstr();
+        s_state.globs[i].addr = get64();
+        s_state.globs[i].obj = get64();
+        s_state.globs[i].outsym = get64();
+    }
+
+    return !s_bad;
+}
+
+static void hash_object(size_t i)
+{
+    s_state.objs[i].hash = memhash(g_objs[i]->buf, g_objs[i]->size);
+}
+
+// Remember the link that was just written, for the next one
+void save_state(const char *out, char **paths, size_t cnt, uint64_t base, const char *entry)
+{
+    // Only objects given by name can be patched
+    if (g_archcnt)
+    {
+        char *path = state_path(out);
+        unlink(path);
+        free(path);
+        return;
+    }
+
+    s_state.opthash = opthash(base, entry);
+    s_state.outsize = ftell(g_outf);
+    s_state.symoff = g_symoff;
+    for (size_t i = 0; i < OUT_CNT; i++)
+    {
+        s_state.outs[i].addr = g_outs[i].addr;
+        s_state.outs[i].offset = g_outs[i].offset;
+        s_state.outs[i].idx = g_outs[i].idx;
+    }
+
+    s_state.objcnt = cnt;
+    s_state.objs = calloc(cnt, sizeof(struct stobj));
+    parallel_for(cnt, hash_object);
+
+    for (size_t i = 0; i < cnt; i++)
+    {
+        struct object *obj = g_objs[i];
+        struct stobj *st = &s_state.objs[i];
+        st->path = paths[i];
+        st->locfirst = obj->locfirst;
+        st->loccnt = obj->loccnt;
+        st->sectcnt = obj->sectcnt;
+        st->sects = calloc(obj->sectcnt, sizeof(struct stsect));
+
+        for (size_t j = 1; j < obj->sectcnt; j++)
+        {
+            struct insect *sect = &obj->sects[j];
+            struct outsect *kind = outsect_for(sect);
+            st->sects[j] = (struct stsect) {
+                .out = sect->out ? sect->out - g_outs : -1,
+                .kind = kind ? kind - g_outs : -1,
+                .off = sect->off,
+                .room = sect_room(sect)
+            };
+        }
+    }
+
+    s_state.globs = calloc(g_gsymcnt, sizeof(struct stglob));
+    s_state.globcnt = 0;
+    for (size_t i = 0; i < g_gsymcnt; i++)
+    {
+        struct gsym *gsym = g_gsyms[i];
+        struct stglob *g = &s_state.globs[s_state.globcnt];
+        if (!gsym->sym) *g = (struct stglob) { (char*)gsym->name, 0, -1, 0 };
+        else if (gsym->outsym)
+        {
+            uint64_t addr = gsym->sym->st_shndx == SHN_ABS ? gsym->sym->st_value : symaddr(gsym->obj, gsym->sym - gsym->obj->syms);
+            *g = (struct stglob) { (char*)gsym->name, addr, gsym->obj->idx, gsym->outsym };
+        }
+        else continue; // Its section was dropped
+
+        s_state.globcnt++;
+    }
+
+    write_state(out);
+}
+
+// The new version of an object needs the same sections as the old, each
+// fitting the room the old one had. They go where the old ones were
+static int fit_object(struct object *obj)
+{
+    struct stobj *st = &s_state.objs[obj->idx];
+    if (obj->sectcnt != st->sectcnt) return 0;
+
+    for (size_t i = 0; i < OUT_CNT; i++)
+    {
+        g_outs[i].addr = s_state.outs[i].addr;
+        g_outs[i].offset = s_state.outs[i].offset;
+        g_outs[i].idx = s_state.outs[i].idx;
+    }
+
+    for (size_t j = 1; j < obj->sectcnt; j++)
+    {
+        struct insect *sect = &obj->sects[j];
+        struct stsect *old = &st->sects[j];
+        struct outsect *kind = outsect_for(sect);
+        if ((kind ? kind - g_outs : -1) != old->kind) return 0;
+        if (old->out < 0) continue;
+
+        uint64_t align = sect->shdr->sh_addralign ? sect->shdr->sh_addralign : 1;
+        if (sect->shdr->sh_size > old->room || old->off & (align - 1)) return 0;
+
+        sect->out = &g_outs[old->out];
+        sect->off = old->off;
+    }
+
+    return 1;
+}
+
+static Elf64_Sym **s_newdefs; // New definition of each global the changed object had
+
+// Addresses of the new object's symbols: its own from where its sections are
+// now, the rest from the last link. Its globals have to stay where they were,
+// the objects that aren't relinked point at them
+static int resolve_patch(struct object *obj)
+{
+    // There are far fewer of its globals than in the whole link, so look
+    // those up while going over the last link's once
+    struct htab names = { 0 };
+    for (size_t j = 1; j < obj->symcnt; j++)
+        if (ELF64_ST_BIND(obj->syms[j].st_info) != STB_LOCAL) htab_put(&names, sym_name(obj, &obj->syms[j]), (void*)j);
+
+    struct stglob **globs = calloc(obj->symcnt, sizeof(struct stglob*));
+    size_t owned = 0, had = 0;
+    for (size_t i = 0; i < s_state.globcnt; i++)
+    {
+        size_t j = (size_t)htab_get(&names, s_state.globs[i].name);
+        if (j) globs[j] = &s_state.globs[i];
+        if (s_state.globs[i].obj == (int64_t)obj->idx) had++;
+    }
+
+    s_newdefs = calloc(s_state.globcnt, sizeof(Elf64_Sym*));
+    obj->gsyms = calloc(obj->symcnt, sizeof(struct gsym*));
+    obj->symaddrs = calloc(obj->symcnt, sizeof(uint64_t));
+    uint8_t *missing = calloc(obj->symcnt, 1);
+
+    for (size_t j = 1; j < obj->symcnt; j++)
+    {
+        Elf64_Sym *sym = &obj->syms[j];
+        int bind = ELF64_ST_BIND(sym->st_info);
+        struct insect *sect = sym->st_shndx != SHN_UNDEF && sym->st_shndx < obj->sectcnt ? &obj->sects[sym->st_shndx] : NULL;
+
+        uint64_t addr = 0;
+        if (sym->st_shndx == SHN_ABS) addr = sym->st_value;
+        else if (sect && sect->out) addr = sect->out->addr + sect->off + sym->st_value;
+        else missing[j] = 1;
+
+        if (bind == STB_LOCAL)
+        {
+            obj->symaddrs[j] = addr;
+            continue;
+        }
+
+        // Stands for a global nothing else here knows, so it resolves to 0
+        obj->gsyms[j] = calloc(1, sizeof(struct gsym));
+        obj->gsyms[j]->name = sym_name(obj, sym);
+
+        struct stglob *g = globs[j];
+        if (sym->st_shndx == SHN_COMMON) return 0;
+        if (sym->st_shndx == SHN_UNDEF || (g && g->obj != (int64_t)obj->idx))
+        {
+            // Someone else's definition, one here would win over a strong one
+            // only if it's strong too, and over nothing at all
+            if (!g || (sym->st_shndx != SHN_UNDEF && (bind != STB_WEAK || g->obj < 0))) return 0;
+            obj->symaddrs[j] = g->addr;
+            missing[j] = 0;
+            continue;
+        }
+
+        if (!g)
+        {
+            if (!missing[j]) return 0; // New global
+            continue;
+        }
+
+        if (missing[j] || addr != g->addr) return 0;
+        obj->symaddrs[j] = addr;
+        s_newdefs[g - s_state.globs] = sym;
+        owned++;
+    }
+
+    if (owned != had) return 0;
+
+    // Nothing placed may now refer to what the last link left out
+    for (size_t j = 1; j < obj->sectcnt; j++)
+    {
+        struct insect *sect = &obj->sects[j];
+        if (!sect->out || !sect->rela) continue;
+
+        Elf64_Rela *relas = sect_data(obj, sect->rela);
+        size_t cnt = sect->rela->sh_size / sizeof(Elf64_Rela);
+        for (size_t i = 0; i < cnt; i++)
+        {
+            size_t symi = ELF64_R_SYM(relas[i].r_info);
+            if (symi >= obj->symcnt || (symi && missing[symi])) return 0;
+        }
+    }
+
+    free(missing);
+    free(globs);
+    return 1;
+}
+
+// Symbols 'first' to 'last' of the old .symtab, names and all
+static void copy_syms(struct buf *symtab, struct strtab *strtab, Elf64_Sym *syms, const char *names, size_t first, size_t last)
+{
+    for (size_t i = first; i < last; i++)
+    {
+        Elf64_Sym sym = syms[i];
+        const char *name = names + sym.st_name;
+        sym.st_name = ELF64_ST_BIND(sym.st_info) == STB_LOCAL ? strtab_add(strtab, name) : strtab_addnew(strtab, name);
+        memcpy(buf_reserve(symtab, sizeof(Elf64_Sym)), &sym, sizeof(Elf64_Sym));
+    }
+}
+
+// Put the new object's sections over the old ones in the output and relocate
+// them there, then rewrite the tables at the end, where its locals changed.
+// Returns the number of relocations
+static size_t write_patch(const char *out, struct object *obj)
+{
+    int fd = open(out, O_RDWR);
+    uint8_t *image = fd < 0 ? MAP_FAILED : mmap(NULL, s_state.outsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED)
+        error("link: %s: Can't update in place\n", out);
+
+    for (size_t i = 0; i < OUT_CNT; i++)
+        g_outs[i].data = g_outs[i].type != SHT_NOBITS ? image + g_outs[i].offset : NULL;
+
+    struct stobj *st = &s_state.objs[obj->idx];
+    size_t relocs = 0;
+    for (size_t j = 1; j < obj->sectcnt; j++)
+    {
+        struct insect *sect = &obj->sects[j];
+        if (!sect->out || !sect->out->data) continue;
+
+        memset(sect->out->data + sect->off, 0, st->sects[j].room);
+        if (sect->shdr->sh_type != SHT_NOBITS)
+            memcpy(sect->out->data + sect->off, sect_data(obj, sect->shdr), sect->shdr->sh_size);
+
+        if (sect->rela)
+        {
+            relocate(sect);
+            relocs += sect->rela->sh_size / sizeof(Elf64_Rela);
+        }
+    }
+
+    Elf64_Ehdr *ehdr = (Elf64_Ehdr*)image;
+    Elf64_Shdr *shdrs = (Elf64_Shdr*)(image + ehdr->e_shoff);
+    size_t symi = 0;
+    while (symi < ehdr->e_shnum && shdrs[symi].sh_type != SHT_SYMTAB) symi++;
+    if (symi == ehdr->e_shnum)
+        error("link: %s: No symbol table to update\n", out);
+
+    Elf64_Shdr *symsh = &shdrs[symi], *strsh = &shdrs[symsh->sh_link], *shstrsh = &shdrs[ehdr->e_shstrndx];
+    Elf64_Sym *oldsyms = (Elf64_Sym*)(image + symsh->sh_offset);
+    const char *oldnames = (char*)image + strsh->sh_offset;
+
+    // Same order as build_symtab(): locals object by object, then the globals
+    struct buf symtab = { 0 };
+    struct strtab strtab = { .exact = 1 };
+    copy_syms(&symtab, &strtab, oldsyms, oldnames, 0, st->locfirst);
+    add_locals(&symtab, &strtab, obj);
+    copy_syms(&symtab, &strtab, oldsyms, oldnames, st->locfirst + st->loccnt, symsh->sh_info);
+
+    int64_t delta = obj->loccnt - st->loccnt;
+    size_t firstglob = symsh->sh_info + delta;
+    copy_syms(&symtab, &strtab, oldsyms, oldnames, symsh->sh_info, symsh->sh_size / sizeof(Elf64_Sym));
+    name_symbols(&symtab, &strtab);
+
+    for (size_t i = 0; i < s_state.globcnt; i++)
+    {
+        struct stglob *g = &s_state.globs[i];
+        if (g->outsym) g->outsym += delta;
+        if (!s_newdefs[i]) continue;
+
+        Elf64_Sym *sym = (Elf64_Sym*)symtab.data + g->outsym;
+        sym->st_info = s_newdefs[i]->st_info;
+        sym->st_size = s_newdefs[i]->st_size;
+    }
+
+    // The tables and section headers, as layout_file() arranges them
+    struct buf tail = { 0 };
+    uint64_t stroff = s_state.symoff + symtab.size;
+    uint64_t shstroff = stroff + strtab.size;
+    memcpy(buf_reserve(&tail, symtab.size), symtab.data, symtab.size);
+    strtab_write(&strtab, buf_reserve(&tail, strtab.size));
+    memcpy(buf_reserve(&tail, shstrsh->sh_size), image + shstrsh->sh_offset, shstrsh->sh_size);
+
+    uint64_t shoff = alignup(s_state.symoff + tail.size, 8);
+    memset(buf_reserve(&tail, shoff - s_state.symoff - tail.size), 0, shoff - s_state.symoff - tail.size);
+
+    Elf64_Shdr *newsh = buf_reserve(&tail, ehdr->e_shnum * sizeof(Elf64_Shdr));
+    memcpy(newsh, shdrs, ehdr->e_shnum * sizeof(Elf64_Shdr));
+    newsh[symi].sh_size = symtab.size;
+    newsh[symi].sh_info = firstglob;
+    newsh[symsh->sh_link].sh_offset = stroff;
+    newsh[symsh->sh_link].sh_size = strtab.size;
+    newsh[ehdr->e_shstrndx].sh_offset = shstroff;
+
+    ehdr->e_shoff = shoff;
+    munmap(image, s_state.outsize);
+
+    if (pwrite(fd, tail.data, tail.size, s_state.symoff) != (ssize_t)tail.size || ftruncate(fd, s_state.symoff + tail.size) < 0)
+        error("link: %s: Can't update in place\n", out);
+    close(fd);
+
+    st->loccnt = obj->loccnt;
+    for (size_t i = obj->idx + 1; i < s_state.objcnt; i++)
+        s_state.objs[i].locfirst += delta;
+    s_state.outsize = s_state.symoff + tail.size;
+
+    free(symtab.data);
+    strtab_free(&strtab);
+    free(tail.data);
+    return relocs;
+}
+
+static char **s_paths;
+static uint64_t *s_hashes;
+
+static void hash_input(size_t i)
+{
+    s_hashes[i] = hashfile(s_paths[i]);
+}
+
+// Update 'out' from the last --incremental link if that's possible: the same
+// inputs and options, and at most one object changed in a way that fits.
+// Returns 0 if it needs a full link
+int patch_output(const char *out, char **paths, size_t cnt, uint64_t base, const char *entry, size_t *relocs)
+{
+    if (!read_state(out) || s_state.opthash != opthash(base, entry) || s_state.objcnt != cnt)
+        return 0;
+
+    for (size_t i = 0; i < cnt; i++)
+        if (strcmp(s_state.objs[i].path, paths[i])) return 0;
+
+    struct stat st;
+    if (stat(out, &st) < 0 || (uint64_t)st.st_size != s_state.outsize)
+        return 0;
+
+    s_paths = paths;
+    s_hashes = malloc(cnt * sizeof(uint64_t));
+    parallel_for(cnt, hash_input);
+
+    size_t changed = 0, nchanged = 0;
+    for (size_t i = 0; i < cnt; i++)
+    {
+        if (s_hashes[i] == s_state.objs[i].hash) continue;
+        changed = i;
+        nchanged++;
+    }
+
+    *relocs = 0;
+    if (!nchanged) return 1;
+    if (nchanged > 1) return 0;
+
+    size_t size;
+    uint8_t *buf = map_file(paths[changed], &size);
+    if (isarchive(buf, size)) return 0;
+
+    struct object *obj = read_object(paths[changed], buf, size);
+    obj->idx = changed;
+    if (!fit_object(obj) || !resolve_patch(obj)) return 0;
+
+    *relocs = write_patch(out, obj);
+    s_state.objs[changed].hash = s_hashes[changed];
+    write_state(out);
+    return 1;
+}
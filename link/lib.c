@@ -0,0 +1,287 @@
+#include "lib.h"
+#include "decl.h"
+
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+
+FILE *xfopen(const char *path, const char *access)
+{
+    FILE *f = fopen(path, access);
+    if (!f)
+        error("link: %s: %s\n", path, strerror(errno));
+
+    return f;
+}
+
+void error(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+
+    exit(-1);
+}
+
+// 'n' more bytes at the end of 'buf'
+void *buf_reserve(struct buf *buf, size_t n)
+{
+    if (buf->size + n > buf->cap)
+    {
+        while (buf->size + n > buf->cap) buf->cap = buf->cap ? buf->cap * 2 : 256;
+        buf->data = realloc(buf->data, buf->cap);
+    }
+
+    void *p = buf->data + buf->size;
+    buf->size += n;
+    return p;
+}
+
+// Append 'str' with its terminator, returns its offset
+size_t buf_addstr(struct buf *buf, const char *str)
+{
+    size_t off = buf->size;
+    size_t len = strlen(str) + 1;
+    memcpy(buf_reserve(buf, len), str, len);
+    return off;
+}
+
+size_t strhash(const char *str)
+{
+    size_t h = 14695981039346656037UL; // FNV-1a
+    while (*str) h = (h ^ (uint8_t)*str++) * 1099511628211UL;
+    return h;
+}
+
+// For telling whether a whole file changed, so it takes 8 bytes at a time
+uint64_t memhash(const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    uint64_t h = 14695981039346656037UL ^ size;
+    for (; size >= 8; p += 8, size -= 8)
+    {
+        uint64_t w;
+        memcpy(&w, p, sizeof(w));
+        h = (h ^ w) * 1099511628211UL;
+        h ^= h >> 32;
+    }
+
+    while (size--) h = (h ^ *p++) * 1099511628211UL;
+    return h;
+}
+
+static size_t htab_slot(struct htab *tab, const char *key)
+{
+    size_t i = strhash(key) & (tab->cap - 1);
+    while (tab->keys[i] && strcmp(tab->keys[i], key))
+        i = (i + 1) & (tab->cap - 1);
+    return i;
+}
+
+void *htab_get(struct htab *tab, const char *key)
+{
+    if (!tab->cap) return NULL;
+    return tab->vals[htab_slot(tab, key)];
+}
+
+// Add or replace 'key'. Grows at half full, so probes stay short
+void htab_put(struct htab *tab, const char *key, void *val)
+{
+    if (2 * (tab->cnt + 1) > tab->cap)
+    {
+        struct htab old = *tab;
+
+        tab->cap = old.cap ? old.cap * 2 : 64;
+        tab->keys = calloc(tab->cap, sizeof(char*));
+        tab->vals = calloc(tab->cap, sizeof(void*));
+
+        for (size_t i = 0; i < old.cap; i++)
+        {
+            if (!old.keys[i]) continue;
+
+            size_t slot = htab_slot(tab, old.keys[i]);
+            tab->keys[slot] = old.keys[i];
+            tab->vals[slot] = old.vals[i];
+        }
+
+        free(old.keys);
+        free(old.vals);
+    }
+
+    size_t slot = htab_slot(tab, key);
+    if (!tab->keys[slot]) tab->cnt++;
+
+    tab->keys[slot] = key;
+    tab->vals[slot] = val;
+}
+
+// Skips the lookup an 'exact' table does, for names already unique among
+// themselves like the globals. At worst one of them is stored twice
+size_t strtab_addnew(struct strtab *tab, const char *str)
+{
+    if (tab->cnt == tab->cap)
+    {
+        tab->cap = tab->cap ? tab->cap * 2 : 64;
+        tab->strs = realloc(tab->strs, tab->cap * sizeof(char*));
+    }
+
+    tab->strs[tab->cnt] = str;
+    return tab->cnt++;
+}
+
+size_t strtab_add(struct strtab *tab, const char *str)
+{
+    if (tab->exact)
+    {
+        size_t id = (size_t)htab_get(&tab->ids, str);
+        if (id) return id - 1;
+        htab_put(&tab->ids, str, (void*)(tab->cnt + 1));
+    }
+
+    return strtab_addnew(tab, str);
+}
+
+struct tail
+{
+    const char *str;
+    size_t len, id;
+};
+
+// The character 'pos' places from the end, -1 once past the start
+static int tailchar(struct tail *t, size_t pos)
+{
+    return pos < t->len ? (uint8_t)t->str[t->len - pos - 1] : -1;
+}
+
+static void swaptails(struct tail *a, struct tail *b)
+{
+    struct tail t = *a;
+    *a = *b;
+    *b = t;
+}
+
+// Sort by the characters from the last back, descending, so a string comes
+// right after every string it is the tail of. Multikey quicksort: the run
+// sharing the pivot's character moves on to the next one, so the characters
+// already known to match are never compared again
+static void sorttails(struct tail *t, size_t n, size_t pos)
+{
+    while (n > 1)
+    {
+        int pivot = tailchar(&t[n / 2], pos);
+
+        size_t gt = 0, i = 0, lt = n;
+        while (i < lt)
+        {
+            int c = tailchar(&t[i], pos);
+            if (c > pivot) swaptails(&t[gt++], &t[i++]);
+            else if (c < pivot) swaptails(&t[i], &t[--lt]);
+            else i++;
+        }
+
+        sorttails(t, gt, pos);
+        sorttails(t + lt, n - lt, pos);
+
+        // All of the middle run ended here, so they are the same string
+        if (pivot == -1) return;
+        t += gt;
+        n = lt - gt;
+        pos++;
+    }
+}
+
+// Give every string its offset, returns the size of the table. Offset 0
+// is the empty name
+size_t strtab_finish(struct strtab *tab)
+{
+    tab->offs = malloc(tab->cnt * sizeof(size_t));
+    tab->size = 1;
+    if (tab->exact)
+    {
+        for (size_t i = 0; i < tab->cnt; i++)
+        {
+            size_t len = strlen(tab->strs[i]);
+            tab->offs[i] = len ? tab->size : 0;
+            if (len) tab->size += len + 1;
+        }
+        return tab->size;
+    }
+
+    struct tail *tails = malloc(tab->cnt * sizeof(struct tail));
+    for (size_t i = 0; i < tab->cnt; i++)
+        tails[i] = (struct tail) { tab->strs[i], strlen(tab->strs[i]), i };
+    sorttails(tails, tab->cnt, 0);
+
+    for (size_t i = 0; i < tab->cnt; i++)
+    {
+        struct tail *t = &tails[i], *prev = i ? &tails[i - 1] : NULL;
+        if (!t->len) tab->offs[t->id] = 0;
+        else if (prev && prev->len >= t->len && !memcmp(prev->str + prev->len - t->len, t->str, t->len))
+            tab->offs[t->id] = tab->offs[prev->id] + prev->len - t->len;
+        else
+        {
+            tab->offs[t->id] = tab->size;
+            tab->size += t->len + 1;
+        }
+    }
+
+    free(tails);
+    return tab->size;
+}
+
+// The table itself, strtab_finish() bytes. Strings that share bytes write the same ones
+void strtab_write(struct strtab *tab, void *dst)
+{
+    *(char*)dst = 0;
+    for (size_t i = 0; i < tab->cnt; i++)
+        strcpy((char*)dst + tab->offs[i], tab->strs[i]);
+}
+
+void strtab_free(struct strtab *tab)
+{
+    free(tab->strs);
+    free(tab->offs);
+    free(tab->ids.keys);
+    free(tab->ids.vals);
+    *tab = (struct strtab) { 0 };
+}
+
+static void (*s_fn)(size_t);
+static size_t s_cnt, s_next;
+
+static void *worker(void *arg)
+{
+    (void)arg;
+
+    size_t i;
+    while ((i = __atomic_fetch_add(&s_next, 1, __ATOMIC_RELAXED)) < s_cnt)
+        s_fn(i);
+    return NULL;
+}
+
+// Call 'fn' once for each of 0..cnt-1, on as many threads as there are cores.
+// Threads take the next index as they finish one, so uneven work balances out
+void parallel_for(size_t cnt, void (*fn)(size_t))
+{
+    long ncpu = g_threads ? g_threads : sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nthreads = ncpu > 1 ? (size_t)ncpu : 1;
+    if (nthreads > cnt) nthreads = cnt;
+
+    s_fn = fn;
+    s_cnt = cnt;
+    s_next = 0;
+
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    for (size_t i = 1; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, worker, NULL);
+
+    worker(NULL);
+
+    for (size_t i = 1; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
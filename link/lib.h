@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ARRLEN(arr) (sizeof(arr) / sizeof(arr[0]))
+
+FILE *xfopen(const char *path, const char *access);
+void error(const char *format, ...);
+
+// Round 'v' up to a multiple of 'align', a power of two (0 counts as 1)
+static inline uint64_t alignup(uint64_t v, uint64_t align)
+{
+    return align > 1 ? (v + align - 1) & ~(align - 1) : v;
+}
+
+// Growable byte buffer, for symbol tables and the like
+struct buf
+{
+    uint8_t *data;
+    size_t size, cap;
+};
+
+void *buf_reserve(struct buf *buf, size_t n);
+size_t buf_addstr(struct buf *buf, const char *str);
+
+size_t strhash(const char *str);
+uint64_t memhash(const void *data, size_t size);
+
+// String-keyed table, open addressing: global symbols, archive indexes and the
+// symbol ordering file. Keys are not copied, they mostly point into the inputs
+struct htab
+{
+    const char **keys;
+    void **vals;
+    size_t cap, cnt;
+};
+
+void *htab_get(struct htab *tab, const char *key);
+void htab_put(struct htab *tab, const char *key, void *val);
+
+// Output string table. .shstrtab is small, so strtab_finish() sorts it and a
+// section name ending another (".text" in ".rela.text") is stored inside it.
+// .strtab is too big to sort at link speed and is 'exact': equal names share
+// through 'ids' as they are added. Offsets are in 'offs' once laid out.
+// Strings are not copied
+struct strtab
+{
+    const char **strs;
+    size_t *offs;
+    size_t cnt, cap, size;
+    int exact;       // Only equal names share, found by hashing instead of sorting
+    struct htab ids; // Name -> id + 1, when 'exact'
+};
+
+size_t strtab_add(struct strtab *tab, const char *str);
+size_t strtab_addnew(struct strtab *tab, const char *str);
+size_t strtab_finish(struct strtab *tab);
+void strtab_write(struct strtab *tab, void *dst);
+void strtab_free(struct strtab *tab);
+
+void parallel_for(size_t cnt, void (*fn)(size_t));
@@ -0,0 +1,368 @@
+#include "link.h"
+#include "decl.h"
+#include "obj.h"
+#include "sym.h"
+#include "ar.h"
+#include "lib.h"
+
+#include <elf.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Input sections are merged into these, in this order in memory
+struct outsect g_outs[OUT_CNT] =
+{
+    { .name = ".text",   .type = SHT_PROGBITS, .flags = SHF_ALLOC | SHF_EXECINSTR },
+    { .name = ".rodata", .type = SHT_PROGBITS, .flags = SHF_ALLOC },
+    { .name = ".data",   .type = SHT_PROGBITS, .flags = SHF_ALLOC | SHF_WRITE },
+    { .name = ".bss",    .type = SHT_NOBITS,   .flags = SHF_ALLOC | SHF_WRITE },
+};
+
+// Output section for 'sect', by name (.text, .text.foo, ...) or else by its flags.
+// NULL if it isn't loaded
+struct outsect *outsect_for(struct insect *sect)
+{
+    Elf64_Shdr *shdr = sect->shdr;
+    if (shdr->sh_type == SHT_RELA || shdr->sh_type == SHT_SYMTAB || shdr->sh_type == SHT_STRTAB)
+        return NULL;
+
+    for (size_t i = 0; i < OUT_CNT; i++)
+    {
+        size_t len = strlen(g_outs[i].name);
+        if (!strncmp(sect->name, g_outs[i].name, len) && (!sect->name[len] || sect->name[len] == '.'))
+            return &g_outs[i];
+    }
+
+    if (!(shdr->sh_flags & SHF_ALLOC)) return NULL;
+    if (shdr->sh_flags & SHF_EXECINSTR) return &g_outs[OUT_TEXT];
+    if (shdr->sh_type == SHT_NOBITS) return &g_outs[OUT_BSS];
+    if (shdr->sh_flags & SHF_WRITE) return &g_outs[OUT_DATA];
+    return &g_outs[OUT_RODATA];
+}
+
+static size_t s_objcap;
+
+static void add_object(struct object *obj)
+{
+    if (g_objcnt == s_objcap)
+    {
+        s_objcap = s_objcap ? s_objcap * 2 : 64;
+        g_objs = realloc(g_objs, s_objcap * sizeof(struct object*));
+    }
+
+    obj->idx = g_objcnt;
+    g_objs[g_objcnt++] = obj;
+    add_symbols(obj);
+}
+
+// Pull in the members of 'ar' that define something still undefined, until
+// none do. As with other linkers, only what the inputs before it need counts
+static void add_members(struct archive *ar)
+{
+    int added;
+    do
+    {
+        added = 0;
+        for (size_t i = 0; i < g_gsymcnt; i++)
+        {
+            // Defined already, or only referenced weakly: like GNU ld, weak
+            // undefined symbols stay 0 rather than pulling a member in
+            struct gsym *gsym = g_gsyms[i];
+            if (gsym->sym || !gsym->ref) continue;
+
+            struct object *obj = archive_member(ar, gsym->name);
+            if (!obj) continue;
+
+            add_object(obj);
+            added = 1;
+        }
+    } while (added);
+}
+
+// Read the objects and archives and resolve their symbols against each other
+void load_inputs(char **paths, size_t cnt)
+{
+    for (size_t i = 0; i < cnt; i++)
+    {
+        size_t size;
+        uint8_t *buf = map_file(paths[i], &size);
+        if (!isarchive(buf, size))
+        {
+            add_object(read_object(paths[i], buf, size));
+            continue;
+        }
+
+        g_archcnt++;
+        add_members(read_archive(paths[i], buf, size));
+    }
+
+    check_undefined();
+}
+
+static int byorder(const void *a, const void *b)
+{
+    size_t l = (*(struct insect**)a)->order, r = (*(struct insect**)b)->order;
+    return l < r ? -1 : l > r;
+}
+
+// Loaded sections, the rest is kept or dropped no matter what
+static int isalloc(struct insect *sect)
+{
+    return sect->shdr->sh_flags & SHF_ALLOC && outsect_for(sect);
+}
+
+// Mark the loaded sections reachable from the one 'entry' is in through
+// relocations. Without one, as for a flat binary, execution starts in the
+// first code section of the first object
+void gc_sections(const char *entry)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < g_objcnt; i++)
+        total += g_objs[i]->sectcnt;
+
+    struct insect **work = malloc(total * sizeof(struct insect*));
+    size_t cnt = 0;
+
+    struct gsym *start = entry ? findgsym(entry) : NULL;
+    struct insect *root = start && start->sym ? symsect(start->obj, start->sym - start->obj->syms) : NULL;
+    for (size_t j = 1; !root && g_objcnt && j < g_objs[0]->sectcnt; j++)
+        if (isalloc(&g_objs[0]->sects[j]) && outsect_for(&g_objs[0]->sects[j]) == &g_outs[OUT_TEXT])
+            root = &g_objs[0]->sects[j];
+
+    if (root)
+    {
+        root->live = 1;
+        work[cnt++] = root;
+    }
+
+    // Each section is pushed once, when it is first marked
+    while (cnt)
+    {
+        struct insect *sect = work[--cnt];
+        if (!sect->rela) continue;
+
+        struct object *obj = sect->obj;
+        Elf64_Rela *relas = sect_data(obj, sect->rela);
+        size_t relcnt = sect->rela->sh_size / sizeof(Elf64_Rela);
+        for (size_t i = 0; i < relcnt; i++)
+        {
+            size_t symi = ELF64_R_SYM(relas[i].r_info);
+            struct insect *to = symi && symi < obj->symcnt ? symsect(obj, symi) : NULL;
+            if (!to || to->live) continue;
+
+            to->live = 1;
+            work[cnt++] = to;
+        }
+    }
+
+    free(work);
+
+    if (!g_printgc) return;
+    for (size_t i = 0; i < g_objcnt; i++)
+        for (size_t j = 1; j < g_objs[i]->sectcnt; j++)
+        {
+            struct insect *sect = &g_objs[i]->sects[j];
+            if (isalloc(sect) && !sect->live && sect->shdr->sh_size)
+                fprintf(stderr, "link: Removing unused section '%s' in %s\n", sect->name, g_objs[i]->name);
+        }
+}
+
+// Give each section holding a symbol from the --symbol-ordering-file its
+// rank there, one name per line. A section goes where its first listed symbol
+// is, locals count too. Returns the sections that have a rank, in order
+static struct insect **order_sections(size_t *cnt)
+{
+    FILE *f = xfopen(g_orderfile, "r");
+    struct htab ranks = { 0 };
+    size_t rank = 0;
+
+    char *line = NULL;
+    size_t n = 0;
+    ssize_t len;
+    while ((len = getline(&line, &n, f)) != -1)
+    {
+        while (len && (line[len - 1] == '\n' || line[len - 1] == ' ')) line[--len] = 0;
+        if (!len || htab_get(&ranks, line)) continue;
+
+        htab_put(&ranks, strdup(line), (void*)++rank);
+    }
+    free(line);
+    fclose(f);
+
+    size_t total = 0;
+    for (size_t i = 0; i < g_objcnt; i++)
+        total += g_objs[i]->sectcnt;
+
+    struct insect **sects = malloc(total * sizeof(struct insect*));
+    *cnt = 0;
+    for (size_t i = 0; i < g_objcnt; i++)
+    {
+        struct object *obj = g_objs[i];
+        for (size_t j = 1; j < obj->symcnt; j++)
+        {
+            Elf64_Sym *sym = &obj->syms[j];
+            if (sym->st_shndx == SHN_UNDEF || sym->st_shndx >= obj->sectcnt || ELF64_ST_TYPE(sym->st_info) == STT_SECTION) continue;
+            if (obj->gsyms[j] && obj->gsyms[j]->sym != sym) continue; // Lost to another definition
+
+            size_t r = (size_t)htab_get(&ranks, sym_name(obj, sym));
+            struct insect *sect = &obj->sects[sym->st_shndx];
+            if (!r || !sect->out) continue;
+
+            if (!sect->order) sects[(*cnt)++] = sect;
+            if (!sect->order || r < sect->order) sect->order = r;
+        }
+    }
+
+    qsort(sects, *cnt, sizeof(struct insect*), byorder);
+    return sects;
+}
+
+// Bytes set aside for 'sect'. For --incremental it gets some slack, so a
+// later version of it can be patched in without moving anything else. Empty
+// ones get none, or every object would add padding to every output section
+uint64_t sect_room(struct insect *sect)
+{
+    uint64_t size = sect->shdr->sh_size;
+    return g_incremental && size ? size + size / 4 + 16 : size;
+}
+
+static void place_section(struct insect *sect)
+{
+    struct outsect *out = sect->out;
+    uint64_t align = sect->shdr->sh_addralign ? sect->shdr->sh_addralign : 1;
+    if (align > out->align) out->align = align;
+
+    sect->off = out->size = alignup(out->size, align);
+    out->size += sect_room(sect);
+}
+
+// Give every input section its offset into its output section. With
+// --gc-sections the ones gc_sections() didn't reach are left out. Sections
+// named in a --symbol-ordering-file come first, the rest follow in input order
+void place_sections()
+{
+    for (size_t i = 0; i < g_objcnt; i++)
+        for (size_t j = 1; j < g_objs[i]->sectcnt; j++)
+        {
+            struct insect *sect = &g_objs[i]->sects[j];
+            sect->out = g_gcsections && !sect->live ? NULL : outsect_for(sect);
+        }
+
+    size_t cnt = 0;
+    struct insect **ordered = g_orderfile ? order_sections(&cnt) : NULL;
+    for (size_t i = 0; i < cnt; i++)
+        place_section(ordered[i]);
+    free(ordered);
+
+    for (size_t i = 0; i < g_objcnt; i++)
+        for (size_t j = 1; j < g_objs[i]->sectcnt; j++)
+        {
+            struct insect *sect = &g_objs[i]->sects[j];
+            if (sect->out && !sect->order) place_section(sect);
+        }
+}
+
+// 'v' fits 'bits' bits as a signed or unsigned number
+static int fits(uint64_t v, int bits, int sign)
+{
+    if (bits == 64) return 1;
+
+    int64_t min = -((int64_t)1 << (bits - 1));
+    uint64_t max = ((uint64_t)1 << bits) - 1;
+    return sign ? (int64_t)v >= min && (int64_t)v <= (int64_t)(max >> 1) : v <= max;
+}
+
+// Apply the relocations of 'sect' to its copy in the output
+void relocate(struct insect *sect)
+{
+    struct object *obj = sect->obj;
+    Elf64_Shdr *rel = sect->rela;
+
+    Elf64_Rela *relas = sect_data(obj, rel);
+    size_t cnt = rel->sh_size / sizeof(Elf64_Rela);
+    uint8_t *data = sect->out->data + sect->off;
+    uint64_t addr = sect->out->addr + sect->off;
+
+    for (Elf64_Rela *r = relas; r < relas + cnt; r++)
+    {
+        size_t symi = ELF64_R_SYM(r->r_info);
+        if (symi >= obj->symcnt)
+            error("link: %s: Bad symbol index %lu in %s\n", obj->name, symi, obj->shstrtab + rel->sh_name);
+
+        // 0 is rare enough to check where it came from
+        uint64_t v = obj->symaddrs[symi];
+        if (!v) v = symaddr(obj, symi);
+        v += r->r_addend;
+
+        int size, sign;
+        switch (ELF64_R_TYPE(r->r_info))
+        {
+            case R_X86_64_NONE:  continue;
+            case R_X86_64_64:    size = 8; sign = 0; break;
+            case R_X86_64_32:    size = 4; sign = 0; break;
+            case R_X86_64_32S:   size = 4; sign = 1; break;
+            case R_X86_64_16:    size = 2; sign = 0; break;
+            case R_X86_64_8:     size = 1; sign = 0; break;
+            case R_X86_64_PC32:
+            case R_X86_64_PLT32: size = 4; sign = 1; v -= addr + r->r_offset; break; // Static, so no PLT
+            default:
+                error("link: %s: Unsupported relocation type %lu in %s\n", obj->name, ELF64_R_TYPE(r->r_info), sect->name);
+                return;
+        }
+
+        if (r->r_offset + size > sect->shdr->sh_size)
+            error("link: %s: Relocation against '%s' is past the end of %s\n", obj->name, sym_name(obj, &obj->syms[symi]), sect->name);
+        if (!fits(v, size * 8, sign))
+            error("link: %s: Relocation against '%s' in %s+0x%lx doesn't fit\n", obj->name, sym_name(obj, &obj->syms[symi]), sect->name, r->r_offset);
+
+        uint8_t *loc = data + r->r_offset;
+        for (int j = 0; j < size; j++)
+            loc[j] = v >> (j * 8);
+    }
+}
+
+static struct insect **s_fills; // Input sections with bytes in the output
+static size_t s_fillcnt;
+
+// Copy one input section to its place in the output and relocate it there. No
+// two write the same bytes, so these run in parallel
+static void fill_section(size_t i)
+{
+    struct insect *sect = s_fills[i];
+    if (sect->shdr->sh_type != SHT_NOBITS)
+        memcpy(sect->out->data + sect->off, sect_data(sect->obj, sect->shdr), sect->shdr->sh_size);
+
+    if (sect->rela) relocate(sect);
+}
+
+static void resolve_object(size_t i)
+{
+    resolve_symbols(g_objs[i]);
+}
+
+// Copy and relocate every input section that has bytes in the output, once
+// the output sections have their addresses and 'data'. Returns the number
+// of relocations
+size_t fill_output()
+{
+    for (size_t i = 0; i < g_objcnt; i++)
+    {
+        struct object *obj = g_objs[i];
+        for (size_t j = 1; j < obj->sectcnt; j++)
+        {
+            struct insect *sect = &obj->sects[j];
+            if (!sect->out || !sect->out->data) continue;
+
+            s_fills = realloc(s_fills, (s_fillcnt + 1) * sizeof(struct insect*));
+            s_fills[s_fillcnt++] = sect;
+        }
+    }
+
+    parallel_for(g_objcnt, resolve_object);
+    parallel_for(s_fillcnt, fill_section);
+
+    size_t relocs = 0;
+    for (size_t i = 0; i < s_fillcnt; i++)
+        if (s_fills[i]->rela) relocs += s_fills[i]->rela->sh_size / sizeof(Elf64_Rela);
+    return relocs;
+}
@@ -1,6 +1,50 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 
-void link_elf();
-void link_binary(uint64_t base);
+// A section of the output, made of the input sections of the same kind
+struct outsect
+{
+    const char *name;
+    uint32_t type;
+    uint64_t flags;
+    uint64_t addr, offset, size, align;
+    uint8_t *data;
+    size_t idx; // Section header index
+    size_t namei; // Name offset in .shstrtab
+};
+
+#define OUT_TEXT   0
+#define OUT_RODATA 1
+#define OUT_DATA   2
+#define OUT_BSS    3
+#define OUT_CNT    4
+
+extern struct outsect g_outs[OUT_CNT];
+
+struct insect;
+
+struct outsect *outsect_for(struct insect *sect);
+uint64_t sect_room(struct insect *sect);
+void relocate(struct insect *sect);
+
+void load_inputs(char **paths, size_t cnt);
+void gc_sections(const char *entry);
+void place_sections();
+size_t fill_output();
+void write_map(const char *path);
+
+// Symbols of 'obj' local to it, as they go in the output .symtab
+struct object;
+struct buf;
+struct strtab;
+void add_locals(struct buf *symtab, struct strtab *strtab, struct object *obj);
+void name_symbols(struct buf *symtab, struct strtab *strtab);
+
+int patch_output(const char *out, char **paths, size_t cnt, uint64_t base, const char *entry, size_t *relocs);
+void save_state(const char *out, char **paths, size_t cnt, uint64_t base, const char *entry);
+
+// Both return the number of relocations applied
+size_t link_elf(char **paths, size_t cnt, uint64_t base, const char *entry);
+size_t link_binary(char **paths, size_t cnt, uint64_t base);
@@ -8,28 +8,43 @@
 #include <string.h>
 #include <errno.h>
 #include <elf.h>
+#include <time.h>
 
-static char *inf_name = NULL;
+static char **inf_names = NULL;
+static size_t inf_cnt = 0;
 static char *outf_name = NULL;
+static char *entry = "_start";
+static char *mapf_name = NULL;
 
 static int isbin = 0;
+static int s_timing = 0;
 static size_t base = 0;
 
-//static Elf64_Ehdr s_ehdr = { 0 };
+static struct option s_longopts[] =
+{
+    { "gc-sections",       no_argument, &g_gcsections, 1 },
+    { "print-gc-sections", no_argument, &g_printgc,    1 },
+    { "Map",               required_argument, NULL,    'M' },
+    { "symbol-ordering-file", required_argument, NULL, 'O' },
+    { "incremental",       no_argument, &g_incremental, 1 },
+    { 0 }
+};
 
 void usage()
 {
-    printf("usage: link <object> -o <output>\n");
+    printf("usage: link [-b] [-t] [-j <threads>] [-s 0x<base>] [-e <entry>] [-Map <mapfile>] [--gc-sections] [--print-gc-sections] [--symbol-ordering-file <file>] [--incremental] <objects...> -o <output>\n");
     exit(-1);
 }
 
 void parse_cmd_opts(int argc, char **argv)
 {
-    char opt;
-    while ((opt = getopt(argc, argv, "o:s:b")) != -1)
+    int opt;
+    while ((opt = getopt_long_only(argc, argv, "o:s:be:tj:", s_longopts, NULL)) != -1)
     {
         switch (opt)
         {
+            case 0:
+                break;
             case 'o':
                 outf_name = strdup(optarg);
                 break;
@@ -39,13 +54,31 @@ void parse_cmd_opts(int argc, char **argv)
             case 'b':
                 isbin = 1;
                 break;
+            case 'M':
+                mapf_name = strdup(optarg);
+                break;
+            case 'O':
+                g_orderfile = strdup(optarg);
+                break;
+            case 'e':
+                entry = strdup(optarg);
+                break;
+            case 't':
+                s_timing = 1;
+                break;
+            case 'j':
+                g_threads = atoi(optarg);
+                break;
+            default:
+                usage();
         }
     }
 
     if (!argv[optind])
         usage();
 
-    inf_name = argv[optind];
+    inf_names = &argv[optind];
+    inf_cnt = argc - optind;
 
     if (!outf_name)
         outf_name = strdup("a.out");
@@ -53,7 +86,6 @@ void parse_cmd_opts(int argc, char **argv)
 
 void cleanup()
 {
-    if (g_inf)  fclose(g_inf);
     if (g_outf) fclose(g_outf);
 }
 
@@ -63,55 +95,43 @@ int main(int argc, char **argv)
 
     atexit(cleanup);
 
-    g_inf = fopen(inf_name, "r");
-    if (!g_inf)
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Flat binaries and maps always take a full link
+    if (isbin) g_incremental = 0;
+    uint64_t elfbase = base ? base : 0x400000;
+
+    size_t relocs = 0;
+    int patched = g_incremental && !mapf_name && patch_output(outf_name, inf_names, inf_cnt, elfbase, entry, &relocs);
+    if (!patched)
     {
-        printf("link: %s: %s\n", inf_name, strerror(errno));
-        return -1;
+        g_outf = fopen(outf_name, "w+");
+        if (!g_outf)
+        {
+            printf("link: %s: %s\n", outf_name, strerror(errno));
+            return -1;
+        }
+
+        if (isbin)
+            relocs = link_binary(inf_names, inf_cnt, base);
+        else
+            relocs = link_elf(inf_names, inf_cnt, elfbase, entry);
+
+        if (g_incremental)
+            save_state(outf_name, inf_names, inf_cnt, elfbase, entry);
     }
 
-    g_outf = fopen(outf_name, "w+");
-    if (!g_outf)
+    if (mapf_name)
+        write_map(mapf_name);
+
+    if (s_timing)
     {
-        printf("link: %s: %s\n", outf_name, strerror(errno));
-        return -1;
+        if (g_outf) fflush(g_outf);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "link: %zu objects, %zu relocations in %.3f s%s\n", inf_cnt, relocs, secs, patched ? " (incremental)" : "");
     }
 
-    if (isbin)
-        link_binary(base);
-    else
-        link_elf();
-
-    /*unsigned char ident[EI_NIDENT] = {
-        [EI_MAG0]       = ELFMAG0,
-        [EI_MAG1]       = ELFMAG1,
-        [EI_MAG2]       = ELFMAG2,
-        [EI_MAG3]       = ELFMAG3,
-        [EI_CLASS]      = ELFCLASS64,
-        [EI_DATA]       = ELFDATA2LSB,
-        [EI_VERSION]    = EV_CURRENT,
-        [EI_OSABI]      = ELFOSABI_LINUX,
-        [EI_ABIVERSION] = 0
-    };
-    memcpy(&s_ehdr.e_ident, ident, sizeof(ident));
-    s_ehdr.e_type      = ET_EXEC;
-    s_ehdr.e_machine   = EM_X86_64;
-    s_ehdr.e_version   = EV_CURRENT;
-    s_ehdr.e_ehsize    = sizeof(Elf64_Ehdr);
-    s_ehdr.e_shentsize = sizeof(Elf64_Shdr);
-    s_ehdr.e_phnum     = 1;
-    s_ehdr.e_phentsize = sizeof(Elf64_Phdr);
-    s_ehdr.e_phoff     = sizeof(Elf64_Ehdr);
-
-    fwrite(&s_ehdr, sizeof(Elf64_Ehdr), 1, g_outf);   
-
-    Elf64_Phdr phdr = {
-        .p_type = PT_LOAD,
-        .p_vaddr = 0x40000,
-        .p_flags = PF_X | PF_R | PF_W
-    };
-
-    fwrite(&phdr, sizeof(Elf64_Phdr), 1, g_outf);*/
-
     return 0;
 }
@@ -0,0 +1,166 @@
+#include "link.h"
+#include "decl.h"
+#include "obj.h"
+#include "sym.h"
+#include "lib.h"
+
+#include <elf.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// A defined symbol as it ends up in the output
+struct mapsym
+{
+    const char *name;
+    struct object *obj;
+    size_t objidx;
+    Elf64_Sym *sym;
+    uint64_t addr;
+};
+
+// An input section and where it came from
+struct mapsect
+{
+    struct insect *sect;
+    size_t objidx, shndx;
+};
+
+static struct mapsym *s_syms;
+static size_t s_symcnt;
+
+static const char *typestr(Elf64_Sym *sym)
+{
+    switch (ELF64_ST_TYPE(sym->st_info))
+    {
+        case STT_FUNC:   return "function";
+        case STT_OBJECT: return "object";
+    }
+    return "";
+}
+
+// Every named symbol in a loaded section. A global only counts where it won
+static void collect_symbols()
+{
+    for (size_t i = 0; i < g_objcnt; i++)
+    {
+        struct object *obj = g_objs[i];
+        for (size_t j = 1; j < obj->symcnt; j++)
+        {
+            Elf64_Sym *sym = &obj->syms[j];
+            int type = ELF64_ST_TYPE(sym->st_info);
+            if (type == STT_SECTION || type == STT_FILE) continue;
+            if (sym->st_shndx == SHN_UNDEF || sym->st_shndx == SHN_ABS || sym->st_shndx >= obj->sectcnt) continue;
+            if (!obj->sects[sym->st_shndx].out) continue;
+            if (obj->gsyms[j] && obj->gsyms[j]->sym != sym) continue;
+
+            s_syms = realloc(s_syms, (s_symcnt + 1) * sizeof(struct mapsym));
+            s_syms[s_symcnt++] = (struct mapsym) { sym_name(obj, sym), obj, i, sym, symaddr(obj, j) };
+        }
+    }
+}
+
+static int cmpu(uint64_t l, uint64_t r)
+{
+    return l < r ? -1 : l > r;
+}
+
+// By object, section, then address, so each input section's symbols are a run
+static int byplace(const void *a, const void *b)
+{
+    const struct mapsym *l = a, *r = b;
+    if (l->objidx != r->objidx) return cmpu(l->objidx, r->objidx);
+    if (l->sym->st_shndx != r->sym->st_shndx) return cmpu(l->sym->st_shndx, r->sym->st_shndx);
+    return cmpu(l->addr, r->addr);
+}
+
+// First symbol of section 'shndx' of object 'objidx'
+static size_t firstsym(size_t objidx, size_t shndx)
+{
+    size_t lo = 0, hi = s_symcnt;
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi) / 2;
+        struct mapsym *m = &s_syms[mid];
+        if (m->objidx < objidx || (m->objidx == objidx && m->sym->st_shndx < shndx)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static int byoff(const void *a, const void *b)
+{
+    const struct mapsect *l = a, *r = b;
+    return cmpu(l->sect->off, r->sect->off);
+}
+
+static int bysize(const void *a, const void *b)
+{
+    const struct mapsym *l = a, *r = b;
+    if (l->sym->st_size != r->sym->st_size) return l->sym->st_size < r->sym->st_size ? 1 : -1;
+    return cmpu(l->addr, r->addr);
+}
+
+// Output sections with the input sections that went into them and the
+// symbols in each, what was left out, then every symbol by size
+void write_map(const char *path)
+{
+    FILE *f = xfopen(path, "w");
+    collect_symbols();
+    qsort(s_syms, s_symcnt, sizeof(struct mapsym), byplace);
+
+    struct mapsect *sects = NULL;
+    fprintf(f, "Output sections\n\n");
+    for (size_t i = 0; i < OUT_CNT; i++)
+    {
+        struct outsect *out = &g_outs[i];
+        if (!out->size) continue;
+
+        fprintf(f, "%-24s 0x%016lx %#10lx\n", out->name, out->addr, out->size);
+
+        // Sections aren't in input order with a --symbol-ordering-file
+        size_t cnt = 0;
+        for (size_t j = 0; j < g_objcnt; j++)
+            for (size_t k = 1; k < g_objs[j]->sectcnt; k++)
+            {
+                struct insect *sect = &g_objs[j]->sects[k];
+                if (sect->out != out || !sect->shdr->sh_size) continue;
+
+                sects = realloc(sects, (cnt + 1) * sizeof(struct mapsect));
+                sects[cnt++] = (struct mapsect) { sect, j, k };
+            }
+        qsort(sects, cnt, sizeof(struct mapsect), byoff);
+
+        for (size_t j = 0; j < cnt; j++)
+        {
+            struct insect *sect = sects[j].sect;
+            fprintf(f, "  %-22s 0x%016lx %#10lx %s\n", sect->name, out->addr + sect->off, sect->shdr->sh_size, sect->obj->name);
+
+            size_t oi = sects[j].objidx, si = sects[j].shndx;
+            for (size_t l = firstsym(oi, si); l < s_symcnt && s_syms[l].objidx == oi && s_syms[l].sym->st_shndx == si; l++)
+                fprintf(f, "%-24s 0x%016lx %#10lx %-8s %s\n", "", s_syms[l].addr, s_syms[l].sym->st_size,
+                        typestr(s_syms[l].sym), s_syms[l].name);
+        }
+        fprintf(f, "\n");
+    }
+
+    free(sects);
+
+    fprintf(f, "Discarded input sections\n\n");
+    for (size_t j = 0; j < g_objcnt; j++)
+    {
+        struct object *obj = g_objs[j];
+        for (size_t k = 1; k < obj->sectcnt; k++)
+        {
+            struct insect *sect = &obj->sects[k];
+            if (!sect->out && sect->shdr->sh_flags & SHF_ALLOC && sect->shdr->sh_size)
+                fprintf(f, "  %-22s %18s %#10lx %s\n", sect->name, "", sect->shdr->sh_size, obj->name);
+        }
+    }
+
+    fprintf(f, "\nSymbols by size\n\n");
+    qsort(s_syms, s_symcnt, sizeof(struct mapsym), bysize);
+    for (size_t i = 0; i < s_symcnt; i++)
+        fprintf(f, "%#10lx %-8s %-24s %s\n", s_syms[i].sym->st_size, typestr(s_syms[i].sym), s_syms[i].name, s_syms[i].obj->name);
+
+    fclose(f);
+}
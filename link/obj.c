@@ -0,0 +1,138 @@
+#include "obj.h"
+#include "decl.h"
+#include "lib.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void malformed(struct object *obj)
+{
+    error("link: %s: Truncated or malformed object\n", obj->name);
+}
+
+// 'size' bytes at 'off', which have to be in the file
+static void *at(struct object *obj, uint64_t off, uint64_t size)
+{
+    if (off > obj->size || size > obj->size - off) malformed(obj);
+    return obj->buf + off;
+}
+
+void *sect_data(struct object *obj, Elf64_Shdr *shdr)
+{
+    if (shdr->sh_type == SHT_NOBITS) return NULL;
+    return at(obj, shdr->sh_offset, shdr->sh_size);
+}
+
+const char *sym_name(struct object *obj, Elf64_Sym *sym)
+{
+    if (ELF64_ST_TYPE(sym->st_info) == STT_SECTION)
+        return obj->sects[sym->st_shndx].name;
+    return obj->strtab + sym->st_name;
+}
+
+// Inputs are only read, so the pages are shared with the page cache and
+// nothing gets copied
+uint8_t *map_file(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+        error("link: %s: %s\n", path, strerror(errno));
+
+    *size = st.st_size;
+    uint8_t *buf = *size ? mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    if (buf == MAP_FAILED)
+        error("link: %s: %s\n", path, strerror(errno));
+
+    close(fd);
+    return buf;
+}
+
+// String table section 'idx', which has to exist and end in a terminator so
+// no name runs off its end
+static const char *strsect(struct object *obj, size_t idx, size_t *size)
+{
+    if (idx >= obj->sectcnt) malformed(obj);
+
+    Elf64_Shdr *shdr = &obj->shdrs[idx];
+    const char *data = sect_data(obj, shdr);
+    if (!data || !shdr->sh_size || data[shdr->sh_size - 1]) malformed(obj);
+
+    *size = shdr->sh_size;
+    return data;
+}
+
+// Find the section and symbol tables of an x86-64 relocatable object that's
+// already in memory, a mapped file or an archive member. 'name' is for messages
+struct object *read_object(const char *name, uint8_t *buf, size_t size)
+{
+    struct object *obj = calloc(1, sizeof(struct object));
+    obj->name = name;
+    obj->buf = buf;
+    obj->size = size;
+
+    if (obj->size < sizeof(Elf64_Ehdr))
+        error("link: %s: Not an x86-64 relocatable object\n", name);
+
+    obj->ehdr = at(obj, 0, sizeof(Elf64_Ehdr));
+    if (memcmp(obj->ehdr->e_ident, ELFMAG, SELFMAG) || obj->ehdr->e_ident[EI_CLASS] != ELFCLASS64
+            || obj->ehdr->e_type != ET_REL || obj->ehdr->e_machine != EM_X86_64)
+        error("link: %s: Not an x86-64 relocatable object\n", name);
+
+    // Indices are checked here once, everything after uses them as they are
+    size_t shstrsize, strsize = 0;
+    obj->sectcnt = obj->ehdr->e_shnum;
+    obj->shdrs = at(obj, obj->ehdr->e_shoff, obj->sectcnt * sizeof(Elf64_Shdr));
+    obj->shstrtab = strsect(obj, obj->ehdr->e_shstrndx, &shstrsize);
+
+    obj->sects = calloc(obj->sectcnt, sizeof(struct insect));
+    for (size_t i = 0; i < obj->sectcnt; i++)
+    {
+        Elf64_Shdr *shdr = &obj->shdrs[i];
+        if (shdr->sh_name >= shstrsize) malformed(obj);
+
+        obj->sects[i] = (struct insect) {
+            .obj = obj,
+            .shdr = shdr,
+            .name = obj->shstrtab + shdr->sh_name
+        };
+    }
+
+    for (size_t i = 0; i < obj->sectcnt; i++)
+    {
+        Elf64_Shdr *shdr = &obj->shdrs[i];
+        if (shdr->sh_type == SHT_RELA)
+        {
+            if (shdr->sh_info >= obj->sectcnt) malformed(obj);
+            obj->sects[shdr->sh_info].rela = shdr;
+        }
+        else if (shdr->sh_type == SHT_SYMTAB)
+        {
+            obj->syms = sect_data(obj, shdr);
+            obj->symcnt = shdr->sh_size / sizeof(Elf64_Sym);
+            obj->strtab = strsect(obj, shdr->sh_link, &strsize);
+        }
+    }
+
+    // Symbols are in a section of this object, absolute or undefined. Globals
+    // can also be common, which add_symbols() reports. Extended indices
+    // (SHN_XINDEX) aren't supported
+    for (size_t i = 0; i < obj->symcnt; i++)
+    {
+        Elf64_Sym *sym = &obj->syms[i];
+        if (sym->st_name >= strsize) malformed(obj);
+        if (sym->st_shndx < obj->sectcnt) continue;
+
+        int reserved = ELF64_ST_TYPE(sym->st_info) != STT_SECTION && (sym->st_shndx == SHN_ABS
+                || (sym->st_shndx == SHN_COMMON && ELF64_ST_BIND(sym->st_info) != STB_LOCAL));
+        if (!reserved) malformed(obj);
+    }
+
+    return obj;
+}
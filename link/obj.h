@@ -0,0 +1,50 @@
+#pragma once
+
+#include <elf.h>
+#include <stdint.h>
+#include <stddef.h>
+
+struct object;
+struct outsect;
+struct gsym;
+
+// A section of an input object and where it goes in the output
+struct insect
+{
+    struct object *obj;
+    Elf64_Shdr *shdr;
+    const char *name;
+    Elf64_Shdr *rela;    // Its relocations, if any
+    struct outsect *out; // NULL if it isn't part of the output
+    uint64_t off;        // Offset into 'out'
+    int live;            // Reached from the entry, for --gc-sections
+    size_t order;        // Rank in the --symbol-ordering-file, 0 if not in it
+};
+
+// A relocatable object, mapped whole. Headers, symbols and relocations
+// point into 'buf'
+struct object
+{
+    const char *name;
+    size_t idx; // In g_objs
+    uint8_t *buf; // Read only
+    size_t size;
+
+    Elf64_Ehdr *ehdr;
+    Elf64_Shdr *shdrs;
+    struct insect *sects; // One per section header
+    size_t sectcnt;
+    const char *shstrtab;
+
+    Elf64_Sym *syms;
+    size_t symcnt;
+    const char *strtab;
+    struct gsym **gsyms; // Global each non-local symbol stands for
+    uint64_t *symaddrs;  // Final address of each symbol, once laid out
+    size_t locfirst, loccnt; // Its locals in the output .symtab
+};
+
+uint8_t *map_file(const char *path, size_t *size);
+struct object *read_object(const char *name, uint8_t *buf, size_t size);
+void *sect_data(struct object *obj, Elf64_Shdr *shdr);
+const char *sym_name(struct object *obj, Elf64_Sym *sym);
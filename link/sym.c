@@ -0,0 +1,140 @@
+#include "sym.h"
+#include "obj.h"
+#include "link.h"
+#include "decl.h"
+#include "lib.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static struct htab s_gsymtab; // Name -> global symbol
+static size_t s_gsymcap;
+
+struct gsym *findgsym(const char *name)
+{
+    return htab_get(&s_gsymtab, name);
+}
+
+static struct gsym *refgsym(const char *name)
+{
+    struct gsym *gsym = findgsym(name);
+    if (gsym) return gsym;
+
+    if (g_gsymcnt == s_gsymcap)
+    {
+        s_gsymcap = s_gsymcap ? s_gsymcap * 2 : 256;
+        g_gsyms = realloc(g_gsyms, s_gsymcap * sizeof(struct gsym*));
+    }
+
+    gsym = calloc(1, sizeof(struct gsym));
+    gsym->name = name;
+    g_gsyms[g_gsymcnt++] = gsym;
+    htab_put(&s_gsymtab, name, gsym);
+    return gsym;
+}
+
+// Enter the global symbols of 'obj'. A strong definition beats a weak one,
+// two strong ones are an error
+void add_symbols(struct object *obj)
+{
+    obj->gsyms = calloc(obj->symcnt, sizeof(struct gsym*));
+    for (size_t i = 1; i < obj->symcnt; i++)
+    {
+        Elf64_Sym *sym = &obj->syms[i];
+        int bind = ELF64_ST_BIND(sym->st_info);
+        if (bind == STB_LOCAL) continue;
+
+        struct gsym *gsym = obj->gsyms[i] = refgsym(sym_name(obj, sym));
+        if (sym->st_shndx == SHN_UNDEF)
+        {
+            if (bind != STB_WEAK) gsym->ref = 1;
+            continue;
+        }
+        if (sym->st_shndx == SHN_COMMON)
+            error("link: %s: Common symbol '%s' is not supported\n", obj->name, gsym->name);
+
+        if (!gsym->sym || (ELF64_ST_BIND(gsym->sym->st_info) == STB_WEAK && bind != STB_WEAK))
+        {
+            gsym->obj = obj;
+            gsym->sym = sym;
+        }
+        else if (bind != STB_WEAK && ELF64_ST_BIND(gsym->sym->st_info) != STB_WEAK)
+            error("link: Multiple definition of '%s' in %s and %s\n", gsym->name, gsym->obj->name, obj->name);
+    }
+}
+
+// Undefined weak references are allowed and end up as 0
+void check_undefined()
+{
+    for (size_t i = 0; i < g_objcnt; i++)
+    {
+        struct object *obj = g_objs[i];
+        for (size_t j = 1; j < obj->symcnt; j++)
+        {
+            Elf64_Sym *sym = &obj->syms[j];
+            if (sym->st_shndx != SHN_UNDEF || ELF64_ST_BIND(sym->st_info) != STB_GLOBAL) continue;
+
+            if (!obj->gsyms[j]->sym)
+                error("link: %s: Undefined reference to '%s'\n", obj->name, sym_name(obj, sym));
+        }
+    }
+}
+
+// The definition a reference through symbol 'idx' of 'obj' ends up at, which
+// is another object's for globals. NULL if it's an undefined weak
+static Elf64_Sym *definition(struct object **obj, size_t idx)
+{
+    Elf64_Sym *sym = &(*obj)->syms[idx];
+    if (ELF64_ST_BIND(sym->st_info) == STB_LOCAL) return sym;
+
+    struct gsym *gsym = (*obj)->gsyms[idx];
+    *obj = gsym->obj;
+    return gsym->sym;
+}
+
+// The input section 'sym' of 'obj' is in, NULL for absolute and undefined symbols
+static struct insect *defsect(struct object *obj, Elf64_Sym *sym)
+{
+    if (!sym || sym->st_shndx == SHN_ABS || sym->st_shndx == SHN_UNDEF) return NULL;
+    return &obj->sects[sym->st_shndx];
+}
+
+static uint64_t defaddr(struct object *obj, Elf64_Sym *sym)
+{
+    struct insect *sect = defsect(obj, sym);
+    if (!sect) return sym && sym->st_shndx == SHN_ABS ? sym->st_value : 0;
+    return sect->out ? sect->out->addr + sect->off + sym->st_value : 0;
+}
+
+// Input section a reference through symbol 'idx' of 'obj' lands in, NULL if none
+struct insect *symsect(struct object *obj, size_t idx)
+{
+    struct object *def = obj;
+    Elf64_Sym *sym = definition(&def, idx);
+    return defsect(def, sym);
+}
+
+// Final address of symbol 'idx' of 'obj', once sections are laid out
+uint64_t symaddr(struct object *obj, size_t idx)
+{
+    struct object *def = obj;
+    Elf64_Sym *sym = definition(&def, idx);
+
+    struct insect *sect = defsect(def, sym);
+    if (sect && !sect->out)
+        error("link: %s: Symbol '%s' is in discarded section %s\n", obj->name, sym_name(def, sym), sect->name);
+
+    return defaddr(def, sym);
+}
+
+// Look up every symbol of 'obj' once, so relocations only need an index
+void resolve_symbols(struct object *obj)
+{
+    obj->symaddrs = calloc(obj->symcnt, sizeof(uint64_t));
+    for (size_t i = 1; i < obj->symcnt; i++)
+    {
+        struct object *def = obj;
+        Elf64_Sym *sym = definition(&def, i);
+        obj->symaddrs[i] = defaddr(def, sym);
+    }
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <elf.h>
+#include <stdint.h>
+#include <stddef.h>
+
+struct object;
+struct insect;
+
+// A global symbol, defined by 'sym' of 'obj'. Both are NULL while undefined
+struct gsym
+{
+    const char *name;
+    struct object *obj;
+    Elf64_Sym *sym;
+    size_t outsym; // Index in the output .symtab, 0 if not in it
+    int ref;       // Some object needs it, not just weakly, so archives are searched for it
+};
+
+struct gsym *findgsym(const char *name);
+void add_symbols(struct object *obj);
+void check_undefined();
+struct insect *symsect(struct object *obj, size_t idx);
+uint64_t symaddr(struct object *obj, size_t idx);
+void resolve_symbols(struct object *obj);
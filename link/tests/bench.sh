@@ -0,0 +1,43 @@
+#!/bin/sh
+# Link time on generated objects that call into each other, single threaded
+# and on every core. Needs ../as built. Run from link/: tests/bench.sh [objects] [functions]
+
+n=${1:-64}
+m=${2:-2000}
+dir=${TMPDIR:-/tmp}/link-bench
+mkdir -p "$dir"
+
+for o in $(seq 0 $((n - 1))); do
+    awk -v o="$o" -v n="$n" -v m="$m" 'BEGIN {
+        print "    .section .text"
+        if (o == 0) print "    .global _start\n_start:\n    mov $60, %eax\n    xor %edi, %edi\n    syscall"
+        for (i = 0; i < m; i++) {
+            printf "    .global f%d_%d\nf%d_%d:\n", o, i, o, i
+            printf "    lea v%d_%d(%%rip), %%rax\n", (o + 1) % n, i
+            printf "    mov v%d_%d(%%rip), %%rbx\n", o, i
+            printf "    call $f%d_%d\n", (o + 7) % n, (i * 31) % m
+            printf "    call $f%d_%d\n", o, (i + 1) % m
+            print "    ret"
+        }
+        print "    .section .data"
+        for (i = 0; i < m; i++) printf "    .global v%d_%d\nv%d_%d:\n    .quad f%d_%d\n", o, i, o, i, (o + 3) % n, i
+    }' > "$dir/o$o.s"
+    ../as/dist/as "$dir/o$o.s" -o "$dir/o$o.o" > /dev/null
+done
+
+./dist/link -t -j 1 "$dir"/o*.o -o "$dir/a.out"
+./dist/link -t "$dir"/o*.o -o "$dir/a.out"
+
+# The same with everything but the first object in a library, pulled in through its index
+if command -v ar > /dev/null; then
+    rm -f "$dir/libo.a"
+    ar rcs "$dir/libo.a" $(ls "$dir"/o*.o | grep -v '/o0\.o$')
+    ./dist/link -t "$dir/o0.o" "$dir/libo.a" -o "$dir/lib.out"
+fi
+
+# Relink after one object grows a little, which --incremental patches in place
+rm -f "$dir/inc.out.state"
+./dist/link -t --incremental "$dir"/o*.o -o "$dir/inc.out"
+sed -i 's/^    \.section \.data$/    ret\n&/' "$dir/o5.s"
+../as/dist/as "$dir/o5.s" -o "$dir/o5.o" > /dev/null
+./dist/link -t --incremental "$dir"/o*.o -o "$dir/inc.out"
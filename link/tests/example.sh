@@ -0,0 +1,38 @@
+#!/bin/sh
+# Links start.o, main.o and util.o with libex.a (square, bump and unused) and
+# runs the result: _start calls main across objects, main and util keep
+# values in .bss, and only the members main needs come out of the archive.
+# main refers to unused only weakly, so its member stays out.
+# Needs ../as built. Run from link/: tests/example.sh
+
+src=tests/example
+dir=${TMPDIR:-/tmp}/link-example
+mkdir -p "$dir"
+
+for f in start main util square bump unused; do
+    ../as/dist/as "$src/$f.s" -o "$dir/$f.o" > /dev/null || exit 1
+done
+
+# main's reference to unused is weak, which mustn't pull unused.o in
+objcopy --weaken-symbol=unused "$dir/main.o" || exit 1
+
+rm -f "$dir/libex.a"
+ar rcs "$dir/libex.a" "$dir/square.o" "$dir/bump.o" "$dir/unused.o"
+
+./dist/link "$dir/start.o" "$dir/main.o" "$dir/util.o" "$dir/libex.a" -Map "$dir/ex.map" -o "$dir/ex" || exit 1
+
+# twice(5) = 10, square(10) = 100, bump() makes it 101, plus the 10 twice() left in .bss,
+# plus the address of unused, which stays 0
+"$dir/ex"
+status=$?
+if [ $status -ne 111 ]; then
+    echo "example: exit status $status, expected 111"
+    exit 1
+fi
+
+if grep -q unused "$dir/ex.map"; then
+    echo "example: unused.o was pulled out of the archive"
+    exit 1
+fi
+
+echo "example: ok"
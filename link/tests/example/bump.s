@@ -0,0 +1,7 @@
+    .section .text
+    .global bump
+bump:
+    mov counter(%rip), %rax
+    add $1, %rax
+    mov %rax, counter(%rip)
+    ret
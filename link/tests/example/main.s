@@ -0,0 +1,19 @@
+    .section .text
+    .global main
+main:
+    mov $5, %rdi
+    call $twice
+    mov %rax, %rdi
+    call $square
+    mov %rax, counter(%rip)
+    call $bump
+    mov counter(%rip), %rax
+    add last(%rip), %rax
+    mov $unused, %rcx
+    add %rcx, %rax
+    ret
+
+    .section .bss
+    .global counter
+counter:
+    .zero 8
@@ -0,0 +1,6 @@
+    .section .text
+    .global square
+square:
+    mov %rdi, %rax
+    imul %rdi, %rax
+    ret
@@ -0,0 +1,7 @@
+    .section .text
+    .global _start
+_start:
+    call $main
+    mov %eax, %edi
+    mov $60, %eax
+    syscall
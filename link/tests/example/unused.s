@@ -0,0 +1,4 @@
+    .section .text
+    .global unused
+unused:
+    ret
@@ -0,0 +1,12 @@
+    .section .text
+    .global twice
+twice:
+    mov %rdi, %rax
+    add %rdi, %rax
+    mov %rax, last(%rip)
+    ret
+
+    .section .bss
+    .global last
+last:
+    .zero 8